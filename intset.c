@@ -8,36 +8,618 @@
  ******************************************************************************/
 
 #include "postgres.h"
+
+#include <math.h>
+
 #include "fmgr.h"
+#include "funcapi.h"
+#include "access/gin.h"
+#include "access/gist.h"
+#include "access/htup_details.h"
+#include "access/stratnum.h"
+#include "catalog/pg_operator.h"
+#include "catalog/pg_statistic.h"
+#include "catalog/pg_type.h"
+#include "commands/vacuum.h"
+#include "lib/hyperloglog.h"
 #include "libpq/pqformat.h"		/* needed for send/recv functions */
+#include "mb/pg_wchar.h"
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "nodes/supportnodes.h"
+#include "port/pg_bitutils.h"
+#include "utils/array.h"
+#include "utils/expandeddatum.h"
+#include "utils/guc.h"
+#include "utils/hashutils.h"
+#include "utils/hsearch.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/selfuncs.h"
+#include "utils/sortsupport.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define INTSET_USE_X86_SIMD
+#include <immintrin.h>
+#endif
 
 PG_MODULE_MAGIC;
 
+/*
+ * Size ratio from which intersection and difference stop merging and
+ * gallop through the larger set instead, 0 disables galloping
+ */
+static int	gallop_ratio = 32;
+
+/*
+ * Use the portable set kernels even when the CPU supports vector ones,
+ * meant for A/B testing the SIMD code paths
+ */
+static bool force_scalar = false;
+
+/*
+ * Jaccard index from which the % operator calls two sets similar
+ */
+static double similarity_threshold = 0.3;
+
+typedef enum SetOperation
+{
+	SET_INTERSECTION,
+	SET_UNION,
+	SET_DIFFERENCE,
+	SET_DISJUNCTION
+} SetOperation;
+
+/*
+ * Merge kernels for sorted, duplicate free int32 arrays. One table exists
+ * per instruction set, and the best one the CPU supports is picked by
+ * choose_set_kernels when the library is loaded.
+ *
+ * Kernels producing an array may write up to INTSET_KERNEL_SLACK numbers
+ * past the end of their result, since vector stores always write whole
+ * registers.
+ */
+typedef struct SetKernels
+{
+	const char *name;
+	int32		(*intersection) (int32 *dataA, int32 sizeA, int32 *dataB, int32 sizeB, int32 *result);
+	int32		(*intersection_count) (int32 *dataA, int32 sizeA, int32 *dataB, int32 sizeB);
+	int32		(*set_union) (int32 *dataA, int32 sizeA, int32 *dataB, int32 sizeB, int32 *result);
+	int32		(*difference) (int32 *dataA, int32 sizeA, int32 *dataB, int32 sizeB, int32 *result);
+	bool		(*subset) (int32 *dataA, int32 sizeA, int32 *dataB, int32 sizeB);
+	void		(*unpack_block) (uint32 *words, int32 width, int32 first, int32 *result);
+	int32		(*bitmap_operation) (uint64 *wordsA, uint64 *wordsB, SetOperation op, uint64 *result, int32 *runs);
+} SetKernels;
+
+#define INTSET_KERNEL_SLACK 16
+
+static const SetKernels *set_kernels = NULL;
+
 typedef struct IntSet
 {
 	int32		length;                         // struct length
-	int32		size;	                        // array size
+	uint32		header;                         // number of elements and layout of data, see INTSET_SIZE
 	int32		data[FLEXIBLE_ARRAY_MEMBER];    // actual length of the data part is not specified
 } IntSet;
 
+#define DatumGetIntSetP(X)		((IntSet *) PG_DETOAST_DATUM(X))
+#define PG_GETARG_INTSET_P(n)	DatumGetIntSetP(PG_GETARG_DATUM(n))
+
+/*
+ * INTSET_FORMAT_ARRAY keeps the sorted numbers as a plain array.
+ * INTSET_FORMAT_PACKED cuts them into blocks of INTSET_BLOCK_SIZE numbers:
+ * data holds one IntSetBlock header per block, followed by the bit-packed
+ * gaps of every block. See the packed format section for the details.
+ * INTSET_FORMAT_ROARING splits them into chunks by their upper 16 bits:
+ * data holds the number of chunks and a pad word, one RoaringChunk header
+ * per chunk and the containers. See the roaring format section for the
+ * details.
+ *
+ * The format is kept in the top bits of the header word, below which is
+ * the number of elements. Sets stored before there were formats hold
+ * their size in that word, directly followed by the sorted numbers, so
+ * they read as array sets.
+ */
+#define INTSET_FORMAT_ARRAY		0
+#define INTSET_FORMAT_PACKED	1
+#define INTSET_FORMAT_ROARING	2
+
+#define INTSET_FORMAT_SHIFT		30
+#define INTSET_MAX_SIZE			((int32) ((1U << INTSET_FORMAT_SHIFT) - 1))
+#define INTSET_SIZE(intSet)		((int32) ((intSet)->header & INTSET_MAX_SIZE))
+#define INTSET_FORMAT(intSet)	((int32) ((intSet)->header >> INTSET_FORMAT_SHIFT))
+#define SET_INTSET_HEADER(intSet, size, format) \
+	((intSet)->header = (uint32) (size) | ((uint32) (format) << INTSET_FORMAT_SHIFT))
+
+#define INTSET_HEADER_SIZE	offsetof(IntSet, data)
+#define INTSET_BLOCK_SIZE	128
+#define INTSET_NBLOCKS(size) (((size) + INTSET_BLOCK_SIZE - 1) / INTSET_BLOCK_SIZE)
+#define INTSET_BLOCKS(intSet) ((IntSetBlock *) (intSet)->data)
+// most numbers a set can be built from, as limited by palloc
+#define INTSET_MAX_NUMBERS	((int32) ((MaxAllocSize - INTSET_HEADER_SIZE) / sizeof(int32)) - INTSET_KERNEL_SLACK)
+
+typedef struct IntSetBlock
+{
+	int32		first;          // smallest number of the block
+	int32		last;           // largest number of the block
+	int32		offset;         // start of the packed gaps, in words after the headers
+	int32		width;          // bits per packed gap
+} IntSetBlock;
+
+typedef struct RoaringChunk
+{
+	uint16		key;            // upper 16 bits of the numbers, sign flipped
+	uint16		type;           // container type, one of ROARING_*
+	int32		cardinality;    // number of elements
+	int32		runs;           // number of runs of consecutive numbers
+	int32		offset;         // start of the container, in bytes after the headers
+} RoaringChunk;
+
+#define ROARING_ARRAY	0       // sorted uint16 lower bits
+#define ROARING_BITMAP	1       // ROARING_BITMAP_WORDS words, one bit per number
+#define ROARING_RUN		2       // uint16 pairs of run start and length - 1
+
+#define ROARING_BITMAP_WORDS	1024
+#define ROARING_MAX_ARRAY		4096
+#define ROARING_HEADER_SIZE		(2 * sizeof(int32))    // chunk count and a pad word, aligning the containers
+#define ROARING_NCHUNKS(intSet) ((intSet)->data[0])
+#define ROARING_CHUNKS(intSet) ((RoaringChunk *) &(intSet)->data[2])
+#define ROARING_CONTAINERS(intSet) ((char *) &ROARING_CHUNKS(intSet)[ROARING_NCHUNKS(intSet)])
+#define ROARING_CONTAINER(intSet, chunk) (ROARING_CONTAINERS(intSet) + (chunk)->offset)
+
+/*
+ * Collects the chunks of a roaring set built in key order
+ */
+typedef struct RoaringBuilder
+{
+	RoaringChunk *chunks;
+	int32		nchunks;
+	int64		cardinality;
+	char	   *containers;
+	Size		used;           // bytes of containers written
+	Size		allocated;      // bytes of containers allocated
+} RoaringBuilder;
+
+/*
+ * Buffers for combining one pair of containers
+ */
+typedef struct RoaringScratch
+{
+	uint64		wordsA[ROARING_BITMAP_WORDS];
+	uint64		wordsB[ROARING_BITMAP_WORDS];
+	uint64		words[ROARING_BITMAP_WORDS];
+	int32		lowsA[ROARING_MAX_ARRAY + INTSET_KERNEL_SLACK];
+	int32		lowsB[ROARING_MAX_ARRAY + INTSET_KERNEL_SLACK];
+	int32		lows[2 * ROARING_MAX_ARRAY + INTSET_KERNEL_SLACK];
+} RoaringScratch;
+
+/*
+ * Walks an intset one block at a time. Array-format sets are cut into
+ * blocks of the same size so both formats can be processed alike; their
+ * blocks are read in place, packed ones are unpacked into buffer.
+ */
+typedef struct BlockReader
+{
+	IntSet	   *intSet;
+	int32		current;        // block held in buffer, -1 if none
+	int32		buffer[INTSET_BLOCK_SIZE + INTSET_KERNEL_SLACK];
+} BlockReader;
+
+/*
+ * In-memory form of an intset that is being built up, as done by || on
+ * PL/pgSQL variables and aggregate states. Numbers are added to an
+ * unsorted tail, which is sorted and merged into the head only when the
+ * set is read or flattened.
+ */
+typedef struct ExpandedIntSet
+{
+	ExpandedObjectHeader hdr;
+	int			ei_magic;       // INTSET_EXPANDED_MAGIC
+	int32	   *numbers;        // sorted, duplicate free head, then the tail
+	int32		sorted;         // length of the head
+	int32		count;          // length of head and tail
+	int32		allocated;      // numbers allocated, not counting the kernel slack
+	IntSet	   *flat;           // flat form, built by expanded_flat_size, NULL if stale
+} ExpandedIntSet;
+
+#define INTSET_EXPANDED_MAGIC 0x1a5e7
+
+/*
+ * Transition state of intset_union_agg and intset_intersect_agg, kept in
+ * the aggregate context. Union states append every input to an unsorted
+ * tail, which is merged into the head once it outgrows it, and switch to
+ * a bitmap while the set is dense. Intersection states only have a head,
+ * and no numbers at all until their first input.
+ */
+typedef struct IntSetAggState
+{
+	int32	   *numbers;        // sorted, duplicate free head, then the tail
+	int32		sorted;         // length of the head
+	int32		count;          // length of head and tail, or bits set in bitmap
+	int32		allocated;      // numbers allocated, not counting the kernel slack
+	uint64	   *bitmap;         // one bit per number from base, NULL unless dense
+	int64		base;           // number of the first bit, a multiple of 64
+	int32		nwords;
+} IntSetAggState;
+
+// unsorted numbers a union state takes before merging, whatever its size
+#define INTSET_AGG_MIN_TAIL		4096
+
+/*
+ * Position in a set read in order, as by intset_elements and the n-way
+ * union. Array and packed sets are read one block at a time, roaring ones
+ * one chunk at a time.
+ */
+typedef struct IntSetElements
+{
+	BlockReader reader;
+	int32	   *numbers;        // numbers of the current block or chunk
+	int32		count;          // numbers in it
+	int32		pos;            // next one to return
+	int32		next;           // block or chunk to read after it
+	int32	   *chunk;          // decoded roaring chunk, NULL for other formats
+} IntSetElements;
+
+// elements assumed for a set there are no statistics about, as for arrays
+#define INTSET_DEFAULT_ELEMENTS	10
+
+/*
+ * Constant set argument of an operator, prepared on the first call and
+ * kept in fn_extra for the following rows: detoasted, unpacked to the
+ * array format, and laid out again in Eytzinger order for probing.
+ */
+typedef struct IntSetProbe
+{
+	int			argno;          // argument it was built from
+	Datum		datum;          // and the value it had
+	IntSet	   *intSet;         // that value in the array format
+	int32	   *layout;         // its numbers in Eytzinger order, from 1
+} IntSetProbe;
+
+// largest constant set offered to a B-tree as = ANY(array), larger ones
+// become a range
+#define INTSET_INDEX_MAX_KEYS	1024
+
+/*
+ * GiST index key. Leaf sets of up to INTSET_GIST_MAX_ARRAY numbers keep
+ * their numbers and are matched exactly; larger sets and internal nodes
+ * hash every number to one bit of an INTSET_SIGLEN byte signature. A
+ * signature with every bit set is stored without its words.
+ */
+typedef struct IntSetSignature
+{
+	int32		length;                         // struct length
+	int32		flag;                           // kind of key, one of INTSET_GIST_*
+	int32		data[FLEXIBLE_ARRAY_MEMBER];    // sorted numbers or signature words
+} IntSetSignature;
+
+#define INTSET_GIST_ARRAY		0
+#define INTSET_GIST_SIGNATURE	1
+#define INTSET_GIST_ALLTRUE		2
+
+// signature bytes, a multiple of 8, changing it requires a REINDEX
+#define INTSET_SIGLEN			256
+#define INTSET_SIGLEN_BITS		(INTSET_SIGLEN * BITS_PER_BYTE)
+#define INTSET_SIGLEN_WORDS		(INTSET_SIGLEN / sizeof(uint64))
+#define INTSET_GIST_MAX_ARRAY	((int32) (INTSET_SIGLEN / sizeof(int32)))
+
+#define INTSET_GIST_HEADER_SIZE	offsetof(IntSetSignature, data)
+#define INTSET_GIST_SIZE(key)	((int32) ((VARSIZE(key) - INTSET_GIST_HEADER_SIZE) / sizeof(int32)))
+#define INTSET_GIST_WORDS(key)	((uint64 *) (key)->data)
+#define DatumGetIntSetSignatureP(X)	((IntSetSignature *) PG_DETOAST_DATUM(X))
+
+/*
+ * Entry of a GiST page being split, with how much more it pulls towards
+ * one seed than the other
+ */
+typedef struct SplitCost
+{
+	OffsetNumber pos;
+	int32		cost;
+} SplitCost;
+
+/*
+ * Sort support state, counting the distinct abbreviated keys so that the
+ * abbreviation can be given up when they tell too few sets apart
+ */
+typedef struct IntSetSortSupport
+{
+	int64		inputCount;     // keys abbreviated so far
+	bool		estimating;     // still deciding whether to abort
+	hyperLogLogState abbrCard;  // cardinality of the abbreviated keys
+} IntSetSortSupport;
+
+/*
+ * Element tracked by the lossy counting of ANALYZE, see compute_intset_stats
+ */
+typedef struct ElementCount
+{
+	int32		element;
+	int32		frequency;      // sets seen containing the element
+	int32		delta;          // most it may have been undercounted by
+} ElementCount;
+
+/*
+ * Standard typanalyze results kept by intset_typanalyze, whose scalar
+ * statistics are computed before the element ones
+ */
+typedef struct IntSetAnalyzeData
+{
+	AnalyzeAttrComputeStatsFunc stdComputeStats;
+	void	   *stdExtraData;
+} IntSetAnalyzeData;
+
+/*
+ * Element statistics of an intset column, as read by the selectivity
+ * estimators: the most common elements with the fraction of sets holding
+ * each, and the histogram of set sizes
+ */
+typedef struct IntSetStats
+{
+	float4		nullfrac;
+	Datum	   *elements;       // most common elements, sorted
+	float4	   *freqs;          // fraction of non-null sets holding each
+	int32		nelements;
+	float4		otherFreq;      // fraction assumed for any other element
+	float4	   *hist;           // equi-depth bounds of the set sizes
+	int32		nhist;
+	float4		avgSize;
+	AttStatsSlot mcelem;
+	AttStatsSlot dechist;
+} IntSetStats;
+
+#define INTSET_DEFAULT_SEL	0.005
+
+/*
+ * Set of 64-bit integers. The sorted numbers are stored as offsets from
+ * base, width bytes each, see make_bigintset
+ */
+typedef struct BigIntSet
+{
+	int32		length;                         // struct length
+	int32		size;	                        // number of elements
+	int32		width;                          // bytes per element: 2, 4 or 8
+	int32		padding;                        // zero, keeps base aligned
+	int64		base;                           // smallest number, 0 for width 8
+	char		data[FLEXIBLE_ARRAY_MEMBER];    // uint16, uint32 or int64 elements
+} BigIntSet;
+
+#define DatumGetBigIntSetP(X)		((BigIntSet *) PG_DETOAST_DATUM(X))
+#define PG_GETARG_BIGINTSET_P(n)	DatumGetBigIntSetP(PG_GETARG_DATUM(n))
+
+#define BIGINTSET_HEADER_SIZE	offsetof(BigIntSet, data)
+#define BIGINTSET_MAX_NUMBERS	((int32) ((MaxAllocSize - BIGINTSET_HEADER_SIZE) / sizeof(int64)))
+
 /*****************************************************************************
  * Helper functions declaration
  *****************************************************************************/
-// bool is_valid_input(char *str);
-bool is_valid_input(char *str, char **newNumList); 
-int32 get_num_length(int32 num);
-int32 *get_data(char *numList, int32 *size); 
-// int32 *get_data(char *str, int32 *size);
-char *to_string(int32 *data, int32 size); 
-int32 find_insert_pos(int32 *data, int32 target, int32 size);
-bool num_exist(int32 *data, int32 target, int32 size);
-int32 *insert_num(int32 *data, int32 size, int32 num, int32 pos);
+IntSet *parse_intset(char *str);
+void report_syntax_error(const char *type, char *str, char *pos) pg_attribute_noreturn();
+int compare_int32(const void *a, const void *b);
+void sort_numbers(int32 *data, int32 size);
+bool use_galloping(const char *op, int32 sizeA, int32 sizeB);
 bool is_subset(int32 *dataA, int32 sizeA, int32 *dataB, int32 sizeB);
 bool is_equal(int32 *dataA, int32 sizeA, int32 *dataB, int32 sizeB);
-int32 *get_intersection(int32 *dataA, int32 sizeA, int32 *dataB, int32 sizeB, int32 *newSize);
-int32 *get_union(int32 *dataA, int32 sizeA, int32 *dataB, int32 sizeB, int32 *newSize);
-int32 *get_disjunction(int32 *dataA, int32 sizeA, int32 *dataB, int32 sizeB, int32 *newSize);
-int32 *get_difference(int32 *dataA, int32 sizeA, int32 *dataB, int32 sizeB, int32 *newSize);
+IntSet *new_intset(int32 maxSize);
+void set_intset_size(IntSet *intSet, int32 size);
+ExpandedIntSet *expand_intset(Datum intSetDatum, MemoryContext parentContext);
+ExpandedIntSet *get_expanded(Datum intSetDatum);
+void add_numbers(ExpandedIntSet *eis, int32 *data, int32 size);
+void sort_expanded(ExpandedIntSet *eis);
+IntSetAggState *new_agg_state(MemoryContext context, int32 *data, int32 size);
+IntSetAggState *copy_agg_state(MemoryContext context, IntSetAggState *state);
+void agg_add_numbers(IntSetAggState *state, int32 *data, int32 size);
+void flush_agg_state(IntSetAggState *state);
+void agg_array_to_bitmap(IntSetAggState *state);
+bool extend_agg_bitmap(IntSetAggState *state, int32 first, int32 last, int32 size);
+void agg_bitmap_to_array(IntSetAggState *state);
+void agg_intersect(IntSetAggState *state, IntSet *intSet);
+void agg_intersect_numbers(IntSetAggState *state, int32 *data, int32 size);
+int32 *agg_numbers(IntSetAggState *state);
+IntSet *agg_state_intset(IntSetAggState *state);
+void init_elements(IntSetElements *state, IntSet *intSet);
+bool next_elements(IntSetElements *state);
+void sift_elements(IntSetElements *inputs, int32 *heap, int32 size, int32 i);
+int32 variadic_intsets(ArrayType *array, IntSet ***sets);
+int compare_intset_size(const void *a, const void *b);
+bool arg_is_const(FmgrInfo *flinfo, int argno);
+IntSetProbe *get_probe(FunctionCallInfo fcinfo, int argno);
+int32 eytzinger_fill(int32 *numbers, int32 *layout, int32 size, int32 pos, int32 node);
+bool probe_has(IntSetProbe *probe, int32 num);
+bool probe_is_subset(IntSetProbe *probe, IntSet *intSet);
+int element_set_argno(List *args);
+List *element_index_quals(SupportRequestIndexCondition *req, Node *key, Datum intSetDatum);
+Expr *index_comparison(Oid opfamily, Node *key, StrategyNumber strategy, int32 num);
+int32 *array_numbers(ArrayType *array, int32 *size);
+bool numbers_ascending(int32 *data, int32 size);
+bool intset_has_numbers(IntSet *intSet, int32 *data, int32 size, bool all);
+BigIntSet *parse_bigintset(char *str);
+int compare_int64(const void *a, const void *b);
+BigIntSet *make_bigintset(int64 *data, int32 size);
+int64 bigintset_number(BigIntSet *bigSet, int32 i);
+int64 *bigintset_numbers(BigIntSet *bigSet);
+bool bigintset_bound(Datum bigSetDatum, bool last, int64 *result);
+bool bigintset_has(BigIntSet *bigSet, int64 num);
+bool bigintset_is_subset(BigIntSet *setA, BigIntSet *setB);
+bool bigintset_overlaps(BigIntSet *setA, BigIntSet *setB);
+bool bigintset_is_equal(BigIntSet *setA, BigIntSet *setB);
+int32 bigintset_compare(BigIntSet *setA, BigIntSet *setB);
+BigIntSet *bigintset_operation(BigIntSet *setA, BigIntSet *setB, SetOperation op);
+Size expanded_flat_size(ExpandedObjectHeader *eohptr);
+void expanded_flatten_into(ExpandedObjectHeader *eohptr, void *result, Size allocatedSize);
+void read_intset_slice(Datum intSetDatum, Size offset, Size length, void *result);
+bool intset_bound(Datum intSetDatum, bool last, int32 *result);
+uint32 container_bound(Datum intSetDatum, RoaringChunk *chunk, Size start, bool last);
+IntSet *compress_intset(IntSet *intSet);
+IntSet *compressed_form(IntSet *intSet);
+IntSet *pack_intset(int32 *data, int32 size);
+int32 pack_block(int32 *data, int32 count, uint32 *words);
+int32 *intset_numbers(IntSet *intSet);
+void init_block_reader(BlockReader *reader, IntSet *intSet);
+int32 block_count(IntSet *intSet, int32 block);
+int32 block_first(IntSet *intSet, int32 block);
+int32 block_last(IntSet *intSet, int32 block);
+int32 *read_block(BlockReader *reader, int32 block);
+int32 find_block(IntSet *intSet, int32 from, int32 target);
+bool probe_number(BlockReader *reader, int32 *block, int32 num);
+bool intset_has(IntSet *intSet, int32 num);
+bool datum_has(Datum intSetDatum, int32 num);
+bool intset_is_subset(IntSet *setA, IntSet *setB);
+bool intset_is_equal(IntSet *setA, IntSet *setB);
+int32 intset_intersection(IntSet *setA, IntSet *setB, int32 *result);
+int32 count_intersection(IntSet *setA, IntSet *setB);
+double jaccard_index(int32 common, int32 sizeA, int32 sizeB);
+int32 intset_difference(IntSet *setA, IntSet *setB, int32 *result);
+bool intset_overlaps(IntSet *setA, IntSet *setB);
+int32 intset_compare(IntSet *setA, IntSet *setB);
+int32 compare_elements(IntSet *setA, IntSet *setB);
+int32 intset_prefix(IntSet *intSet, int32 count, int32 *result);
+int intset_fastcmp(Datum x, Datum y, SortSupport ssup);
+int intset_abbrev_cmp(Datum x, Datum y, SortSupport ssup);
+Datum intset_abbrev_convert(Datum original, SortSupport ssup);
+bool intset_abbrev_abort(int memtupcount, SortSupport ssup);
+void compute_intset_stats(VacAttrStats *stats, AnalyzeAttrFetchFunc fetchfunc, int samplerows,
+                          double totalrows);
+void prune_element_counts(HTAB *table, int32 bucket);
+int compare_element_frequency(const void *a, const void *b);
+bool load_intset_stats(VariableStatData *vardata, IntSetStats *stats);
+void free_intset_stats(IntSetStats *stats);
+float4 element_freq(IntSetStats *stats, int32 num);
+double expected_power(IntSetStats *stats, double p);
+double estimate_intset_size(PlannerInfo *root, Node *node);
+Selectivity set_selectivity(IntSetStats *stats, StrategyNumber strategy, Datum query);
+Selectivity number_in_set_selectivity(VariableStatData *vardata, IntSet *intSet);
+Selectivity set_join_selectivity(IntSetStats *sets, IntSetStats *queries, bool overlap);
+Selectivity number_join_selectivity(VariableStatData *vardata, IntSetStats *sets);
+float8 intset_restriction_sel(PlannerInfo *root, List *args, int varRelid, StrategyNumber strategy);
+float8 intset_join_sel(PlannerInfo *root, List *args, SpecialJoinInfo *sjinfo, StrategyNumber strategy);
+IntSetSignature *new_gist_key(int32 flag, int32 size);
+IntSetSignature *make_gist_key(int32 *data, int32 size);
+IntSetSignature *finish_signature(IntSetSignature *key);
+uint32 signature_bit(int32 num);
+void sign_numbers(uint64 *words, int32 *data, int32 size);
+void merge_signature(uint64 *words, IntSetSignature *key);
+uint64 *key_words(IntSetSignature *key, uint64 *buffer);
+bool signature_has_all(uint64 *words, int32 *data, int32 size);
+bool signature_has_any(uint64 *words, int32 *data, int32 size);
+double key_similarity(IntSetSignature *key, bool leaf, int32 *data, int32 size);
+int32 words_distance(uint64 *wordsA, uint64 *wordsB);
+int32 signature_distance(IntSetSignature *keyA, IntSetSignature *keyB);
+int compare_split_cost(const void *a, const void *b);
+uint32 roaring_key(int32 num);
+int32 roaring_number(uint32 key, uint32 low);
+Size container_size(int32 cardinality, int32 runs, uint16 *type);
+Size roaring_size(int32 *data, int32 size);
+void init_roaring_builder(RoaringBuilder *builder, int32 maxChunks);
+char *add_container(RoaringBuilder *builder, uint32 key, int32 cardinality, int32 runs, uint16 *type);
+void emit_numbers(RoaringBuilder *builder, uint32 key, int32 *lows, int32 count);
+void emit_bitmap(RoaringBuilder *builder, uint32 key, uint64 *words, int32 cardinality, int32 runs);
+void emit_container(RoaringBuilder *builder, IntSet *intSet, RoaringChunk *chunk);
+IntSet *build_roaring(RoaringBuilder *builder);
+IntSet *finish_roaring(RoaringBuilder *builder);
+IntSet *make_roaring(int32 *data, int32 size);
+IntSet *as_roaring(IntSet *intSet);
+int32 roaring_decode(RoaringChunk *chunks, int32 nchunks, char *containers, int32 *result);
+int32 container_numbers(RoaringChunk *chunk, char *container, int32 *lows);
+int32 container_prefix(RoaringChunk *chunk, char *container, int32 count, int32 *lows);
+bool same_container(IntSet *setA, RoaringChunk *chunkA, IntSet *setB, RoaringChunk *chunkB);
+uint64 *container_words(RoaringChunk *chunk, char *container, uint64 *buffer);
+bool container_has(RoaringChunk *chunk, char *container, uint32 low);
+bool container_subset(IntSet *setA, RoaringChunk *chunkA, IntSet *setB, RoaringChunk *chunkB,
+                      RoaringScratch *scratch);
+void combine_containers(RoaringBuilder *builder, RoaringScratch *scratch, SetOperation op,
+                        IntSet *setA, RoaringChunk *chunkA, IntSet *setB, RoaringChunk *chunkB);
+bool roaring_has(IntSet *intSet, int32 num);
+bool roaring_is_subset(IntSet *setA, IntSet *setB);
+int32 roaring_intersection_count(IntSet *setA, IntSet *setB);
+int32 container_intersection_count(IntSet *setA, RoaringChunk *chunkA, IntSet *setB, RoaringChunk *chunkB);
+IntSet *roaring_operation(IntSet *setA, IntSet *setB, SetOperation op);
+int32 get_intersection(int32 *dataA, int32 sizeA, int32 *dataB, int32 sizeB, int32 *result);
+int32 get_intersection_count(int32 *dataA, int32 sizeA, int32 *dataB, int32 sizeB);
+int32 get_union(int32 *dataA, int32 sizeA, int32 *dataB, int32 sizeB, int32 *result);
+int32 get_difference(int32 *dataA, int32 sizeA, int32 *dataB, int32 sizeB, int32 *result);
+void scalar_unpack_block(uint32 *words, int32 width, int32 first, int32 *result);
+int32 scalar_bitmap_operation(uint64 *wordsA, uint64 *wordsB, SetOperation op, uint64 *result, int32 *runs);
+void choose_set_kernels(void);
+const SetKernels *current_set_kernels(void);
+
+void _PG_init(void);
+
+/*****************************************************************************
+ * Sorted array kernels
+ *
+ * The scalar merges and searches come from intset_kernels.h, once per
+ * element type: int32 for intSet, int64 for bigintset, and the uint16 and
+ * uint32 offsets of narrow bigintsets. The int32 merges are also the
+ * scalar entries of the set kernel tables. The two signed types also get
+ * their parsing, printing and varint wire format from there.
+ *****************************************************************************/
+
+#define KERNEL_TYPE int32
+#define KERNEL_NAME(name) name
+#define KERNEL_UNSIGNED uint32
+#define KERNEL_MAX PG_INT32_MAX
+#define KERNEL_SQL_TYPE "integer"
+#define KERNEL_SET_TYPE "intset"
+#include "intset_kernels.h"
+
+#define KERNEL_TYPE int64
+#define KERNEL_NAME(name) name##_int64
+#define KERNEL_UNSIGNED uint64
+#define KERNEL_MAX PG_INT64_MAX
+#define KERNEL_SQL_TYPE "bigint"
+#define KERNEL_SET_TYPE "bigintset"
+#include "intset_kernels.h"
+
+#define KERNEL_TYPE uint32
+#define KERNEL_NAME(name) name##_uint32
+#include "intset_kernels.h"
+
+#define KERNEL_TYPE uint16
+#define KERNEL_NAME(name) name##_uint16
+#include "intset_kernels.h"
+
+/*****************************************************************************
+ * Module load
+ *****************************************************************************/
+
+void
+_PG_init(void)
+{
+	DefineCustomIntVariable("intset.gallop_ratio",
+							"Size ratio from which intset intersection and difference use galloping search.",
+							"When the larger input has at least this many times the elements of the smaller "
+							"one, each element of the smaller input is located by exponential search. "
+							"Zero always uses a linear merge.",
+							&gallop_ratio,
+							32,
+							0, INT_MAX,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("intset.force_scalar",
+							 "Use the portable intset set kernels instead of SIMD ones.",
+							 NULL,
+							 &force_scalar,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomRealVariable("intset.similarity_threshold",
+							 "Sets the Jaccard index threshold used by the % operator.",
+							 NULL,
+							 &similarity_threshold,
+							 0.3,
+							 0.0,
+							 1.0,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+
+	choose_set_kernels();
+}
 
 /*****************************************************************************
  * Input/Output functions
@@ -50,31 +632,8 @@ Datum
 intset_in(PG_FUNCTION_ARGS)
 {
 	char	*str = PG_GETARG_CSTRING(0);
-	int32 	size = 0;       	// size of array
-	int32 	*data = NULL;   	// integer array
-	char	*numList = NULL;	// number of list separate by comma without curly braces
-    	IntSet	*result;  	      	// result of IntSet to be stored
-    	
-	
-   	// Input validation
-	if (!is_valid_input(str, &numList))
-		ereport(ERROR,
-			(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-				errmsg("invalid input syntax for type %s: \"%s\"",
-					"intset", str)));
-
-	// Get array of integer
-	data = get_data(numList, &size);
-	
-    	// Setup result
-	result = (IntSet *) malloc((size + 2) * sizeof(int32));
-	SET_VARSIZE(result, (size + 2) * sizeof(int32));
-
-	result->size = size;
-	memcpy(result->data, data, size * sizeof(int32));
-	free(numList);
-	free(data);
-	PG_RETURN_POINTER(result);
+
+	PG_RETURN_POINTER(parse_intset(str));
 }
 
 PG_FUNCTION_INFO_V1(intset_out);
@@ -82,12 +641,47 @@ PG_FUNCTION_INFO_V1(intset_out);
 Datum
 intset_out(PG_FUNCTION_ARGS)
 {
-	IntSet    *intSet = (IntSet *) PG_GETARG_POINTER(0);
+	IntSet    *intSet = PG_GETARG_INTSET_P(0);
 	char	  *result;
-	result = to_string(intSet->data, intSet->size);
+	result = to_string(intset_numbers(intSet), INTSET_SIZE(intSet));
 	PG_RETURN_CSTRING(result);
 }
 
+/*****************************************************************************
+ * Binary Input/Output functions
+ *
+ * The wire format is the element count as an int32 followed by one
+ * LEB128 varint per element: the first element zigzag encoded, then each
+ * gap to the previous element minus one. Sets of clustered numbers take
+ * about one byte per element, and recv gets sortedness for free since
+ * every gap is positive.
+ *****************************************************************************/
+
+PG_FUNCTION_INFO_V1(intset_recv);
+
+Datum
+intset_recv(PG_FUNCTION_ARGS)
+{
+	StringInfo	buf = (StringInfo) PG_GETARG_POINTER(0);
+	int32		size = recv_count(buf);
+	IntSet	   *result = new_intset(size);
+
+	recv_numbers(buf, result->data, size);
+	set_intset_size(result, size);
+
+	PG_RETURN_POINTER(compress_intset(result));
+}
+
+PG_FUNCTION_INFO_V1(intset_send);
+
+Datum
+intset_send(PG_FUNCTION_ARGS)
+{
+	IntSet	   *intSet = PG_GETARG_INTSET_P(0);
+
+	PG_RETURN_BYTEA_P(send_numbers(intset_numbers(intSet), INTSET_SIZE(intSet)));
+}
+
 /*****************************************************************************
  * New Operators
  *
@@ -100,23 +694,127 @@ Datum
 intset_contains(PG_FUNCTION_ARGS)
 {
 	int32	  num = PG_GETARG_INT32(0);
-	IntSet    *intSet = (IntSet *) PG_GETARG_POINTER(1);
-	int32	  *data = intSet->data;
-	int32 	  size = intSet->size;
-	bool 	  result = num_exist(data, num, size);
+	IntSetProbe *probe = get_probe(fcinfo, 1);
+	bool 	  result;
+
+	if (probe != NULL) PG_RETURN_BOOL(probe_has(probe, num));
+	result = datum_has(PG_GETARG_DATUM(1), num);
+
+	PG_RETURN_BOOL(result);
+}
+
+/*
+ * Same as intset_contains with the arguments swapped, so that ? can be
+ * commuted onto an indexed intset column
+ */
+PG_FUNCTION_INFO_V1(contains_element);
+
+Datum
+contains_element(PG_FUNCTION_ARGS)
+{
+	int32	  num = PG_GETARG_INT32(1);
+	IntSetProbe *probe = get_probe(fcinfo, 0);
+	bool 	  result;
+
+	if (probe != NULL) PG_RETURN_BOOL(probe_has(probe, num));
+	result = datum_has(PG_GETARG_DATUM(0), num);
 
 	PG_RETURN_BOOL(result);
 }
 
+/*
+ * Planner support for both ? functions, when the set is a constant:
+ * a single element set becomes a plain equality, and an index on the
+ * number is given = ANY(array) or a range to scan
+ */
+PG_FUNCTION_INFO_V1(intset_contains_support);
+
+Datum
+intset_contains_support(PG_FUNCTION_ARGS)
+{
+	Node	   *rawreq = (Node *) PG_GETARG_POINTER(0);
+	Node	   *ret = NULL;
+	List	   *args;
+	Node	   *set;
+	int			setArg;
+
+	if (IsA(rawreq, SupportRequestSimplify)) {
+		SupportRequestSimplify *req = (SupportRequestSimplify *) rawreq;
+		IntSet	   *intSet;
+
+		args = req->fcall->args;
+		setArg = element_set_argno(args);
+		set = (Node *) list_nth(args, setArg);
+		if (!IsA(set, Const) || ((Const *) set)->constisnull) PG_RETURN_POINTER(NULL);
+
+		intSet = DatumGetIntSetP(((Const *) set)->constvalue);
+		if (INTSET_SIZE(intSet) == 1)
+			ret = (Node *) make_opclause(Int4EqualOperator, BOOLOID, false,
+										 (Expr *) list_nth(args, 1 - setArg),
+										 (Expr *) makeConst(INT4OID, -1, InvalidOid, sizeof(int32),
+															Int32GetDatum(intset_numbers(intSet)[0]),
+															false, true),
+										 InvalidOid, InvalidOid);
+	}
+	else if (IsA(rawreq, SupportRequestIndexCondition)) {
+		SupportRequestIndexCondition *req = (SupportRequestIndexCondition *) rawreq;
+
+		if (is_opclause(req->node)) args = ((OpExpr *) req->node)->args;
+		else if (is_funcclause(req->node)) args = ((FuncExpr *) req->node)->args;
+		else PG_RETURN_POINTER(NULL);
+
+		setArg = element_set_argno(args);
+		set = (Node *) list_nth(args, setArg);
+		if (req->indexarg != 1 - setArg || !IsA(set, Const) || ((Const *) set)->constisnull)
+			PG_RETURN_POINTER(NULL);
+
+		ret = (Node *) element_index_quals(req, (Node *) list_nth(args, 1 - setArg),
+										   ((Const *) set)->constvalue);
+	}
+
+	PG_RETURN_POINTER(ret);
+}
+
 
 PG_FUNCTION_INFO_V1(get_cardinality);
 
 Datum
 get_cardinality(PG_FUNCTION_ARGS)
 {
-	IntSet	  *intSet = (IntSet *) PG_GETARG_POINTER(0);
-	int32	  result = intSet->size;
+	ExpandedIntSet *eis = get_expanded(PG_GETARG_DATUM(0));
+	IntSet	  *intSet;
+	int32	  result;
+
+	if (eis != NULL) {
+		sort_expanded(eis);
+		PG_RETURN_INT32(eis->sorted);
+	}
+	// only the size is needed, so only the first TOAST chunk is fetched
+	intSet = (IntSet *) PG_DETOAST_DATUM_SLICE(PG_GETARG_DATUM(0), 0, sizeof(int32));
+	result = INTSET_SIZE(intSet);
+
+	PG_RETURN_INT32(result);
+}
+
+PG_FUNCTION_INFO_V1(intset_min);
+
+Datum
+intset_min(PG_FUNCTION_ARGS)
+{
+	int32	  result;
+
+	if (!intset_bound(PG_GETARG_DATUM(0), false, &result)) PG_RETURN_NULL();
+	PG_RETURN_INT32(result);
+}
+
+PG_FUNCTION_INFO_V1(intset_max);
+
+Datum
+intset_max(PG_FUNCTION_ARGS)
+{
+	int32	  result;
 
+	if (!intset_bound(PG_GETARG_DATUM(0), true, &result)) PG_RETURN_NULL();
 	PG_RETURN_INT32(result);
 }
 
@@ -125,11 +823,14 @@ PG_FUNCTION_INFO_V1(contains_all);
 Datum
 contains_all(PG_FUNCTION_ARGS)
 {
-	IntSet	  *setA = (IntSet *) PG_GETARG_POINTER(0);
-	IntSet	  *setB = (IntSet *) PG_GETARG_POINTER(1);
+	IntSetProbe *probe;
 
-	bool 	  result = is_subset(setA->data, setA->size, setB->data, setB->size);
-	PG_RETURN_BOOL(result);
+	if ((probe = get_probe(fcinfo, 0)) != NULL)
+		PG_RETURN_BOOL(probe_is_subset(probe, PG_GETARG_INTSET_P(1)));
+	if ((probe = get_probe(fcinfo, 1)) != NULL)
+		PG_RETURN_BOOL(intset_is_subset(PG_GETARG_INTSET_P(0), probe->intSet));
+
+	PG_RETURN_BOOL(intset_is_subset(PG_GETARG_INTSET_P(0), PG_GETARG_INTSET_P(1)));
 }
 
 PG_FUNCTION_INFO_V1(contains_only);
@@ -137,11 +838,14 @@ PG_FUNCTION_INFO_V1(contains_only);
 Datum
 contains_only(PG_FUNCTION_ARGS)
 {
-	IntSet	  *setA = (IntSet *) PG_GETARG_POINTER(0);
-	IntSet	  *setB = (IntSet *) PG_GETARG_POINTER(1);
+	IntSetProbe *probe;
 
-	bool 	  result = is_subset(setB->data, setB->size, setA->data, setA->size);
-	PG_RETURN_BOOL(result);
+	if ((probe = get_probe(fcinfo, 1)) != NULL)
+		PG_RETURN_BOOL(probe_is_subset(probe, PG_GETARG_INTSET_P(0)));
+	if ((probe = get_probe(fcinfo, 0)) != NULL)
+		PG_RETURN_BOOL(intset_is_subset(PG_GETARG_INTSET_P(1), probe->intSet));
+
+	PG_RETURN_BOOL(intset_is_subset(PG_GETARG_INTSET_P(1), PG_GETARG_INTSET_P(0)));
 }
 
 PG_FUNCTION_INFO_V1(equal);
@@ -149,10 +853,10 @@ PG_FUNCTION_INFO_V1(equal);
 Datum
 equal(PG_FUNCTION_ARGS)
 {
-	IntSet	  *setA = (IntSet *) PG_GETARG_POINTER(0);
-	IntSet	  *setB = (IntSet *) PG_GETARG_POINTER(1);
+	IntSet	  *setA = PG_GETARG_INTSET_P(0);
+	IntSet	  *setB = PG_GETARG_INTSET_P(1);
 
-	bool 	  result = is_equal(setB->data, setB->size, setA->data, setA->size);
+	bool 	  result = intset_is_equal(setA, setB);
 	PG_RETURN_BOOL(result);
 }
 
@@ -161,33 +865,44 @@ PG_FUNCTION_INFO_V1(not_equal);
 Datum
 not_equal(PG_FUNCTION_ARGS)
 {
-	IntSet	  *setA = (IntSet *) PG_GETARG_POINTER(0);
-	IntSet	  *setB = (IntSet *) PG_GETARG_POINTER(1);
+	IntSet	  *setA = PG_GETARG_INTSET_P(0);
+	IntSet	  *setB = PG_GETARG_INTSET_P(1);
 
-	bool 	  result = is_equal(setB->data, setB->size, setA->data, setA->size);
+	bool 	  result = intset_is_equal(setA, setB);
 	PG_RETURN_BOOL(!result);
 }
 
+PG_FUNCTION_INFO_V1(contains_any);
+
+Datum
+contains_any(PG_FUNCTION_ARGS)
+{
+	IntSet	  *setA = PG_GETARG_INTSET_P(0);
+	IntSet	  *setB = PG_GETARG_INTSET_P(1);
+
+	bool 	  result = intset_overlaps(setA, setB);
+	PG_RETURN_BOOL(result);
+}
+
 
 PG_FUNCTION_INFO_V1(intersection);
 
 Datum
 intersection(PG_FUNCTION_ARGS)
 {
-	IntSet	  *setA = (IntSet *) PG_GETARG_POINTER(0);
-	IntSet	  *setB = (IntSet *) PG_GETARG_POINTER(1);
-	int32     size = 0;
-	int32 	  *data;
+	IntSet	  *setA = PG_GETARG_INTSET_P(0);
+	IntSet	  *setB = PG_GETARG_INTSET_P(1);
+	int32     size;
 	IntSet	  *result;
 
-	data = get_intersection(setB->data, setB->size, setA->data, setA->size, &size);
+	if (INTSET_FORMAT(setA) == INTSET_FORMAT_ROARING || INTSET_FORMAT(setB) == INTSET_FORMAT_ROARING)
+		PG_RETURN_POINTER(roaring_operation(setA, setB, SET_INTERSECTION));
 
-	result = (IntSet *) malloc((size + 2) * sizeof(int32));
-	SET_VARSIZE(result, (size + 2) * sizeof(int32));
-	result->size = size;
-	memcpy(result->data, data, size * sizeof(int32));
+	result = new_intset(Min(INTSET_SIZE(setA), INTSET_SIZE(setB)));
+	size = intset_intersection(setA, setB, result->data);
+	set_intset_size(result, size);
 
-	PG_RETURN_POINTER(result);
+	PG_RETURN_POINTER(compress_intset(result));
 }
 
 PG_FUNCTION_INFO_V1(union_set);
@@ -195,20 +910,42 @@ PG_FUNCTION_INFO_V1(union_set);
 Datum
 union_set(PG_FUNCTION_ARGS)
 {
-	IntSet	  *setA = (IntSet *) PG_GETARG_POINTER(0);
-	IntSet	  *setB = (IntSet *) PG_GETARG_POINTER(1);
-	int32     size = 0;
-	int32 	  *data;
+	Datum	  datumA = PG_GETARG_DATUM(0);
+	IntSet	  *setA;
+	IntSet	  *setB = PG_GETARG_INTSET_P(1);
+	ExpandedIntSet *eis;
+	MemoryContext aggContext;
+	int32     size;
 	IntSet	  *result;
 
-	data = get_union(setA->data, setA->size, setB->data, setB->size, &size);
+	/*
+	 * Read-write expanded sets, which aggregates hand their transition
+	 * state as, grow in place. Any other call merges the two flat sets
+	 * directly, since expanding would cost a memory context and a copy of
+	 * setA for a result that is flattened right away.
+	 */
+	if (VARATT_IS_EXTERNAL_EXPANDED_RW(DatumGetPointer(datumA)))
+		eis = get_expanded(datumA);
+	else if (AggCheckCallContext(fcinfo, &aggContext))
+		eis = expand_intset(datumA, aggContext);
+	else
+		eis = NULL;
 
-	result = (IntSet *) malloc((size + 2) * sizeof(int32));
-	SET_VARSIZE(result, (size + 2) * sizeof(int32));
-	result->size = size;
-	memcpy(result->data, data, size * sizeof(int32));
+	if (eis != NULL) {
+		add_numbers(eis, intset_numbers(setB), INTSET_SIZE(setB));
+		PG_RETURN_DATUM(EOHPGetRWDatum(&eis->hdr));
+	}
 
-	PG_RETURN_POINTER(result);
+	setA = DatumGetIntSetP(datumA);
+	if (INTSET_FORMAT(setA) == INTSET_FORMAT_ROARING || INTSET_FORMAT(setB) == INTSET_FORMAT_ROARING)
+		PG_RETURN_POINTER(roaring_operation(setA, setB, SET_UNION));
+
+	result = new_intset(INTSET_SIZE(setA) + INTSET_SIZE(setB));
+	size = get_union(intset_numbers(setA), INTSET_SIZE(setA),
+							intset_numbers(setB), INTSET_SIZE(setB), result->data);
+	set_intset_size(result, size);
+
+	PG_RETURN_POINTER(compress_intset(result));
 }
 
 
@@ -217,20 +954,20 @@ PG_FUNCTION_INFO_V1(disjunction);
 Datum
 disjunction(PG_FUNCTION_ARGS)
 {
-	IntSet	  *setA = (IntSet *) PG_GETARG_POINTER(0);
-	IntSet	  *setB = (IntSet *) PG_GETARG_POINTER(1);
-	int32     size = 0;
-	int32 	  *data;
+	IntSet	  *setA = PG_GETARG_INTSET_P(0);
+	IntSet	  *setB = PG_GETARG_INTSET_P(1);
+	int32     size;
 	IntSet	  *result;
 
-	data = get_disjunction(setA->data, setA->size, setB->data, setB->size, &size);
+	if (INTSET_FORMAT(setA) == INTSET_FORMAT_ROARING || INTSET_FORMAT(setB) == INTSET_FORMAT_ROARING)
+		PG_RETURN_POINTER(roaring_operation(setA, setB, SET_DISJUNCTION));
 
-	result = (IntSet *) malloc((size + 2) * sizeof(int32));
-	SET_VARSIZE(result, (size + 2) * sizeof(int32));
-	result->size = size;
-	memcpy(result->data, data, size * sizeof(int32));
+	result = new_intset(INTSET_SIZE(setA) + INTSET_SIZE(setB));
+	size = get_disjunction(intset_numbers(setA), INTSET_SIZE(setA),
+							intset_numbers(setB), INTSET_SIZE(setB), result->data);
+	set_intset_size(result, size);
 
-	PG_RETURN_POINTER(result);
+	PG_RETURN_POINTER(compress_intset(result));
 }
 
 PG_FUNCTION_INFO_V1(difference);
@@ -238,326 +975,5639 @@ PG_FUNCTION_INFO_V1(difference);
 Datum
 difference(PG_FUNCTION_ARGS)
 {
-	IntSet	  *setA = (IntSet *) PG_GETARG_POINTER(0);
-	IntSet	  *setB = (IntSet *) PG_GETARG_POINTER(1);
-	int32     size = 0;
-	int32 	  *data;
+	IntSet	  *setA = PG_GETARG_INTSET_P(0);
+	IntSet	  *setB = PG_GETARG_INTSET_P(1);
+	int32     size;
 	IntSet	  *result;
 
-	data = get_difference(setA->data, setA->size, setB->data, setB->size, &size);
+	if (INTSET_FORMAT(setA) == INTSET_FORMAT_ROARING || INTSET_FORMAT(setB) == INTSET_FORMAT_ROARING)
+		PG_RETURN_POINTER(roaring_operation(setA, setB, SET_DIFFERENCE));
 
-	result = (IntSet *) malloc((size + 2) * sizeof(int32));
-	SET_VARSIZE(result, (size + 2) * sizeof(int32));
-	result->size = size;
-	memcpy(result->data, data, size * sizeof(int32));
+	result = new_intset(INTSET_SIZE(setA));
+	size = intset_difference(setA, setB, result->data);
+	set_intset_size(result, size);
 
-	PG_RETURN_POINTER(result);
+	PG_RETURN_POINTER(compress_intset(result));
 }
 
+/*
+ * Sizes of the intersection, union and difference, and the Jaccard
+ * index, all counted from the intersection without building any set
+ */
+PG_FUNCTION_INFO_V1(intset_intersection_count);
 
-/*****************************************************************************
- * Helper functions
- *****************************************************************************/
+Datum
+intset_intersection_count(PG_FUNCTION_ARGS)
+{
+	IntSet	  *setA = PG_GETARG_INTSET_P(0);
+	IntSet	  *setB = PG_GETARG_INTSET_P(1);
 
-/*
- * Check if the input is valid
- */
-bool is_valid_input(char *str, char **newNumList) {
-	int i = 0, j = strlen(str) - 1, s = 0;
-	char *numList, *token, *listWithSpace;
-	bool onlySpace = false;
-	while (i < strlen(str) && isspace(str[i])) i++;
-	while (j >= 0 && isspace(str[j])) j--;
-	if (str[i] != '{' || str[j] != '}') return false;
-	i++;
-	j--;
-
-	listWithSpace = malloc((j - i  + 2) * sizeof(char));
-    	memcpy(listWithSpace, &str[i], j - i + 1);
-    	listWithSpace[j - i + 1] = '\0';
-
-	token = strtok(listWithSpace, ",");
-	while (token != NULL) {
-		// trim token
-		i = 0, j = strlen(token) - 1;
-		while (i < strlen(token) && isspace(token[i])) i++;
-		while (j >= 0 && isspace(token[j])) j--;
-		if (onlySpace) return false;
-		if (j == -1) {
-			onlySpace = true;
-		};
-		for (int x = i; x < j; x++) {
-			if (!isdigit(token[x])) return false;
-		}
-		token = strtok(NULL, ",");
-	}
-
-	// remove internal space
-	for (int x = 0;x < strlen(str); x++) {
-		if (str[x] != ' ') str[s++] = str[x];
-	}
-	str[s] = '\0';
-	if (strstr(str, ",,")) return false;
-	if (strcmp(str, "{}") == 0) return true;
-    
-   	// remove braces
-	numList = malloc((s - 1) * sizeof(char));
-	memcpy(numList, &str[1], s - 2);
-	numList[s - 2] = '\0';
-	
-	*newNumList = malloc(sizeof(char) * (s - 1));
-	strcpy(*newNumList, numList);
-
-	if (!isdigit(numList[0]) || !isdigit(numList[s - 3])) return false;
-
-	token = strtok(numList, ",");
-	while (token != NULL) {
-		printf("%s\n", token);
-		for (int x = 0; x < strlen(token); x++) {
-			if (!isdigit(token[x])) return false;
-		}
-		token = strtok(NULL, ",");
-	}
-	free(numList);
-	free(token);
-	return true;
+	PG_RETURN_INT32(count_intersection(setA, setB));
 }
 
-/*
- * Get integer array from input string
- */
-int32 *get_data(char *numList, int32 *size) {
-
-	int32 i = 0, tmpSize = 0, subTokenLen = 0, pos = 0, num = 0, *data = NULL;
-	char *token = NULL, *subToken = NULL;
-	token = strtok(numList, ",");
-	while (token != NULL) {
-		i = 0;
-		while (token[i] == '0') i++;
-		if (i >= strlen(token)) subTokenLen = 1;
-		else subTokenLen = strlen(token) - i;
-		subToken = malloc(sizeof(char) * (subTokenLen + 1));
-		memcpy(subToken, &token[i], subTokenLen);
-		subToken[subTokenLen] = '\0';
-    
-        	num = atoi(subToken);
-        	// add first integer to array
-		if (tmpSize == 0) {
-			data = malloc(sizeof(int32));
-			data[tmpSize++] = num;
-		} else {
-			// if num already exist in array, jump to next turn
-			if (num_exist(data, num, tmpSize)) {
-				token = strtok(NULL, ",");
-				continue;
-			}
-			// otherwise find expected position to insert	
-			pos = find_insert_pos(data, num, tmpSize);
-			data = insert_num(data, ++tmpSize, num, pos);
-		}
-		token = strtok(NULL, ",");
-	}
-	
-	*size = tmpSize;
-	free(token);
-	free(subToken);
-	return data;
-}
+PG_FUNCTION_INFO_V1(intset_union_count);
 
-/*
- * Check if the integer has been in the array
- * Searching the number by binary search
- */
-bool num_exist(int32 *data, int32 target, int32 size) {
-	int32 l = 0, r = size - 1, m;
+Datum
+intset_union_count(PG_FUNCTION_ARGS)
+{
+	IntSet	  *setA = PG_GETARG_INTSET_P(0);
+	IntSet	  *setB = PG_GETARG_INTSET_P(1);
 
-	while (l <= r) {
-		m = l + (r - l) / 2;
-		if (data[m] == target) return true;
-		else if (data[m] < target) l = m + 1;
-		else r = m - 1;
-	}
-	return false;
+	PG_RETURN_INT32(INTSET_SIZE(setA) + INTSET_SIZE(setB) - count_intersection(setA, setB));
 }
 
-/*
- * Find the position where the number should be
- */
-int32 find_insert_pos(int32 *data, int32 target, int32 size) {
-	int32 l = 0, r = size - 1, m;
+PG_FUNCTION_INFO_V1(intset_difference_count);
 
-	while (l <= r) {
-		m = l + (r - l) / 2;
-		if (data[m] < target) l = m + 1;
-		else r = m - 1;
-	}
-	return l;
+Datum
+intset_difference_count(PG_FUNCTION_ARGS)
+{
+	IntSet	  *setA = PG_GETARG_INTSET_P(0);
+	IntSet	  *setB = PG_GETARG_INTSET_P(1);
+
+	PG_RETURN_INT32(INTSET_SIZE(setA) - count_intersection(setA, setB));
 }
 
 /*
- * Insert the number into array according to the position found before
- * Each cell after the position moves one cell backward
+ * Two empty sets have nothing in common, as in pg_trgm, so their index
+ * is 0
  */
-int32 *insert_num(int32 *data, int32 size, int32 num, int32 pos) {
-	
-	data = realloc(data, sizeof(int32) * size);
+PG_FUNCTION_INFO_V1(intset_jaccard);
 
-	for (int i = size - 1; i > pos; i--) {
-		data[i] = data[i - 1];
-	}
-	data[pos] = num;
-	return data;
+Datum
+intset_jaccard(PG_FUNCTION_ARGS)
+{
+	IntSet	  *setA = PG_GETARG_INTSET_P(0);
+	IntSet	  *setB = PG_GETARG_INTSET_P(1);
+
+	PG_RETURN_FLOAT8(jaccard_index(count_intersection(setA, setB), INTSET_SIZE(setA), INTSET_SIZE(setB)));
 }
 
 /*
- * Count number of digit of the integer
+ * Similarity is a Jaccard index of at least intset.similarity_threshold
  */
-int32 get_num_length(int32 num) {
-	int32 count = 0;
-	if (num == 0) return 1;
-	
-	while (num != 0) {
-		num /= 10;
-		count++;
-	}
-	return count;
+PG_FUNCTION_INFO_V1(intset_similar);
+
+Datum
+intset_similar(PG_FUNCTION_ARGS)
+{
+	IntSet	  *setA = PG_GETARG_INTSET_P(0);
+	IntSet	  *setB = PG_GETARG_INTSET_P(1);
+
+	PG_RETURN_BOOL(jaccard_index(count_intersection(setA, setB), INTSET_SIZE(setA), INTSET_SIZE(setB))
+				   >= similarity_threshold);
 }
 
 /*
- * Convert the integer array to string
+ * Jaccard distance, 1 minus the Jaccard index
  */
-char *to_string(int32 *data, int32 size) {
+PG_FUNCTION_INFO_V1(intset_distance);
 
-	char *str = NULL;
-	int32 len;
-	if (size == 0) len = 2;
-	else len = size + 1; // initialize with number of commas and bracket
-	// get string length
-	for (int i = 0; i < size; i++) {
-		len += get_num_length(data[i]);
-	}
+Datum
+intset_distance(PG_FUNCTION_ARGS)
+{
+	IntSet	  *setA = PG_GETARG_INTSET_P(0);
+	IntSet	  *setB = PG_GETARG_INTSET_P(1);
 
-	str = malloc(sizeof(char) * (len + 1));
-	strcpy(str, "{");
-	for (int i = 0; i < size; i++) {
-		sprintf(str, "%s%d,", str, data[i]);
-	}
-	str[len - 1] = '}';
-	str[len] = '\0';
-	return str;
+	PG_RETURN_FLOAT8(1.0 - jaccard_index(count_intersection(setA, setB), INTSET_SIZE(setA), INTSET_SIZE(setB)));
+}
+
+
+/*****************************************************************************
+ * Integer arrays
+ *
+ * Casts between intSet and int4[], and operators taking an int4[] as it is.
+ * The operators read the array payload in place, merging it with array
+ * sets when it happens to be sorted and probing the set otherwise. Arrays
+ * must be one-dimensional and free of NULLs.
+ *****************************************************************************/
+
+PG_FUNCTION_INFO_V1(int4array_to_intset);
+
+Datum
+int4array_to_intset(PG_FUNCTION_ARGS)
+{
+	ArrayType  *array = PG_GETARG_ARRAYTYPE_P(0);
+	int32		size;
+	int32	   *data = array_numbers(array, &size);
+	IntSet	   *result;
+
+	if (size > INTSET_MAX_NUMBERS)
+		ereport(ERROR,
+			(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				errmsg("intset cannot hold more than %d elements", INTSET_MAX_NUMBERS)));
+
+	result = new_intset(size);
+	memcpy(result->data, data, size * sizeof(int32));
+	if (!numbers_ascending(result->data, size)) {
+		sort_numbers(result->data, size);
+		size = remove_duplicates(result->data, size);
+	}
+	set_intset_size(result, size);
+
+	PG_RETURN_POINTER(compress_intset(result));
+}
+
+PG_FUNCTION_INFO_V1(intset_to_int4array);
+
+Datum
+intset_to_int4array(PG_FUNCTION_ARGS)
+{
+	IntSet	   *intSet = PG_GETARG_INTSET_P(0);
+	Size		nbytes = ARR_OVERHEAD_NONULLS(1) + INTSET_SIZE(intSet) * sizeof(int32);
+	ArrayType  *result;
+
+	if (INTSET_SIZE(intSet) == 0) PG_RETURN_ARRAYTYPE_P(construct_empty_array(INT4OID));
+
+	result = (ArrayType *) palloc0(nbytes);
+	SET_VARSIZE(result, nbytes);
+	result->ndim = 1;
+	result->dataoffset = 0;
+	result->elemtype = INT4OID;
+	ARR_DIMS(result)[0] = INTSET_SIZE(intSet);
+	ARR_LBOUND(result)[0] = 1;
+	memcpy(ARR_DATA_PTR(result), intset_numbers(intSet), INTSET_SIZE(intSet) * sizeof(int32));
+
+	PG_RETURN_ARRAYTYPE_P(result);
+}
+
+PG_FUNCTION_INFO_V1(intset_contains_array);
+
+Datum
+intset_contains_array(PG_FUNCTION_ARGS)
+{
+	IntSet	   *intSet = PG_GETARG_INTSET_P(0);
+	int32		size;
+	int32	   *data = array_numbers(PG_GETARG_ARRAYTYPE_P(1), &size);
+
+	PG_RETURN_BOOL(intset_has_numbers(intSet, data, size, true));
+}
+
+PG_FUNCTION_INFO_V1(array_contained_intset);
+
+Datum
+array_contained_intset(PG_FUNCTION_ARGS)
+{
+	int32		size;
+	int32	   *data = array_numbers(PG_GETARG_ARRAYTYPE_P(0), &size);
+	IntSet	   *intSet = PG_GETARG_INTSET_P(1);
+
+	PG_RETURN_BOOL(intset_has_numbers(intSet, data, size, true));
+}
+
+PG_FUNCTION_INFO_V1(intset_overlaps_array);
+
+Datum
+intset_overlaps_array(PG_FUNCTION_ARGS)
+{
+	IntSet	   *intSet = PG_GETARG_INTSET_P(0);
+	int32		size;
+	int32	   *data = array_numbers(PG_GETARG_ARRAYTYPE_P(1), &size);
+
+	PG_RETURN_BOOL(intset_has_numbers(intSet, data, size, false));
+}
+
+PG_FUNCTION_INFO_V1(array_overlaps_intset);
+
+Datum
+array_overlaps_intset(PG_FUNCTION_ARGS)
+{
+	int32		size;
+	int32	   *data = array_numbers(PG_GETARG_ARRAYTYPE_P(0), &size);
+	IntSet	   *intSet = PG_GETARG_INTSET_P(1);
+
+	PG_RETURN_BOOL(intset_has_numbers(intSet, data, size, false));
+}
+
+
+/*****************************************************************************
+ * Big intsets
+ *
+ * bigintset holds 64-bit integers with the operators, ordering and hashing
+ * of intSet, see the Big intsets helpers for its storage. The SIMD kernels,
+ * the packed and roaring formats, the index, statistics and aggregate
+ * support stay specific to intSet.
+ *****************************************************************************/
+
+PG_FUNCTION_INFO_V1(bigintset_in);
+
+Datum
+bigintset_in(PG_FUNCTION_ARGS)
+{
+	char	*str = PG_GETARG_CSTRING(0);
+
+	PG_RETURN_POINTER(parse_bigintset(str));
+}
+
+PG_FUNCTION_INFO_V1(bigintset_out);
+
+Datum
+bigintset_out(PG_FUNCTION_ARGS)
+{
+	BigIntSet *bigSet = PG_GETARG_BIGINTSET_P(0);
+
+	PG_RETURN_CSTRING(to_string_int64(bigintset_numbers(bigSet), bigSet->size));
+}
+
+/*
+ * The wire format is the one of intSet, with 64-bit varints
+ */
+PG_FUNCTION_INFO_V1(bigintset_recv);
+
+Datum
+bigintset_recv(PG_FUNCTION_ARGS)
+{
+	StringInfo	buf = (StringInfo) PG_GETARG_POINTER(0);
+	int32		size = recv_count_int64(buf);
+	int64	   *data = (int64 *) palloc(Max(size, 1) * sizeof(int64));
+
+	recv_numbers_int64(buf, data, size);
+
+	PG_RETURN_POINTER(make_bigintset(data, size));
+}
+
+PG_FUNCTION_INFO_V1(bigintset_send);
+
+Datum
+bigintset_send(PG_FUNCTION_ARGS)
+{
+	BigIntSet  *bigSet = PG_GETARG_BIGINTSET_P(0);
+
+	PG_RETURN_BYTEA_P(send_numbers_int64(bigintset_numbers(bigSet), bigSet->size));
+}
+
+PG_FUNCTION_INFO_V1(bigintset_contains);
+
+Datum
+bigintset_contains(PG_FUNCTION_ARGS)
+{
+	int64	  num = PG_GETARG_INT64(0);
+	BigIntSet *bigSet = PG_GETARG_BIGINTSET_P(1);
+
+	PG_RETURN_BOOL(bigintset_has(bigSet, num));
+}
+
+PG_FUNCTION_INFO_V1(bigintset_contains_element);
+
+Datum
+bigintset_contains_element(PG_FUNCTION_ARGS)
+{
+	BigIntSet *bigSet = PG_GETARG_BIGINTSET_P(0);
+	int64	  num = PG_GETARG_INT64(1);
+
+	PG_RETURN_BOOL(bigintset_has(bigSet, num));
+}
+
+PG_FUNCTION_INFO_V1(bigintset_cardinality);
+
+Datum
+bigintset_cardinality(PG_FUNCTION_ARGS)
+{
+	int32	  result;
+
+	read_intset_slice(PG_GETARG_DATUM(0), offsetof(BigIntSet, size), sizeof(int32), &result);
+	PG_RETURN_INT32(result);
+}
+
+PG_FUNCTION_INFO_V1(bigintset_min);
+
+Datum
+bigintset_min(PG_FUNCTION_ARGS)
+{
+	int64	  result;
+
+	if (!bigintset_bound(PG_GETARG_DATUM(0), false, &result)) PG_RETURN_NULL();
+	PG_RETURN_INT64(result);
+}
+
+PG_FUNCTION_INFO_V1(bigintset_max);
+
+Datum
+bigintset_max(PG_FUNCTION_ARGS)
+{
+	int64	  result;
+
+	if (!bigintset_bound(PG_GETARG_DATUM(0), true, &result)) PG_RETURN_NULL();
+	PG_RETURN_INT64(result);
+}
+
+PG_FUNCTION_INFO_V1(bigintset_contains_all);
+
+Datum
+bigintset_contains_all(PG_FUNCTION_ARGS)
+{
+	BigIntSet *setA = PG_GETARG_BIGINTSET_P(0);
+	BigIntSet *setB = PG_GETARG_BIGINTSET_P(1);
+
+	PG_RETURN_BOOL(bigintset_is_subset(setA, setB));
+}
+
+PG_FUNCTION_INFO_V1(bigintset_contains_only);
+
+Datum
+bigintset_contains_only(PG_FUNCTION_ARGS)
+{
+	BigIntSet *setA = PG_GETARG_BIGINTSET_P(0);
+	BigIntSet *setB = PG_GETARG_BIGINTSET_P(1);
+
+	PG_RETURN_BOOL(bigintset_is_subset(setB, setA));
+}
+
+PG_FUNCTION_INFO_V1(bigintset_equal);
+
+Datum
+bigintset_equal(PG_FUNCTION_ARGS)
+{
+	BigIntSet *setA = PG_GETARG_BIGINTSET_P(0);
+	BigIntSet *setB = PG_GETARG_BIGINTSET_P(1);
+
+	PG_RETURN_BOOL(bigintset_is_equal(setA, setB));
+}
+
+PG_FUNCTION_INFO_V1(bigintset_not_equal);
+
+Datum
+bigintset_not_equal(PG_FUNCTION_ARGS)
+{
+	BigIntSet *setA = PG_GETARG_BIGINTSET_P(0);
+	BigIntSet *setB = PG_GETARG_BIGINTSET_P(1);
+
+	PG_RETURN_BOOL(!bigintset_is_equal(setA, setB));
+}
+
+PG_FUNCTION_INFO_V1(bigintset_contains_any);
+
+Datum
+bigintset_contains_any(PG_FUNCTION_ARGS)
+{
+	BigIntSet *setA = PG_GETARG_BIGINTSET_P(0);
+	BigIntSet *setB = PG_GETARG_BIGINTSET_P(1);
+
+	PG_RETURN_BOOL(bigintset_overlaps(setA, setB));
+}
+
+PG_FUNCTION_INFO_V1(bigintset_intersection);
+
+Datum
+bigintset_intersection(PG_FUNCTION_ARGS)
+{
+	BigIntSet *setA = PG_GETARG_BIGINTSET_P(0);
+	BigIntSet *setB = PG_GETARG_BIGINTSET_P(1);
+
+	PG_RETURN_POINTER(bigintset_operation(setA, setB, SET_INTERSECTION));
+}
+
+PG_FUNCTION_INFO_V1(bigintset_union);
+
+Datum
+bigintset_union(PG_FUNCTION_ARGS)
+{
+	BigIntSet *setA = PG_GETARG_BIGINTSET_P(0);
+	BigIntSet *setB = PG_GETARG_BIGINTSET_P(1);
+
+	PG_RETURN_POINTER(bigintset_operation(setA, setB, SET_UNION));
+}
+
+PG_FUNCTION_INFO_V1(bigintset_disjunction);
+
+Datum
+bigintset_disjunction(PG_FUNCTION_ARGS)
+{
+	BigIntSet *setA = PG_GETARG_BIGINTSET_P(0);
+	BigIntSet *setB = PG_GETARG_BIGINTSET_P(1);
+
+	PG_RETURN_POINTER(bigintset_operation(setA, setB, SET_DISJUNCTION));
+}
+
+PG_FUNCTION_INFO_V1(bigintset_difference);
+
+Datum
+bigintset_difference(PG_FUNCTION_ARGS)
+{
+	BigIntSet *setA = PG_GETARG_BIGINTSET_P(0);
+	BigIntSet *setB = PG_GETARG_BIGINTSET_P(1);
+
+	PG_RETURN_POINTER(bigintset_operation(setA, setB, SET_DIFFERENCE));
+}
+
+PG_FUNCTION_INFO_V1(bigintset_cmp);
+
+Datum
+bigintset_cmp(PG_FUNCTION_ARGS)
+{
+	BigIntSet *setA = PG_GETARG_BIGINTSET_P(0);
+	BigIntSet *setB = PG_GETARG_BIGINTSET_P(1);
+
+	PG_RETURN_INT32(bigintset_compare(setA, setB));
+}
+
+PG_FUNCTION_INFO_V1(bigintset_lt);
+
+Datum
+bigintset_lt(PG_FUNCTION_ARGS)
+{
+	BigIntSet *setA = PG_GETARG_BIGINTSET_P(0);
+	BigIntSet *setB = PG_GETARG_BIGINTSET_P(1);
+
+	PG_RETURN_BOOL(bigintset_compare(setA, setB) < 0);
+}
+
+PG_FUNCTION_INFO_V1(bigintset_le);
+
+Datum
+bigintset_le(PG_FUNCTION_ARGS)
+{
+	BigIntSet *setA = PG_GETARG_BIGINTSET_P(0);
+	BigIntSet *setB = PG_GETARG_BIGINTSET_P(1);
+
+	PG_RETURN_BOOL(bigintset_compare(setA, setB) <= 0);
+}
+
+PG_FUNCTION_INFO_V1(bigintset_gt);
+
+Datum
+bigintset_gt(PG_FUNCTION_ARGS)
+{
+	BigIntSet *setA = PG_GETARG_BIGINTSET_P(0);
+	BigIntSet *setB = PG_GETARG_BIGINTSET_P(1);
+
+	PG_RETURN_BOOL(bigintset_compare(setA, setB) > 0);
+}
+
+PG_FUNCTION_INFO_V1(bigintset_ge);
+
+Datum
+bigintset_ge(PG_FUNCTION_ARGS)
+{
+	BigIntSet *setA = PG_GETARG_BIGINTSET_P(0);
+	BigIntSet *setB = PG_GETARG_BIGINTSET_P(1);
+
+	PG_RETURN_BOOL(bigintset_compare(setA, setB) >= 0);
+}
+
+/*
+ * Equal sets have equal bytes, so the hashes cover the stored set past
+ * its length word
+ */
+PG_FUNCTION_INFO_V1(bigintset_hash);
+
+Datum
+bigintset_hash(PG_FUNCTION_ARGS)
+{
+	BigIntSet *bigSet = PG_GETARG_BIGINTSET_P(0);
+
+	PG_RETURN_DATUM(hash_any((unsigned char *) &bigSet->size, VARSIZE(bigSet) - offsetof(BigIntSet, size)));
+}
+
+PG_FUNCTION_INFO_V1(bigintset_hash_extended);
+
+Datum
+bigintset_hash_extended(PG_FUNCTION_ARGS)
+{
+	BigIntSet *bigSet = PG_GETARG_BIGINTSET_P(0);
+	uint64	  seed = PG_GETARG_INT64(1);
+
+	PG_RETURN_DATUM(hash_any_extended((unsigned char *) &bigSet->size,
+	                                  VARSIZE(bigSet) - offsetof(BigIntSet, size), seed));
+}
+
+PG_FUNCTION_INFO_V1(intset_to_bigintset);
+
+Datum
+intset_to_bigintset(PG_FUNCTION_ARGS)
+{
+	IntSet	  *intSet = PG_GETARG_INTSET_P(0);
+	int32	  *data = intset_numbers(intSet);
+	int64	  *numbers = (int64 *) palloc(Max(INTSET_SIZE(intSet), 1) * sizeof(int64));
+
+	for (int i = 0; i < INTSET_SIZE(intSet); i++) {
+		numbers[i] = data[i];
+	}
+
+	PG_RETURN_POINTER(make_bigintset(numbers, INTSET_SIZE(intSet)));
+}
+
+PG_FUNCTION_INFO_V1(bigintset_to_intset);
+
+Datum
+bigintset_to_intset(PG_FUNCTION_ARGS)
+{
+	BigIntSet *bigSet = PG_GETARG_BIGINTSET_P(0);
+	int32	  size = bigSet->size;
+	IntSet	  *result;
+
+	// the numbers are sorted, so only the ends can be out of range
+	if (size > 0 && (bigintset_number(bigSet, 0) < PG_INT32_MIN
+					 || bigintset_number(bigSet, size - 1) > PG_INT32_MAX))
+		ereport(ERROR,
+				(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+				 errmsg("bigintset value is out of range for type intset")));
+
+	result = new_intset(size);
+	for (int i = 0; i < size; i++) {
+		result->data[i] = (int32) bigintset_number(bigSet, i);
+	}
+	set_intset_size(result, size);
+
+	PG_RETURN_POINTER(compress_intset(result));
+}
+
+/*****************************************************************************
+ * Aggregates
+ *
+ * intset_agg, intset_union_agg and intset_intersect_agg keep an
+ * IntSetAggState as their internal transition state, so no row copies the
+ * set built so far. Partial states travel between parallel workers as flat intsets,
+ * compressed like any other; an intersection state that has not seen a
+ * set yet travels as an empty bytea. NULL inputs are skipped, and the
+ * aggregates are NULL when every input is.
+ *****************************************************************************/
+
+PG_FUNCTION_INFO_V1(intset_union_trans);
+
+Datum
+intset_union_trans(PG_FUNCTION_ARGS)
+{
+	IntSetAggState *state = PG_ARGISNULL(0) ? NULL : (IntSetAggState *) PG_GETARG_POINTER(0);
+	MemoryContext aggContext;
+	IntSet	  *intSet;
+
+	if (!AggCheckCallContext(fcinfo, &aggContext))
+		elog(ERROR, "intset_union_trans called in non-aggregate context");
+	if (PG_ARGISNULL(1)) {
+		if (state == NULL) PG_RETURN_NULL();
+		PG_RETURN_POINTER(state);
+	}
+
+	intSet = PG_GETARG_INTSET_P(1);
+	if (state == NULL)
+		state = new_agg_state(aggContext, intset_numbers(intSet), INTSET_SIZE(intSet));
+	else
+		agg_add_numbers(state, intset_numbers(intSet), INTSET_SIZE(intSet));
+
+	PG_RETURN_POINTER(state);
+}
+
+PG_FUNCTION_INFO_V1(intset_union_combine);
+
+Datum
+intset_union_combine(PG_FUNCTION_ARGS)
+{
+	IntSetAggState *state1 = PG_ARGISNULL(0) ? NULL : (IntSetAggState *) PG_GETARG_POINTER(0);
+	IntSetAggState *state2 = PG_ARGISNULL(1) ? NULL : (IntSetAggState *) PG_GETARG_POINTER(1);
+	MemoryContext aggContext;
+
+	if (!AggCheckCallContext(fcinfo, &aggContext))
+		elog(ERROR, "intset_union_combine called in non-aggregate context");
+	if (state2 == NULL) {
+		if (state1 == NULL) PG_RETURN_NULL();
+		PG_RETURN_POINTER(state1);
+	}
+
+	// deserialized states live in a per-tuple context, so they are copied
+	if (state1 == NULL)
+		PG_RETURN_POINTER(copy_agg_state(aggContext, state2));
+	agg_add_numbers(state1, agg_numbers(state2), state2->count);
+
+	PG_RETURN_POINTER(state1);
+}
+
+PG_FUNCTION_INFO_V1(intset_union_final);
+
+Datum
+intset_union_final(PG_FUNCTION_ARGS)
+{
+	IntSetAggState *state = PG_ARGISNULL(0) ? NULL : (IntSetAggState *) PG_GETARG_POINTER(0);
+
+	if (state == NULL) PG_RETURN_NULL();
+	PG_RETURN_POINTER(agg_state_intset(state));
+}
+
+/*
+ * Transition of intset_agg, which shares the other functions of
+ * intset_union_agg. Numbers are appended to the tail. When the buffer is
+ * full and the tail outgrows the head, the tail is merged in first, as
+ * agg_add_numbers does, and the buffer only grows, to twice the numbers
+ * kept, if that freed less than half of it. A full buffer thus holds at
+ * most twice the distinct numbers, and grows to at most four times them,
+ * however many duplicates come.
+ */
+PG_FUNCTION_INFO_V1(intset_agg_trans);
+
+Datum
+intset_agg_trans(PG_FUNCTION_ARGS)
+{
+	IntSetAggState *state = PG_ARGISNULL(0) ? NULL : (IntSetAggState *) PG_GETARG_POINTER(0);
+	MemoryContext aggContext;
+	int32	  num;
+
+	if (!AggCheckCallContext(fcinfo, &aggContext))
+		elog(ERROR, "intset_agg_trans called in non-aggregate context");
+	if (PG_ARGISNULL(1)) {
+		if (state == NULL) PG_RETURN_NULL();
+		PG_RETURN_POINTER(state);
+	}
+
+	num = PG_GETARG_INT32(1);
+	if (state == NULL) PG_RETURN_POINTER(new_agg_state(aggContext, &num, 1));
+	if (state->bitmap != NULL) {
+		agg_add_numbers(state, &num, 1);
+		PG_RETURN_POINTER(state);
+	}
+
+	if (state->count == state->allocated) {
+		int32 capacity = state->allocated;
+
+		if (state->count - state->sorted > state->sorted || capacity == INTSET_MAX_NUMBERS)
+			flush_agg_state(state);
+		if (state->count == INTSET_MAX_NUMBERS)
+			ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+					errmsg("intset cannot hold more than %d elements", INTSET_MAX_NUMBERS)));
+		if (state->count > capacity / 2)
+			capacity = Min((int64) state->count * 2, INTSET_MAX_NUMBERS);
+		// flush_agg_state leaves no room, so the buffer is resized either way
+		state->allocated = capacity;
+		state->numbers = (int32 *) repalloc(state->numbers,
+		                                    (state->allocated + INTSET_KERNEL_SLACK) * sizeof(int32));
+	}
+	state->numbers[state->count++] = num;
+
+	PG_RETURN_POINTER(state);
+}
+
+PG_FUNCTION_INFO_V1(intset_intersect_trans);
+
+Datum
+intset_intersect_trans(PG_FUNCTION_ARGS)
+{
+	IntSetAggState *state = PG_ARGISNULL(0) ? NULL : (IntSetAggState *) PG_GETARG_POINTER(0);
+	MemoryContext aggContext;
+	IntSet	  *intSet;
+
+	if (!AggCheckCallContext(fcinfo, &aggContext))
+		elog(ERROR, "intset_intersect_trans called in non-aggregate context");
+	if (PG_ARGISNULL(1)) {
+		if (state == NULL) PG_RETURN_NULL();
+		PG_RETURN_POINTER(state);
+	}
+
+	// once empty, the intersection stays empty without reading the inputs
+	if (state != NULL && state->count == 0) PG_RETURN_POINTER(state);
+
+	intSet = PG_GETARG_INTSET_P(1);
+	if (state == NULL)
+		state = new_agg_state(aggContext, intset_numbers(intSet), INTSET_SIZE(intSet));
+	else
+		agg_intersect(state, intSet);
+
+	PG_RETURN_POINTER(state);
+}
+
+PG_FUNCTION_INFO_V1(intset_intersect_combine);
+
+Datum
+intset_intersect_combine(PG_FUNCTION_ARGS)
+{
+	IntSetAggState *state1 = PG_ARGISNULL(0) ? NULL : (IntSetAggState *) PG_GETARG_POINTER(0);
+	IntSetAggState *state2 = PG_ARGISNULL(1) ? NULL : (IntSetAggState *) PG_GETARG_POINTER(1);
+	MemoryContext aggContext;
+
+	if (!AggCheckCallContext(fcinfo, &aggContext))
+		elog(ERROR, "intset_intersect_combine called in non-aggregate context");
+	if (state2 == NULL || state2->numbers == NULL) {
+		if (state1 == NULL) PG_RETURN_NULL();
+		PG_RETURN_POINTER(state1);
+	}
+
+	if (state1 == NULL || state1->numbers == NULL)
+		PG_RETURN_POINTER(copy_agg_state(aggContext, state2));
+	agg_intersect_numbers(state1, state2->numbers, state2->count);
+
+	PG_RETURN_POINTER(state1);
+}
+
+PG_FUNCTION_INFO_V1(intset_intersect_final);
+
+Datum
+intset_intersect_final(PG_FUNCTION_ARGS)
+{
+	IntSetAggState *state = PG_ARGISNULL(0) ? NULL : (IntSetAggState *) PG_GETARG_POINTER(0);
+
+	if (state == NULL || state->numbers == NULL) PG_RETURN_NULL();
+	PG_RETURN_POINTER(agg_state_intset(state));
+}
+
+PG_FUNCTION_INFO_V1(intset_agg_serialize);
+
+Datum
+intset_agg_serialize(PG_FUNCTION_ARGS)
+{
+	IntSetAggState *state = (IntSetAggState *) PG_GETARG_POINTER(0);
+	bytea	   *result;
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "intset_agg_serialize called in non-aggregate context");
+	if (state->numbers == NULL && state->bitmap == NULL) {
+		result = (bytea *) palloc(VARHDRSZ);
+		SET_VARSIZE(result, VARHDRSZ);
+		PG_RETURN_BYTEA_P(result);
+	}
+
+	PG_RETURN_BYTEA_P((bytea *) agg_state_intset(state));
+}
+
+PG_FUNCTION_INFO_V1(intset_agg_deserialize);
+
+Datum
+intset_agg_deserialize(PG_FUNCTION_ARGS)
+{
+	// copied, so that roaring containers get their alignment back
+	IntSet	  *intSet = (IntSet *) PG_DETOAST_DATUM_COPY(PG_GETARG_DATUM(0));
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "intset_agg_deserialize called in non-aggregate context");
+	if (VARSIZE(intSet) == VARHDRSZ)
+		PG_RETURN_POINTER(new_agg_state(CurrentMemoryContext, NULL, 0));
+
+	PG_RETURN_POINTER(new_agg_state(CurrentMemoryContext, intset_numbers(intSet), INTSET_SIZE(intSet)));
+}
+
+
+/*****************************************************************************
+ * Set-returning functions
+ *****************************************************************************/
+
+/*
+ * The sorted elements, one per call. Array sets are returned in place, so
+ * only packed blocks and roaring chunks are decoded, one at a time.
+ */
+PG_FUNCTION_INFO_V1(intset_elements);
+
+Datum
+intset_elements(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	IntSetElements *state;
+
+	if (SRF_IS_FIRSTCALL()) {
+		MemoryContext oldcontext;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+		state = (IntSetElements *) palloc(sizeof(IntSetElements));
+		init_elements(state, PG_GETARG_INTSET_P(0));
+		funcctx->user_fctx = state;
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	state = (IntSetElements *) funcctx->user_fctx;
+	if (state->pos == state->count && !next_elements(state)) SRF_RETURN_DONE(funcctx);
+
+	SRF_RETURN_NEXT(funcctx, Int32GetDatum(state->numbers[state->pos++]));
+}
+
+/*
+ * Union of any number of sets, by a k-way merge over a heap of the
+ * inputs. NULL inputs are ignored.
+ */
+PG_FUNCTION_INFO_V1(intset_union);
+
+Datum
+intset_union(PG_FUNCTION_ARGS)
+{
+	IntSet	  **sets;
+	int32	  nsets = variadic_intsets(PG_GETARG_ARRAYTYPE_P(0), &sets);
+	IntSetElements *inputs;
+	int32	  *heap, heapSize = 0, size = 0;
+	int64	  total = 0;
+	IntSet	  *result;
+
+	if (nsets == 1) PG_RETURN_POINTER(sets[0]);
+
+	inputs = (IntSetElements *) palloc(nsets * sizeof(IntSetElements));
+	heap = (int32 *) palloc(nsets * sizeof(int32));
+	for (int i = 0; i < nsets; i++) {
+		init_elements(&inputs[i], sets[i]);
+		if (next_elements(&inputs[i])) heap[heapSize++] = i;
+		total += INTSET_SIZE(sets[i]);
+	}
+	for (int i = heapSize / 2 - 1; i >= 0; i--)
+		sift_elements(inputs, heap, heapSize, i);
+
+	result = new_intset((int32) Min(total, INTSET_MAX_NUMBERS));
+	while (heapSize > 0) {
+		IntSetElements *input = &inputs[heap[0]];
+		int32 num = input->numbers[input->pos++];
+
+		if (size == 0 || result->data[size - 1] != num) {
+			if (size == INTSET_MAX_NUMBERS)
+				ereport(ERROR,
+					(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+						errmsg("intset cannot hold more than %d elements", INTSET_MAX_NUMBERS)));
+			result->data[size++] = num;
+		}
+		if (input->pos == input->count && !next_elements(input)) {
+			heap[0] = heap[--heapSize];
+			if (heapSize == 0) break;
+		}
+		sift_elements(inputs, heap, heapSize, 0);
+	}
+	set_intset_size(result, size);
+
+	PG_RETURN_POINTER(compress_intset(result));
+}
+
+/*
+ * Intersection of any number of sets, starting from the smallest and
+ * going up in size, until the result is empty. NULL inputs are ignored,
+ * and the result is NULL when there is no set at all.
+ */
+PG_FUNCTION_INFO_V1(intset_intersect);
+
+Datum
+intset_intersect(PG_FUNCTION_ARGS)
+{
+	IntSet	  **sets;
+	int32	  nsets = variadic_intsets(PG_GETARG_ARRAYTYPE_P(0), &sets);
+	IntSet	  *result, *spare;
+
+	if (nsets == 0) PG_RETURN_NULL();
+	if (nsets == 1) PG_RETURN_POINTER(sets[0]);
+
+	qsort(sets, nsets, sizeof(IntSet *), compare_intset_size);
+	result = new_intset(INTSET_SIZE(sets[0]));
+	spare = new_intset(INTSET_SIZE(sets[0]));
+	memcpy(result->data, intset_numbers(sets[0]), INTSET_SIZE(sets[0]) * sizeof(int32));
+	set_intset_size(result, INTSET_SIZE(sets[0]));
+
+	for (int i = 1; i < nsets && INTSET_SIZE(result) > 0; i++) {
+		IntSet *swap = result;
+
+		if (INTSET_FORMAT(sets[i]) == INTSET_FORMAT_ROARING) {
+			// the result never overtakes the numbers it is read from
+			int32 size = 0;
+
+			for (int j = 0; j < INTSET_SIZE(result); j++) {
+				if (roaring_has(sets[i], result->data[j]))
+					result->data[size++] = result->data[j];
+			}
+			set_intset_size(result, size);
+			continue;
+		}
+		set_intset_size(spare, intset_intersection(result, sets[i], spare->data));
+		result = spare;
+		spare = swap;
+	}
+	pfree(spare);
+
+	PG_RETURN_POINTER(compress_intset(result));
+}
+
+/*
+ * Planner support for intset_elements: the number of rows is the size of
+ * a constant set, or the average size from the column statistics
+ */
+PG_FUNCTION_INFO_V1(intset_elements_support);
+
+Datum
+intset_elements_support(PG_FUNCTION_ARGS)
+{
+	Node	   *rawreq = (Node *) PG_GETARG_POINTER(0);
+	SupportRequestRows *req;
+
+	if (!IsA(rawreq, SupportRequestRows)) PG_RETURN_POINTER(NULL);
+
+	req = (SupportRequestRows *) rawreq;
+	if (!is_funcclause(req->node)) PG_RETURN_POINTER(NULL);
+	req->rows = estimate_intset_size(req->root, (Node *) linitial(((FuncExpr *) req->node)->args));
+
+	PG_RETURN_POINTER(req);
+}
+
+
+/*****************************************************************************
+ * B-tree support
+ *
+ * Sets are ordered lexicographically by their sorted elements, a set
+ * coming before the sets it is a proper prefix of. The empty set is the
+ * smallest of all.
+ *****************************************************************************/
+
+PG_FUNCTION_INFO_V1(intset_cmp);
+
+Datum
+intset_cmp(PG_FUNCTION_ARGS)
+{
+	IntSet	  *setA = PG_GETARG_INTSET_P(0);
+	IntSet	  *setB = PG_GETARG_INTSET_P(1);
+
+	int32	  result = intset_compare(setA, setB);
+	PG_RETURN_INT32(result);
+}
+
+PG_FUNCTION_INFO_V1(intset_lt);
+
+Datum
+intset_lt(PG_FUNCTION_ARGS)
+{
+	IntSet	  *setA = PG_GETARG_INTSET_P(0);
+	IntSet	  *setB = PG_GETARG_INTSET_P(1);
+
+	bool 	  result = intset_compare(setA, setB) < 0;
+	PG_RETURN_BOOL(result);
+}
+
+PG_FUNCTION_INFO_V1(intset_le);
+
+Datum
+intset_le(PG_FUNCTION_ARGS)
+{
+	IntSet	  *setA = PG_GETARG_INTSET_P(0);
+	IntSet	  *setB = PG_GETARG_INTSET_P(1);
+
+	bool 	  result = intset_compare(setA, setB) <= 0;
+	PG_RETURN_BOOL(result);
+}
+
+PG_FUNCTION_INFO_V1(intset_gt);
+
+Datum
+intset_gt(PG_FUNCTION_ARGS)
+{
+	IntSet	  *setA = PG_GETARG_INTSET_P(0);
+	IntSet	  *setB = PG_GETARG_INTSET_P(1);
+
+	bool 	  result = intset_compare(setA, setB) > 0;
+	PG_RETURN_BOOL(result);
+}
+
+PG_FUNCTION_INFO_V1(intset_ge);
+
+Datum
+intset_ge(PG_FUNCTION_ARGS)
+{
+	IntSet	  *setA = PG_GETARG_INTSET_P(0);
+	IntSet	  *setB = PG_GETARG_INTSET_P(1);
+
+	bool 	  result = intset_compare(setA, setB) >= 0;
+	PG_RETURN_BOOL(result);
+}
+
+/*
+ * With 64-bit datums, sorts first run on an abbreviated key holding the
+ * first two elements, see intset_abbrev_convert
+ */
+PG_FUNCTION_INFO_V1(intset_sortsupport);
+
+Datum
+intset_sortsupport(PG_FUNCTION_ARGS)
+{
+	SortSupport ssup = (SortSupport) PG_GETARG_POINTER(0);
+
+	ssup->comparator = intset_fastcmp;
+#if SIZEOF_DATUM == 8
+	if (ssup->abbreviate) {
+		IntSetSortSupport *state = (IntSetSortSupport *) MemoryContextAlloc(ssup->ssup_cxt,
+		                                                                    sizeof(IntSetSortSupport));
+
+		state->inputCount = 0;
+		state->estimating = true;
+		initHyperLogLog(&state->abbrCard, 10);
+		ssup->ssup_extra = state;
+		ssup->comparator = intset_abbrev_cmp;
+		ssup->abbrev_converter = intset_abbrev_convert;
+		ssup->abbrev_abort = intset_abbrev_abort;
+		ssup->abbrev_full_comparator = intset_fastcmp;
+	}
+#endif
+
+	PG_RETURN_VOID();
+}
+
+
+/*****************************************************************************
+ * Hash support
+ *
+ * Like bigintset_hash, the hashes cover the stored bytes after the length
+ * word. Every set is stored in its compressed form except the large arrays
+ * written by the original module, so those are compressed first and hash
+ * alike with the sets built since.
+ *****************************************************************************/
+PG_FUNCTION_INFO_V1(intset_hash);
+
+Datum
+intset_hash(PG_FUNCTION_ARGS)
+{
+	IntSet	  *intSet = PG_GETARG_INTSET_P(0);
+	IntSet	  *canonical = compressed_form(intSet);
+
+	if (canonical == NULL)
+		canonical = intSet;
+	PG_RETURN_DATUM(hash_any((unsigned char *) &canonical->header,
+							 VARSIZE(canonical) - offsetof(IntSet, header)));
+}
+
+/*
+ * With seed 0, the lower 32 bits match intset_hash, as hash_any_extended
+ * does for hash_any
+ */
+PG_FUNCTION_INFO_V1(intset_hash_extended);
+
+Datum
+intset_hash_extended(PG_FUNCTION_ARGS)
+{
+	IntSet	  *intSet = PG_GETARG_INTSET_P(0);
+	uint64	  seed = PG_GETARG_INT64(1);
+	IntSet	  *canonical = compressed_form(intSet);
+
+	if (canonical == NULL)
+		canonical = intSet;
+	PG_RETURN_DATUM(hash_any_extended((unsigned char *) &canonical->header,
+									  VARSIZE(canonical) - offsetof(IntSet, header),
+									  seed));
+}
+
+
+/*****************************************************************************
+ * GIN support
+ *
+ * Every element is a key, compared with btint4cmp. The sets are sorted
+ * and duplicate free already, so their numbers are handed out as they are.
+ *****************************************************************************/
+
+#define INTSET_ELEMENT_STRATEGY		1	// intSet ? int
+#define INTSET_CONTAINS_STRATEGY	2	// intSet >@ intSet
+#define INTSET_CONTAINED_STRATEGY	3	// intSet @< intSet
+#define INTSET_EQUAL_STRATEGY		4	// intSet = intSet
+#define INTSET_OVERLAP_STRATEGY		5	// intSet ?| intSet
+#define INTSET_SIMILAR_STRATEGY		6	// intSet % intSet
+#define INTSET_DISTANCE_STRATEGY	7	// intSet <-> intSet, GiST only
+
+PG_FUNCTION_INFO_V1(gin_extract_value_intset);
+
+Datum
+gin_extract_value_intset(PG_FUNCTION_ARGS)
+{
+	IntSet	   *intSet = PG_GETARG_INTSET_P(0);
+	int32	   *nkeys = (int32 *) PG_GETARG_POINTER(1);
+	int32	   *data = intset_numbers(intSet);
+	Datum	   *keys = (Datum *) palloc(Max(INTSET_SIZE(intSet), 1) * sizeof(Datum));
+
+	for (int32 i = 0; i < INTSET_SIZE(intSet); i++)
+		keys[i] = Int32GetDatum(data[i]);
+	*nkeys = INTSET_SIZE(intSet);
+
+	PG_RETURN_POINTER(keys);
+}
+
+PG_FUNCTION_INFO_V1(gin_extract_query_intset);
+
+Datum
+gin_extract_query_intset(PG_FUNCTION_ARGS)
+{
+	int32	   *nkeys = (int32 *) PG_GETARG_POINTER(1);
+	StrategyNumber strategy = PG_GETARG_UINT16(2);
+	int32	   *searchMode = (int32 *) PG_GETARG_POINTER(6);
+	IntSet	   *query;
+	int32	   *data;
+	Datum	   *keys;
+
+	if (strategy == INTSET_ELEMENT_STRATEGY) {
+		keys = (Datum *) palloc(sizeof(Datum));
+		keys[0] = PG_GETARG_DATUM(0);
+		*nkeys = 1;
+		PG_RETURN_POINTER(keys);
+	}
+
+	query = PG_GETARG_INTSET_P(0);
+	data = intset_numbers(query);
+	keys = (Datum *) palloc(Max(INTSET_SIZE(query), 1) * sizeof(Datum));
+	for (int32 i = 0; i < INTSET_SIZE(query); i++)
+		keys[i] = Int32GetDatum(data[i]);
+	*nkeys = INTSET_SIZE(query);
+
+	switch (strategy) {
+		case INTSET_CONTAINS_STRATEGY:
+			// every set contains the empty one
+			if (INTSET_SIZE(query) == 0) *searchMode = GIN_SEARCH_MODE_ALL;
+			break;
+		case INTSET_CONTAINED_STRATEGY:
+			// the empty set is contained in every one, and has no keys
+			*searchMode = GIN_SEARCH_MODE_INCLUDE_EMPTY;
+			break;
+		case INTSET_EQUAL_STRATEGY:
+			if (INTSET_SIZE(query) == 0) *searchMode = GIN_SEARCH_MODE_INCLUDE_EMPTY;
+			break;
+		case INTSET_OVERLAP_STRATEGY:
+			// without keys nothing matches, which is right for an empty query
+			break;
+		case INTSET_SIMILAR_STRATEGY:
+			// a zero threshold makes every set similar, even one sharing nothing
+			if (similarity_threshold <= 0.0) *searchMode = GIN_SEARCH_MODE_ALL;
+			break;
+		default:
+			elog(ERROR, "unrecognized strategy number: %d", strategy);
+	}
+
+	PG_RETURN_POINTER(keys);
+}
+
+PG_FUNCTION_INFO_V1(gin_consistent_intset);
+
+Datum
+gin_consistent_intset(PG_FUNCTION_ARGS)
+{
+	bool	   *check = (bool *) PG_GETARG_POINTER(0);
+	StrategyNumber strategy = PG_GETARG_UINT16(1);
+	int32		nkeys = PG_GETARG_INT32(3);
+	bool	   *recheck = (bool *) PG_GETARG_POINTER(5);
+	bool		result = true;
+	int32		common = 0;
+
+	switch (strategy) {
+		case INTSET_ELEMENT_STRATEGY:
+		case INTSET_CONTAINS_STRATEGY:
+			// having all the keys is exactly containing the query
+			*recheck = false;
+			break;
+		case INTSET_CONTAINED_STRATEGY:
+			// the keys say nothing about the other elements of the item
+			*recheck = true;
+			PG_RETURN_BOOL(true);
+		case INTSET_EQUAL_STRATEGY:
+			*recheck = true;
+			break;
+		case INTSET_OVERLAP_STRATEGY:
+			*recheck = false;
+			result = false;
+			for (int32 i = 0; i < nkeys && !result; i++)
+				result = check[i];
+			PG_RETURN_BOOL(result);
+		case INTSET_SIMILAR_STRATEGY:
+			// the union is at least as large as the query, so the share of
+			// the query found in the item bounds the Jaccard index
+			*recheck = true;
+			if (nkeys == 0) PG_RETURN_BOOL(true);
+			for (int32 i = 0; i < nkeys; i++)
+				common += check[i];
+			PG_RETURN_BOOL((double) common / nkeys >= similarity_threshold);
+		default:
+			elog(ERROR, "unrecognized strategy number: %d", strategy);
+	}
+
+	for (int32 i = 0; i < nkeys && result; i++)
+		result = check[i];
+
+	PG_RETURN_BOOL(result);
+}
+
+PG_FUNCTION_INFO_V1(gin_triconsistent_intset);
+
+Datum
+gin_triconsistent_intset(PG_FUNCTION_ARGS)
+{
+	GinTernaryValue *check = (GinTernaryValue *) PG_GETARG_POINTER(0);
+	StrategyNumber strategy = PG_GETARG_UINT16(1);
+	int32		nkeys = PG_GETARG_INT32(3);
+	GinTernaryValue result = GIN_TRUE;
+
+	if (strategy == INTSET_CONTAINED_STRATEGY) PG_RETURN_GIN_TERNARY_VALUE(GIN_MAYBE);
+	if (strategy == INTSET_OVERLAP_STRATEGY) {
+		result = GIN_FALSE;
+		for (int32 i = 0; i < nkeys && result != GIN_TRUE; i++) {
+			if (check[i] == GIN_TRUE) result = GIN_TRUE;
+			else if (check[i] == GIN_MAYBE) result = GIN_MAYBE;
+		}
+		PG_RETURN_GIN_TERNARY_VALUE(result);
+	}
+	if (strategy == INTSET_SIMILAR_STRATEGY) {
+		int32		common = 0;
+
+		for (int32 i = 0; i < nkeys; i++)
+			common += check[i] != GIN_FALSE;
+		if (nkeys > 0 && (double) common / nkeys < similarity_threshold)
+			PG_RETURN_GIN_TERNARY_VALUE(GIN_FALSE);
+		PG_RETURN_GIN_TERNARY_VALUE(GIN_MAYBE);
+	}
+	if (strategy != INTSET_ELEMENT_STRATEGY && strategy != INTSET_CONTAINS_STRATEGY
+		&& strategy != INTSET_EQUAL_STRATEGY)
+		elog(ERROR, "unrecognized strategy number: %d", strategy);
+
+	for (int32 i = 0; i < nkeys; i++) {
+		if (check[i] == GIN_FALSE) PG_RETURN_GIN_TERNARY_VALUE(GIN_FALSE);
+		if (check[i] == GIN_MAYBE) result = GIN_MAYBE;
+	}
+	// equality still needs the item to have no other elements
+	if (strategy == INTSET_EQUAL_STRATEGY) result = GIN_MAYBE;
+
+	PG_RETURN_GIN_TERNARY_VALUE(result);
+}
+
+
+/*****************************************************************************
+ * GiST support
+ *
+ * A lossy signature tree in the manner of intarray's gist__intbig_ops,
+ * cheaper to keep up to date than the GIN index on write-heavy tables.
+ * Leaf keys of small sets hold their numbers and answer every strategy
+ * exactly; the other keys are signatures, so their matches are rechecked.
+ * The strategy numbers are the ones of the GIN support, plus the Jaccard
+ * distance, which GIN cannot order by.
+ *****************************************************************************/
+
+PG_FUNCTION_INFO_V1(intset_signature_in);
+
+Datum
+intset_signature_in(PG_FUNCTION_ARGS)
+{
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("intset_signature_in() not implemented")));
+	PG_RETURN_DATUM(0);
+}
+
+PG_FUNCTION_INFO_V1(intset_signature_out);
+
+Datum
+intset_signature_out(PG_FUNCTION_ARGS)
+{
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("intset_signature_out() not implemented")));
+	PG_RETURN_DATUM(0);
+}
+
+PG_FUNCTION_INFO_V1(gist_intset_consistent);
+
+Datum
+gist_intset_consistent(PG_FUNCTION_ARGS)
+{
+	GISTENTRY  *entry = (GISTENTRY *) PG_GETARG_POINTER(0);
+	StrategyNumber strategy = PG_GETARG_UINT16(2);
+	bool	   *recheck = (bool *) PG_GETARG_POINTER(4);
+	IntSetSignature *key = DatumGetIntSetSignatureP(entry->key);
+	uint64		buffer[INTSET_SIGLEN_WORDS];
+	uint64		queryWords[INTSET_SIGLEN_WORDS];
+	uint64	   *words;
+	IntSet	   *query;
+	int32	   *data;
+	bool		result;
+
+	// only the keys holding numbers are exact
+	*recheck = key->flag != INTSET_GIST_ARRAY;
+
+	if (strategy == INTSET_ELEMENT_STRATEGY) {
+		int32		num = PG_GETARG_INT32(1);
+
+		if (key->flag == INTSET_GIST_ARRAY)
+			result = num_exist(key->data, num, INTSET_GIST_SIZE(key));
+		else
+			result = key->flag == INTSET_GIST_ALLTRUE
+				|| signature_has_all(INTSET_GIST_WORDS(key), &num, 1);
+		PG_RETURN_BOOL(result);
+	}
+
+	query = PG_GETARG_INTSET_P(1);
+	data = intset_numbers(query);
+
+	if (strategy == INTSET_SIMILAR_STRATEGY)
+		PG_RETURN_BOOL(key_similarity(key, GIST_LEAF(entry), data, INTSET_SIZE(query))
+					   >= similarity_threshold);
+
+	if (key->flag == INTSET_GIST_ARRAY) {
+		int32		size = INTSET_GIST_SIZE(key);
+
+		switch (strategy) {
+			case INTSET_CONTAINS_STRATEGY:
+				result = is_subset(key->data, size, data, INTSET_SIZE(query));
+				break;
+			case INTSET_CONTAINED_STRATEGY:
+				result = is_subset(data, INTSET_SIZE(query), key->data, size);
+				break;
+			case INTSET_EQUAL_STRATEGY:
+				result = is_equal(key->data, size, data, INTSET_SIZE(query));
+				break;
+			case INTSET_OVERLAP_STRATEGY:
+				result = numbers_overlap(key->data, size, data, INTSET_SIZE(query));
+				break;
+			default:
+				elog(ERROR, "unrecognized strategy number: %d", strategy);
+		}
+		PG_RETURN_BOOL(result);
+	}
+
+	words = key_words(key, buffer);
+	switch (strategy) {
+		case INTSET_CONTAINS_STRATEGY:
+			result = signature_has_all(words, data, INTSET_SIZE(query));
+			break;
+		case INTSET_CONTAINED_STRATEGY:
+			// an internal key is no bound on the sets below it, which may
+			// even be empty
+			if (!GIST_LEAF(entry)) PG_RETURN_BOOL(true);
+			memset(queryWords, 0, sizeof(queryWords));
+			sign_numbers(queryWords, data, INTSET_SIZE(query));
+			result = true;
+			for (int i = 0; i < INTSET_SIGLEN_WORDS && result; i++)
+				result = (words[i] & ~queryWords[i]) == 0;
+			break;
+		case INTSET_EQUAL_STRATEGY:
+			if (!GIST_LEAF(entry)) {
+				result = signature_has_all(words, data, INTSET_SIZE(query));
+				break;
+			}
+			// sets small enough to keep their numbers never get a signature
+			if (INTSET_SIZE(query) <= INTSET_GIST_MAX_ARRAY) PG_RETURN_BOOL(false);
+			memset(queryWords, 0, sizeof(queryWords));
+			sign_numbers(queryWords, data, INTSET_SIZE(query));
+			result = memcmp(words, queryWords, INTSET_SIGLEN) == 0;
+			break;
+		case INTSET_OVERLAP_STRATEGY:
+			result = signature_has_any(words, data, INTSET_SIZE(query));
+			break;
+		default:
+			elog(ERROR, "unrecognized strategy number: %d", strategy);
+	}
+
+	PG_RETURN_BOOL(result);
+}
+
+/*
+ * Jaccard distance for ordered scans. Signatures only give a lower
+ * bound, so their leaf distances are rechecked.
+ */
+PG_FUNCTION_INFO_V1(gist_intset_distance);
+
+Datum
+gist_intset_distance(PG_FUNCTION_ARGS)
+{
+	GISTENTRY  *entry = (GISTENTRY *) PG_GETARG_POINTER(0);
+	IntSet	   *query = PG_GETARG_INTSET_P(1);
+	StrategyNumber strategy = PG_GETARG_UINT16(2);
+	bool	   *recheck = (bool *) PG_GETARG_POINTER(4);
+	IntSetSignature *key = DatumGetIntSetSignatureP(entry->key);
+
+	if (strategy != INTSET_DISTANCE_STRATEGY)
+		elog(ERROR, "unrecognized strategy number: %d", strategy);
+	*recheck = key->flag != INTSET_GIST_ARRAY;
+
+	PG_RETURN_FLOAT8(1.0 - key_similarity(key, GIST_LEAF(entry), intset_numbers(query),
+										  INTSET_SIZE(query)));
+}
+
+PG_FUNCTION_INFO_V1(gist_intset_compress);
+
+Datum
+gist_intset_compress(PG_FUNCTION_ARGS)
+{
+	GISTENTRY  *entry = (GISTENTRY *) PG_GETARG_POINTER(0);
+	GISTENTRY  *retval;
+	IntSet	   *intSet;
+	IntSetSignature *key;
+
+	// internal keys come from union and picksplit in their final form
+	if (!entry->leafkey) PG_RETURN_POINTER(entry);
+
+	intSet = DatumGetIntSetP(entry->key);
+	key = make_gist_key(intset_numbers(intSet), INTSET_SIZE(intSet));
+
+	retval = (GISTENTRY *) palloc(sizeof(GISTENTRY));
+	gistentryinit(*retval, PointerGetDatum(key), entry->rel, entry->page, entry->offset, false);
+	PG_RETURN_POINTER(retval);
+}
+
+PG_FUNCTION_INFO_V1(gist_intset_union);
+
+Datum
+gist_intset_union(PG_FUNCTION_ARGS)
+{
+	GistEntryVector *entryvec = (GistEntryVector *) PG_GETARG_POINTER(0);
+	int		   *size = (int *) PG_GETARG_POINTER(1);
+	IntSetSignature *result = new_gist_key(INTSET_GIST_SIGNATURE, INTSET_SIGLEN / sizeof(int32));
+
+	for (int i = 0; i < entryvec->n; i++)
+		merge_signature(INTSET_GIST_WORDS(result),
+		                DatumGetIntSetSignatureP(entryvec->vector[i].key));
+	result = finish_signature(result);
+	*size = VARSIZE(result);
+
+	PG_RETURN_POINTER(result);
+}
+
+/*
+ * Keys are built deterministically, so equal keys have equal bytes
+ */
+PG_FUNCTION_INFO_V1(gist_intset_same);
+
+Datum
+gist_intset_same(PG_FUNCTION_ARGS)
+{
+	IntSetSignature *keyA = DatumGetIntSetSignatureP(PG_GETARG_DATUM(0));
+	IntSetSignature *keyB = DatumGetIntSetSignatureP(PG_GETARG_DATUM(1));
+	bool	   *result = (bool *) PG_GETARG_POINTER(2);
+
+	*result = VARSIZE(keyA) == VARSIZE(keyB) && memcmp(keyA, keyB, VARSIZE(keyA)) == 0;
+	PG_RETURN_POINTER(result);
+}
+
+/*
+ * The penalty is the Hamming distance between the signatures, as the
+ * number of differing bits is what makes a subtree match fewer queries
+ */
+PG_FUNCTION_INFO_V1(gist_intset_penalty);
+
+Datum
+gist_intset_penalty(PG_FUNCTION_ARGS)
+{
+	GISTENTRY  *origentry = (GISTENTRY *) PG_GETARG_POINTER(0);
+	GISTENTRY  *newentry = (GISTENTRY *) PG_GETARG_POINTER(1);
+	float	   *penalty = (float *) PG_GETARG_POINTER(2);
+
+	*penalty = (float) signature_distance(DatumGetIntSetSignatureP(origentry->key),
+	                                      DatumGetIntSetSignatureP(newentry->key));
+	PG_RETURN_POINTER(penalty);
+}
+
+/*
+ * Guttman's quadratic split on Hamming distance: the two keys furthest
+ * apart seed the halves, and the other keys are handed out starting with
+ * those pulled hardest towards one side, each joining the half whose
+ * union it is closer to
+ */
+PG_FUNCTION_INFO_V1(gist_intset_picksplit);
+
+Datum
+gist_intset_picksplit(PG_FUNCTION_ARGS)
+{
+	GistEntryVector *entryvec = (GistEntryVector *) PG_GETARG_POINTER(0);
+	GIST_SPLITVEC *v = (GIST_SPLITVEC *) PG_GETARG_POINTER(1);
+	OffsetNumber maxoff = entryvec->n - 1;
+	uint64	   *words = (uint64 *) palloc((maxoff + 1) * INTSET_SIGLEN);
+	uint64		unionL[INTSET_SIGLEN_WORDS], unionR[INTSET_SIGLEN_WORDS];
+	SplitCost  *costs = (SplitCost *) palloc(maxoff * sizeof(SplitCost));
+	OffsetNumber seedL = FirstOffsetNumber, seedR = OffsetNumberNext(FirstOffsetNumber);
+	int32		waste = -1;
+	IntSetSignature *key;
+
+	// the signatures of every entry, one INTSET_SIGLEN_WORDS row per offset
+#define ENTRY_WORDS(i) (&words[(i) * INTSET_SIGLEN_WORDS])
+	for (OffsetNumber i = FirstOffsetNumber; i <= maxoff; i = OffsetNumberNext(i)) {
+		uint64	   *keyWords = key_words(DatumGetIntSetSignatureP(entryvec->vector[i].key),
+		                                 ENTRY_WORDS(i));
+
+		if (keyWords != ENTRY_WORDS(i)) memcpy(ENTRY_WORDS(i), keyWords, INTSET_SIGLEN);
+	}
+
+	for (OffsetNumber i = FirstOffsetNumber; i < maxoff; i = OffsetNumberNext(i)) {
+		for (OffsetNumber j = OffsetNumberNext(i); j <= maxoff; j = OffsetNumberNext(j)) {
+			int32		distance = words_distance(ENTRY_WORDS(i), ENTRY_WORDS(j));
+
+			if (distance > waste) {
+				waste = distance;
+				seedL = i;
+				seedR = j;
+			}
+		}
+	}
+
+	v->spl_left = (OffsetNumber *) palloc((maxoff + 1) * sizeof(OffsetNumber));
+	v->spl_right = (OffsetNumber *) palloc((maxoff + 1) * sizeof(OffsetNumber));
+	v->spl_nleft = 0;
+	v->spl_nright = 0;
+	memcpy(unionL, ENTRY_WORDS(seedL), INTSET_SIGLEN);
+	memcpy(unionR, ENTRY_WORDS(seedR), INTSET_SIGLEN);
+
+	for (OffsetNumber i = FirstOffsetNumber; i <= maxoff; i = OffsetNumberNext(i)) {
+		costs[i - 1].pos = i;
+		costs[i - 1].cost = Abs(words_distance(unionL, ENTRY_WORDS(i))
+		                        - words_distance(unionR, ENTRY_WORDS(i)));
+	}
+	qsort(costs, maxoff, sizeof(SplitCost), compare_split_cost);
+
+	for (OffsetNumber k = 0; k < maxoff; k++) {
+		OffsetNumber i = costs[k].pos;
+		int32		distanceL, distanceR;
+		uint64	   *side;
+
+		if (i == seedL) {
+			v->spl_left[v->spl_nleft++] = i;
+			continue;
+		}
+		if (i == seedR) {
+			v->spl_right[v->spl_nright++] = i;
+			continue;
+		}
+
+		distanceL = words_distance(unionL, ENTRY_WORDS(i));
+		distanceR = words_distance(unionR, ENTRY_WORDS(i));
+		// ties go to the smaller half to keep the split balanced
+		if (distanceL < distanceR || (distanceL == distanceR && v->spl_nleft <= v->spl_nright)) {
+			v->spl_left[v->spl_nleft++] = i;
+			side = unionL;
+		} else {
+			v->spl_right[v->spl_nright++] = i;
+			side = unionR;
+		}
+		for (int w = 0; w < INTSET_SIGLEN_WORDS; w++)
+			side[w] |= ENTRY_WORDS(i)[w];
+	}
+#undef ENTRY_WORDS
+
+	key = new_gist_key(INTSET_GIST_SIGNATURE, INTSET_SIGLEN / sizeof(int32));
+	memcpy(INTSET_GIST_WORDS(key), unionL, INTSET_SIGLEN);
+	v->spl_ldatum = PointerGetDatum(finish_signature(key));
+	key = new_gist_key(INTSET_GIST_SIGNATURE, INTSET_SIGLEN / sizeof(int32));
+	memcpy(INTSET_GIST_WORDS(key), unionR, INTSET_SIGLEN);
+	v->spl_rdatum = PointerGetDatum(finish_signature(key));
+
+	PG_RETURN_POINTER(v);
+}
+
+
+/*****************************************************************************
+ * Statistics and selectivity
+ *
+ * ANALYZE collects, next to the standard statistics of whole sets, the
+ * most common elements with the fraction of sets holding each, and a
+ * histogram of the set sizes, as array_typanalyze does for arrays. The
+ * estimators assume the elements of a set to be independent.
+ *****************************************************************************/
+
+PG_FUNCTION_INFO_V1(intset_typanalyze);
+
+Datum
+intset_typanalyze(PG_FUNCTION_ARGS)
+{
+	VacAttrStats *stats = (VacAttrStats *) PG_GETARG_POINTER(0);
+	IntSetAnalyzeData *extra;
+
+	if (!std_typanalyze(stats)) PG_RETURN_BOOL(false);
+
+	extra = (IntSetAnalyzeData *) palloc(sizeof(IntSetAnalyzeData));
+	extra->stdComputeStats = stats->compute_stats;
+	extra->stdExtraData = stats->extra_data;
+	stats->extra_data = extra;
+	stats->compute_stats = compute_intset_stats;
+
+	PG_RETURN_BOOL(true);
+}
+
+PG_FUNCTION_INFO_V1(intset_element_sel);
+
+Datum
+intset_element_sel(PG_FUNCTION_ARGS)
+{
+	PlannerInfo *root = (PlannerInfo *) PG_GETARG_POINTER(0);
+	List	   *args = (List *) PG_GETARG_POINTER(2);
+	int			varRelid = PG_GETARG_INT32(3);
+
+	PG_RETURN_FLOAT8(intset_restriction_sel(root, args, varRelid, INTSET_ELEMENT_STRATEGY));
+}
+
+PG_FUNCTION_INFO_V1(intset_contains_sel);
+
+Datum
+intset_contains_sel(PG_FUNCTION_ARGS)
+{
+	PlannerInfo *root = (PlannerInfo *) PG_GETARG_POINTER(0);
+	List	   *args = (List *) PG_GETARG_POINTER(2);
+	int			varRelid = PG_GETARG_INT32(3);
+
+	PG_RETURN_FLOAT8(intset_restriction_sel(root, args, varRelid, INTSET_CONTAINS_STRATEGY));
+}
+
+PG_FUNCTION_INFO_V1(intset_contained_sel);
+
+Datum
+intset_contained_sel(PG_FUNCTION_ARGS)
+{
+	PlannerInfo *root = (PlannerInfo *) PG_GETARG_POINTER(0);
+	List	   *args = (List *) PG_GETARG_POINTER(2);
+	int			varRelid = PG_GETARG_INT32(3);
+
+	PG_RETURN_FLOAT8(intset_restriction_sel(root, args, varRelid, INTSET_CONTAINED_STRATEGY));
+}
+
+PG_FUNCTION_INFO_V1(intset_overlap_sel);
+
+Datum
+intset_overlap_sel(PG_FUNCTION_ARGS)
+{
+	PlannerInfo *root = (PlannerInfo *) PG_GETARG_POINTER(0);
+	List	   *args = (List *) PG_GETARG_POINTER(2);
+	int			varRelid = PG_GETARG_INT32(3);
+
+	PG_RETURN_FLOAT8(intset_restriction_sel(root, args, varRelid, INTSET_OVERLAP_STRATEGY));
+}
+
+PG_FUNCTION_INFO_V1(intset_element_joinsel);
+
+Datum
+intset_element_joinsel(PG_FUNCTION_ARGS)
+{
+	PlannerInfo *root = (PlannerInfo *) PG_GETARG_POINTER(0);
+	List	   *args = (List *) PG_GETARG_POINTER(2);
+	SpecialJoinInfo *sjinfo = (SpecialJoinInfo *) PG_GETARG_POINTER(4);
+
+	PG_RETURN_FLOAT8(intset_join_sel(root, args, sjinfo, INTSET_ELEMENT_STRATEGY));
+}
+
+PG_FUNCTION_INFO_V1(intset_contains_joinsel);
+
+Datum
+intset_contains_joinsel(PG_FUNCTION_ARGS)
+{
+	PlannerInfo *root = (PlannerInfo *) PG_GETARG_POINTER(0);
+	List	   *args = (List *) PG_GETARG_POINTER(2);
+	SpecialJoinInfo *sjinfo = (SpecialJoinInfo *) PG_GETARG_POINTER(4);
+
+	PG_RETURN_FLOAT8(intset_join_sel(root, args, sjinfo, INTSET_CONTAINS_STRATEGY));
+}
+
+PG_FUNCTION_INFO_V1(intset_contained_joinsel);
+
+Datum
+intset_contained_joinsel(PG_FUNCTION_ARGS)
+{
+	PlannerInfo *root = (PlannerInfo *) PG_GETARG_POINTER(0);
+	List	   *args = (List *) PG_GETARG_POINTER(2);
+	SpecialJoinInfo *sjinfo = (SpecialJoinInfo *) PG_GETARG_POINTER(4);
+
+	PG_RETURN_FLOAT8(intset_join_sel(root, args, sjinfo, INTSET_CONTAINED_STRATEGY));
+}
+
+PG_FUNCTION_INFO_V1(intset_overlap_joinsel);
+
+Datum
+intset_overlap_joinsel(PG_FUNCTION_ARGS)
+{
+	PlannerInfo *root = (PlannerInfo *) PG_GETARG_POINTER(0);
+	List	   *args = (List *) PG_GETARG_POINTER(2);
+	SpecialJoinInfo *sjinfo = (SpecialJoinInfo *) PG_GETARG_POINTER(4);
+
+	PG_RETURN_FLOAT8(intset_join_sel(root, args, sjinfo, INTSET_OVERLAP_STRATEGY));
+}
+
+
+/*****************************************************************************
+ * Helper functions
+ *****************************************************************************/
+
+/*
+ * Parse an intset literal such as "{3, -1, 2}" in a single pass
+ * Numbers are converted straight into the result, which is sized for the
+ * most numbers the string could hold, then sorted and deduplicated once
+ */
+IntSet *parse_intset(char *str) {
+	IntSet *result = new_intset(strlen(str) / 2 + 1);
+	bool sorted;
+	int32 size = parse_numbers(str, result->data, &sorted);
+
+	if (!sorted) sort_numbers(result->data, size);
+	set_intset_size(result, remove_duplicates(result->data, size));
+	return compress_intset(result);
+}
+
+/*
+ * Raise the invalid input error for str, pointing at pos
+ */
+void report_syntax_error(const char *type, char *str, char *pos) {
+	ereport(ERROR,
+		(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+			errmsg("invalid input syntax for type %s: \"%s\"",
+				type, str),
+			*pos == '\0' ?
+			errdetail("Unexpected end of input.") :
+			errdetail("Unexpected character \"%.*s\" at position %d.",
+				pg_mblen(pos), pos, (int) (pos - str) + 1)));
+	pg_unreachable();
+}
+
+int compare_int32(const void *a, const void *b) {
+	int32 x = *(const int32 *) a, y = *(const int32 *) b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Sort an array of numbers in place. Large arrays use an LSD radix sort
+ * over three digits of 11, 11 and 10 bits, which runs in linear time
+ */
+void sort_numbers(int32 *data, int32 size) {
+	uint32 *keys = (uint32 *) data, *buf, *from, *to;
+	int32 counts[3][2048];
+
+	if (size < 1024) {
+		qsort(data, size, sizeof(int32), compare_int32);
+		return;
+	}
+
+	// flipping the sign bit makes the unsigned order match the signed one
+	memset(counts, 0, sizeof(counts));
+	for (int i = 0; i < size; i++) {
+		uint32 key = keys[i] ^ 0x80000000;
+
+		counts[0][key & 0x7FF]++;
+		counts[1][(key >> 11) & 0x7FF]++;
+		counts[2][key >> 22]++;
+	}
+
+	buf = (uint32 *) palloc(size * sizeof(uint32));
+	from = keys;
+	to = buf;
+	for (int pass = 0; pass < 3; pass++) {
+		int shift = pass * 11;
+		int32 offset = 0;
+
+		for (int d = 0; d < 2048; d++) {
+			int32 count = counts[pass][d];
+
+			counts[pass][d] = offset;
+			offset += count;
+		}
+		for (int i = 0; i < size; i++) {
+			uint32 key = from[i] ^ 0x80000000;
+
+			to[counts[pass][(key >> shift) & 0x7FF]++] = from[i];
+		}
+		from = to;
+		to = (to == buf) ? keys : buf;
+	}
+	// three passes leave the result in buf
+	memcpy(keys, buf, size * sizeof(uint32));
+	pfree(buf);
+}
+
+/*
+ * Decide whether the two sizes are skewed enough to gallop through the
+ * larger set, see intset.gallop_ratio
+ */
+bool use_galloping(const char *op, int32 sizeA, int32 sizeB) {
+	int32 small = Min(sizeA, sizeB), large = Max(sizeA, sizeB);
+	bool gallop = gallop_ratio > 0 && (int64) small * gallop_ratio <= large;
+
+	elog(DEBUG2, "intset %s of %d and %d elements: %s",
+		 op, sizeA, sizeB, gallop ? "galloping" : current_set_kernels()->name);
+	return gallop;
+}
+
+/*
+ * Check if intSet A contain all the values in intSet B
+ * for every element of B, it is an element of A
+ * i.e. A >@ B
+ */
+bool is_subset(int32 *dataA, int32 sizeA, int32 *dataB, int32 sizeB) {
+	if (sizeB == 0) return true;
+	if (sizeB > sizeA || dataB[0] < dataA[0] || dataB[sizeB - 1] > dataA[sizeA - 1])
+		return false;
+
+	if (use_galloping("subset", sizeA, sizeB)) return gallop_subset(dataA, sizeA, dataB, sizeB);
+	return current_set_kernels()->subset(dataA, sizeA, dataB, sizeB);
+}
+
+/*
+ * Check whether two intSets are the same
+ */
+bool is_equal(int32 *dataA, int32 sizeA, int32 *dataB, int32 sizeB) {
+	if (sizeA != sizeB) return false;
+	for (int i = 0; i < sizeA; i++) {
+		if (dataA[i] != dataB[i]) return false;
+	}
+	return true;
+}
+
+/*
+ * Allocate an IntSet able to hold up to maxSize elements, plus the slack
+ * the set kernels may write past their result
+ * The actual size is filled in by set_intset_size once it is known
+ */
+IntSet *new_intset(int32 maxSize) {
+	IntSet *intSet;
+
+	intSet = (IntSet *) palloc(INTSET_HEADER_SIZE + (maxSize + INTSET_KERNEL_SLACK) * sizeof(int32));
+	SET_INTSET_HEADER(intSet, 0, INTSET_FORMAT_ARRAY);
+	return intSet;
+}
+
+/*
+ * Record the number of elements of an array set and the matching varlena
+ * length
+ */
+void set_intset_size(IntSet *intSet, int32 size) {
+	SET_INTSET_HEADER(intSet, size, INTSET_FORMAT_ARRAY);
+	SET_VARSIZE(intSet, INTSET_HEADER_SIZE + size * sizeof(int32));
+}
+
+/*
+ * Intersection of the two sorted arrays, galloping when the sizes are
+ * skewed and running the set kernels otherwise
+ * result must have room for Min(sizeA, sizeB) numbers
+ */
+int32 get_intersection(int32 *dataA, int32 sizeA,
+                       int32 *dataB, int32 sizeB, int32 *result) {
+	if (use_galloping("intersection", sizeA, sizeB))
+		return gallop_intersection(dataA, sizeA, dataB, sizeB, result);
+	return current_set_kernels()->intersection(dataA, sizeA, dataB, sizeB, result);
+}
+
+/*
+ * Size of the intersection of the two sorted arrays, galloping or
+ * running the set kernels as get_intersection does
+ */
+int32 get_intersection_count(int32 *dataA, int32 sizeA, int32 *dataB, int32 sizeB) {
+	if (use_galloping("intersection", sizeA, sizeB))
+		return gallop_intersection_count(dataA, sizeA, dataB, sizeB);
+	return current_set_kernels()->intersection_count(dataA, sizeA, dataB, sizeB);
+}
+
+/*
+ * Union of the two sorted arrays
+ * result must have room for sizeA + sizeB numbers
+ */
+int32 get_union(int32 *dataA, int32 sizeA,
+                int32 *dataB, int32 sizeB, int32 *result) {
+	return current_set_kernels()->set_union(dataA, sizeA, dataB, sizeB, result);
+}
+
+/*
+ * Numbers of setA not in setB, galloping when the sizes are skewed and
+ * running the set kernels otherwise
+ * result must have room for sizeA numbers
+ */
+int32 get_difference(int32 *dataA, int32 sizeA,
+                     int32 *dataB, int32 sizeB, int32 *result) {
+	if (use_galloping("difference", sizeA, sizeB))
+		return gallop_difference(dataA, sizeA, dataB, sizeB, result);
+	return current_set_kernels()->difference(dataA, sizeA, dataB, sizeB, result);
+}
+
+/*****************************************************************************
+ * Expanded intsets
+ *****************************************************************************/
+
+static const ExpandedObjectMethods expanded_intset_methods = {
+	expanded_flat_size,
+	expanded_flatten_into
+};
+
+/*
+ * Build a new read-write expanded set holding the same numbers as the
+ * given intSet datum, flat or expanded, in a child of parentContext
+ */
+ExpandedIntSet *expand_intset(Datum intSetDatum, MemoryContext parentContext) {
+	ExpandedIntSet *source = get_expanded(intSetDatum);
+	MemoryContext context;
+	ExpandedIntSet *eis;
+	int32 *data, size;
+
+	context = AllocSetContextCreate(parentContext, "expanded intset", ALLOCSET_START_SMALL_SIZES);
+	eis = (ExpandedIntSet *) MemoryContextAlloc(context, sizeof(ExpandedIntSet));
+	EOH_init_header(&eis->hdr, &expanded_intset_methods, context);
+	eis->ei_magic = INTSET_EXPANDED_MAGIC;
+	eis->flat = NULL;
+
+	if (source != NULL) {
+		// the tail is copied unsorted, it will be sorted once for the copy
+		data = source->numbers;
+		size = source->count;
+		eis->sorted = source->sorted;
+	} else {
+		IntSet *intSet = DatumGetIntSetP(intSetDatum);
+
+		data = intset_numbers(intSet);
+		size = INTSET_SIZE(intSet);
+		eis->sorted = size;
+	}
+	eis->count = size;
+	eis->allocated = Max(size, INTSET_KERNEL_SLACK);
+	eis->numbers = (int32 *) MemoryContextAlloc(context,
+	                                            (eis->allocated + INTSET_KERNEL_SLACK) * sizeof(int32));
+	memcpy(eis->numbers, data, size * sizeof(int32));
+	return eis;
+}
+
+/*
+ * The expanded set a datum points to, or NULL if it is a flat one
+ */
+ExpandedIntSet *get_expanded(Datum intSetDatum) {
+	ExpandedIntSet *eis;
+
+	if (!VARATT_IS_EXTERNAL_EXPANDED(DatumGetPointer(intSetDatum))) return NULL;
+	eis = (ExpandedIntSet *) DatumGetEOHP(intSetDatum);
+	Assert(eis->ei_magic == INTSET_EXPANDED_MAGIC);
+	return eis;
+}
+
+/*
+ * Add sorted numbers to an expanded set
+ * A few are appended to the tail; many are merged right away, since
+ * they come sorted and merging beats sorting them again later
+ */
+void add_numbers(ExpandedIntSet *eis, int32 *data, int32 size) {
+	if (eis->flat != NULL) {
+		pfree(eis->flat);
+		eis->flat = NULL;
+	}
+
+	if (size >= INTSET_BLOCK_SIZE) {
+		int32 *merged;
+
+		sort_expanded(eis);
+		merged = (int32 *) MemoryContextAlloc(eis->hdr.eoh_context,
+		                                      (eis->sorted + size + INTSET_KERNEL_SLACK) * sizeof(int32));
+		eis->allocated = eis->sorted + size;
+		eis->sorted = eis->count = get_union(eis->numbers, eis->sorted, data, size, merged);
+		pfree(eis->numbers);
+		eis->numbers = merged;
+		return;
+	}
+
+	if (eis->count + size > eis->allocated) {
+		eis->allocated = Max(eis->allocated * 2, eis->count + size);
+		eis->numbers = (int32 *) repalloc(eis->numbers,
+		                                  (eis->allocated + INTSET_KERNEL_SLACK) * sizeof(int32));
+	}
+	memcpy(&eis->numbers[eis->count], data, size * sizeof(int32));
+	eis->count += size;
+}
+
+/*
+ * Sort the tail of an expanded set into its head
+ * This does not change the set, so it is done on read-only ones too
+ */
+void sort_expanded(ExpandedIntSet *eis) {
+	int32 *tail = &eis->numbers[eis->sorted], tailSize = eis->count - eis->sorted;
+	int32 *merged;
+
+	if (tailSize == 0) return;
+	sort_numbers(tail, tailSize);
+	tailSize = remove_duplicates(tail, tailSize);
+
+	merged = (int32 *) MemoryContextAlloc(eis->hdr.eoh_context,
+	                                      (eis->sorted + tailSize + INTSET_KERNEL_SLACK) * sizeof(int32));
+	eis->allocated = eis->sorted + tailSize;
+	eis->sorted = eis->count = get_union(eis->numbers, eis->sorted, tail, tailSize, merged);
+	pfree(eis->numbers);
+	eis->numbers = merged;
+}
+
+/*
+ * Size of the flat form, which is built here and kept until the set
+ * changes, since flatten_into has to produce exactly this many bytes
+ */
+Size expanded_flat_size(ExpandedObjectHeader *eohptr) {
+	ExpandedIntSet *eis = (ExpandedIntSet *) eohptr;
+
+	Assert(eis->ei_magic == INTSET_EXPANDED_MAGIC);
+	if (eis->flat == NULL) {
+		IntSet *flat;
+
+		sort_expanded(eis);
+		flat = new_intset(eis->sorted);
+		memcpy(flat->data, eis->numbers, eis->sorted * sizeof(int32));
+		set_intset_size(flat, eis->sorted);
+		flat = compress_intset(flat);
+
+		eis->flat = (IntSet *) MemoryContextAlloc(eis->hdr.eoh_context, VARSIZE(flat));
+		memcpy(eis->flat, flat, VARSIZE(flat));
+		pfree(flat);
+	}
+	return VARSIZE(eis->flat);
+}
+
+void expanded_flatten_into(ExpandedObjectHeader *eohptr, void *result, Size allocatedSize) {
+	ExpandedIntSet *eis = (ExpandedIntSet *) eohptr;
+
+	Assert(eis->flat != NULL && allocatedSize == VARSIZE(eis->flat));
+	memcpy(result, eis->flat, allocatedSize);
+}
+
+/*****************************************************************************
+ * Aggregate states
+ *****************************************************************************/
+
+/*
+ * Build a union or intersection state holding a copy of the sorted
+ * numbers in context, or an intersection state that has not seen a set
+ * yet if data is NULL
+ */
+IntSetAggState *new_agg_state(MemoryContext context, int32 *data, int32 size) {
+	IntSetAggState *state;
+
+	state = (IntSetAggState *) MemoryContextAllocZero(context, sizeof(IntSetAggState));
+	if (data == NULL) return state;
+
+	state->sorted = state->count = size;
+	state->allocated = Max(size, INTSET_KERNEL_SLACK);
+	state->numbers = (int32 *) MemoryContextAlloc(context,
+	                                              (state->allocated + INTSET_KERNEL_SLACK) * sizeof(int32));
+	memcpy(state->numbers, data, size * sizeof(int32));
+	return state;
+}
+
+/*
+ * Copy a state into context, merging its tail on the way
+ */
+IntSetAggState *copy_agg_state(MemoryContext context, IntSetAggState *state) {
+	IntSetAggState *copy;
+
+	if (state->numbers == NULL && state->bitmap == NULL) return new_agg_state(context, NULL, 0);
+	if (state->bitmap == NULL) {
+		flush_agg_state(state);
+		return new_agg_state(context, state->numbers, state->count);
+	}
+
+	copy = (IntSetAggState *) MemoryContextAlloc(context, sizeof(IntSetAggState));
+	*copy = *state;
+	copy->bitmap = (uint64 *) MemoryContextAlloc(context, state->nwords * sizeof(uint64));
+	memcpy(copy->bitmap, state->bitmap, state->nwords * sizeof(uint64));
+	return copy;
+}
+
+/*
+ * Add sorted numbers to a union state
+ * Bitmaps set their bits straight away. Arrays append the numbers to
+ * their tail, which is sorted and merged once it is larger than the head,
+ * so every number takes part in a logarithmic number of merges however
+ * small the inputs are.
+ */
+void agg_add_numbers(IntSetAggState *state, int32 *data, int32 size) {
+	if (size == 0) return;
+
+	if (state->bitmap != NULL && extend_agg_bitmap(state, data[0], data[size - 1], size)) {
+		for (int i = 0; i < size; i++) {
+			uint64 offset = (uint64) ((int64) data[i] - state->base);
+			uint64 bit = UINT64CONST(1) << (offset % 64);
+
+			state->count += (state->bitmap[offset / 64] & bit) == 0;
+			state->bitmap[offset / 64] |= bit;
+		}
+		return;
+	}
+
+	if (state->count + size > state->allocated) {
+		state->allocated = Max(state->allocated * 2, state->count + size);
+		state->numbers = (int32 *) repalloc(state->numbers,
+		                                    (state->allocated + INTSET_KERNEL_SLACK) * sizeof(int32));
+	}
+	memcpy(&state->numbers[state->count], data, size * sizeof(int32));
+	state->count += size;
+	if (state->count - state->sorted > Max(state->sorted, INTSET_AGG_MIN_TAIL)) {
+		flush_agg_state(state);
+		agg_array_to_bitmap(state);
+	}
+}
+
+/*
+ * Sort the tail of a union state into its head
+ * This does not change the set, so final functions may do it too
+ */
+void flush_agg_state(IntSetAggState *state) {
+	int32 *tail = &state->numbers[state->sorted], tailSize = state->count - state->sorted;
+	int32 *merged;
+
+	if (state->bitmap != NULL || tailSize == 0) return;
+	sort_numbers(tail, tailSize);
+	tailSize = remove_duplicates(tail, tailSize);
+
+	merged = (int32 *) MemoryContextAlloc(GetMemoryChunkContext(state),
+	                                      (state->sorted + tailSize + INTSET_KERNEL_SLACK) * sizeof(int32));
+	state->allocated = state->sorted + tailSize;
+	state->sorted = state->count = get_union(state->numbers, state->sorted, tail, tailSize, merged);
+	pfree(state->numbers);
+	state->numbers = merged;
+}
+
+/*
+ * Switch a flushed union state to a bitmap if that would take no more
+ * memory than its numbers
+ */
+void agg_array_to_bitmap(IntSetAggState *state) {
+	int64 range;
+
+	if (state->count < INTSET_BLOCK_SIZE) return;
+	range = (int64) state->numbers[state->count - 1] - state->numbers[0] + 1;
+	if (range / BITS_PER_BYTE > state->count * (int64) sizeof(int32)) return;
+
+	state->base = state->numbers[0] - (((int64) state->numbers[0] % 64) + 64) % 64;
+	state->nwords = (int32) ((state->numbers[state->count - 1] - state->base) / 64 + 1);
+	state->bitmap = (uint64 *) MemoryContextAllocZero(GetMemoryChunkContext(state),
+	                                                  state->nwords * sizeof(uint64));
+	for (int i = 0; i < state->count; i++) {
+		uint64 offset = (uint64) ((int64) state->numbers[i] - state->base);
+
+		state->bitmap[offset / 64] |= UINT64CONST(1) << (offset % 64);
+	}
+	pfree(state->numbers);
+	state->numbers = NULL;
+	state->sorted = state->allocated = 0;
+}
+
+/*
+ * Grow the bitmap of a union state to cover first to last, before size
+ * more numbers are added. When that would make the bitmap twice the
+ * size of the numbers, they are decoded back into an array instead and
+ * false is returned.
+ */
+bool extend_agg_bitmap(IntSetAggState *state, int32 first, int32 last, int32 size) {
+	int64 end = state->base + (int64) state->nwords * 64;
+	int64 base = state->base, newEnd = end;
+	int32 nwords;
+	uint64 *bitmap;
+
+	if (first >= base && last < end) return true;
+	if (first < base) base = first - (((int64) first % 64) + 64) % 64;
+	if (last >= end) newEnd = last - (((int64) last % 64) + 64) % 64 + 64;
+
+	nwords = (int32) ((newEnd - base) / 64);
+	if ((int64) nwords * sizeof(uint64) > ((int64) state->count + size) * sizeof(int32) * 2) {
+		agg_bitmap_to_array(state);
+		return false;
+	}
+
+	bitmap = (uint64 *) MemoryContextAllocZero(GetMemoryChunkContext(state), nwords * sizeof(uint64));
+	memcpy(&bitmap[(state->base - base) / 64], state->bitmap, state->nwords * sizeof(uint64));
+	pfree(state->bitmap);
+	state->bitmap = bitmap;
+	state->base = base;
+	state->nwords = nwords;
+	return true;
+}
+
+/*
+ * Turn the bitmap of a union state back into sorted numbers
+ */
+void agg_bitmap_to_array(IntSetAggState *state) {
+	int32 n = 0;
+
+	state->allocated = Max(state->count, INTSET_KERNEL_SLACK);
+	state->numbers = (int32 *) MemoryContextAlloc(GetMemoryChunkContext(state),
+	                                              (state->allocated + INTSET_KERNEL_SLACK) * sizeof(int32));
+	for (int w = 0; w < state->nwords; w++) {
+		for (uint64 word = state->bitmap[w]; word != 0; word &= word - 1)
+			state->numbers[n++] = (int32) (state->base + w * 64 + pg_rightmost_one_pos64(word));
+	}
+	Assert(n == state->count);
+	state->sorted = n;
+	pfree(state->bitmap);
+	state->bitmap = NULL;
+	state->base = 0;
+	state->nwords = 0;
+}
+
+/*
+ * Intersect an intersection state with intSet
+ * Sets in the other formats are probed one number at a time when the
+ * state is so much smaller that galloping would pay off, rather than
+ * decoded whole.
+ */
+void agg_intersect(IntSetAggState *state, IntSet *intSet) {
+	int32 size = 0;
+
+	if (INTSET_FORMAT(intSet) == INTSET_FORMAT_ARRAY || state->count >= INTSET_SIZE(intSet)
+	    || !use_galloping("intersection", state->count, INTSET_SIZE(intSet))) {
+		agg_intersect_numbers(state, intset_numbers(intSet), INTSET_SIZE(intSet));
+		return;
+	}
+
+	// the result never overtakes the numbers it is read from
+	for (int i = 0; i < state->count; i++) {
+		if (intset_has(intSet, state->numbers[i]))
+			state->numbers[size++] = state->numbers[i];
+	}
+	state->sorted = state->count = size;
+}
+
+/*
+ * Intersect an intersection state with the sorted numbers
+ */
+void agg_intersect_numbers(IntSetAggState *state, int32 *data, int32 size) {
+	int32 *result;
+
+	result = (int32 *) MemoryContextAlloc(GetMemoryChunkContext(state),
+	                                      (Min(state->count, size) + INTSET_KERNEL_SLACK) * sizeof(int32));
+	state->allocated = Min(state->count, size);
+	state->sorted = state->count = get_intersection(state->numbers, state->count, data, size, result);
+	pfree(state->numbers);
+	state->numbers = result;
+}
+
+/*
+ * The sorted numbers of a state, decoded into the current memory context
+ * if it holds a bitmap
+ */
+int32 *agg_numbers(IntSetAggState *state) {
+	int32 *result, n = 0;
+
+	if (state->bitmap == NULL) {
+		flush_agg_state(state);
+		if (state->bitmap == NULL) return state->numbers;
+	}
+
+	result = (int32 *) palloc((state->count + INTSET_KERNEL_SLACK) * sizeof(int32));
+	for (int w = 0; w < state->nwords; w++) {
+		for (uint64 word = state->bitmap[w]; word != 0; word &= word - 1)
+			result[n++] = (int32) (state->base + w * 64 + pg_rightmost_one_pos64(word));
+	}
+	return result;
+}
+
+/*
+ * Flat, compressed intset of the numbers of a state, in the current
+ * memory context
+ */
+IntSet *agg_state_intset(IntSetAggState *state) {
+	int32 *data = agg_numbers(state);
+	IntSet *result = new_intset(state->count);
+
+	memcpy(result->data, data, state->count * sizeof(int32));
+	set_intset_size(result, state->count);
+	if (data != state->numbers) pfree(data);
+	return compress_intset(result);
+}
+
+/*****************************************************************************
+ * Reading in order
+ *****************************************************************************/
+
+/*
+ * Start reading intSet from its first number, which the first call to
+ * next_elements makes available
+ */
+void init_elements(IntSetElements *state, IntSet *intSet) {
+	init_block_reader(&state->reader, intSet);
+	state->numbers = NULL;
+	state->count = state->pos = state->next = 0;
+	state->chunk = NULL;
+	if (INTSET_FORMAT(intSet) == INTSET_FORMAT_ROARING && INTSET_SIZE(intSet) > 0) {
+		int32 largest = 0;
+
+		// room for the largest chunk only
+		for (int32 c = 0; c < ROARING_NCHUNKS(intSet); c++)
+			largest = Max(largest, ROARING_CHUNKS(intSet)[c].cardinality);
+		state->chunk = (int32 *) palloc((largest + INTSET_KERNEL_SLACK) * sizeof(int32));
+	}
+}
+
+/*
+ * Move on to the next block or chunk, or return false after the last one
+ */
+bool next_elements(IntSetElements *state) {
+	IntSet *intSet = state->reader.intSet;
+
+	if (state->chunk != NULL) {
+		if (state->next == ROARING_NCHUNKS(intSet)) return false;
+		state->count = roaring_decode(&ROARING_CHUNKS(intSet)[state->next], 1,
+		                              ROARING_CONTAINERS(intSet), state->chunk);
+		state->numbers = state->chunk;
+	} else {
+		if (state->next == INTSET_NBLOCKS(INTSET_SIZE(intSet))) return false;
+		state->count = block_count(intSet, state->next);
+		state->numbers = read_block(&state->reader, state->next);
+	}
+	state->pos = 0;
+	state->next++;
+	return true;
+}
+
+/*
+ * Restore the order of a min-heap of inputs, keyed by their next number,
+ * below position i
+ */
+void sift_elements(IntSetElements *inputs, int32 *heap, int32 size, int32 i) {
+	int32 top = heap[i];
+	int32 num = inputs[top].numbers[inputs[top].pos];
+
+	for (;;) {
+		int32 child = 2 * i + 1;
+		int32 childNum;
+
+		if (child >= size) break;
+		if (child + 1 < size
+		    && inputs[heap[child + 1]].numbers[inputs[heap[child + 1]].pos]
+		       < inputs[heap[child]].numbers[inputs[heap[child]].pos])
+			child++;
+		childNum = inputs[heap[child]].numbers[inputs[heap[child]].pos];
+		if (num <= childNum) break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = top;
+}
+
+/*
+ * The non-NULL sets of a variadic intSet[] argument, detoasted
+ */
+int32 variadic_intsets(ArrayType *array, IntSet ***sets) {
+	Datum *elems;
+	bool *nulls;
+	int nelems, nsets = 0;
+	int16 typlen;
+	bool typbyval;
+	char typalign;
+
+	get_typlenbyvalalign(ARR_ELEMTYPE(array), &typlen, &typbyval, &typalign);
+	deconstruct_array(array, ARR_ELEMTYPE(array), typlen, typbyval, typalign, &elems, &nulls, &nelems);
+
+	*sets = (IntSet **) palloc(Max(nelems, 1) * sizeof(IntSet *));
+	for (int i = 0; i < nelems; i++) {
+		if (!nulls[i]) (*sets)[nsets++] = DatumGetIntSetP(elems[i]);
+	}
+	return nsets;
+}
+
+/*
+ * qsort comparator ordering sets by size
+ */
+int compare_intset_size(const void *a, const void *b) {
+	int32 sizeA = INTSET_SIZE(*(IntSet * const *) a), sizeB = INTSET_SIZE(*(IntSet * const *) b);
+
+	return (sizeA > sizeB) - (sizeA < sizeB);
+}
+
+/*****************************************************************************
+ * Probe cache
+ *
+ * Filters such as user_id ? '{...}' test each row against the same
+ * constant set. Its probe is built once per call site, in fn_mcxt, so the
+ * rows neither detoast nor unpack it again. Only Const arguments are
+ * cached: a PL/pgSQL variable is an external Param too, but may get a new
+ * value at the same address between calls.
+ *****************************************************************************/
+
+bool arg_is_const(FmgrInfo *flinfo, int argno) {
+	Node *expr = flinfo->fn_expr;
+	List *args;
+
+	if (expr == NULL) return false;
+	if (IsA(expr, FuncExpr)) args = ((FuncExpr *) expr)->args;
+	else if (IsA(expr, OpExpr)) args = ((OpExpr *) expr)->args;
+	else return false;
+	return argno < list_length(args) && IsA(list_nth(args, argno), Const);
+}
+
+/*
+ * The probe of argument argno, or NULL when it is not a constant
+ */
+IntSetProbe *get_probe(FunctionCallInfo fcinfo, int argno) {
+	FmgrInfo *flinfo = fcinfo->flinfo;
+	IntSetProbe *probe;
+	MemoryContext oldContext;
+	IntSet *intSet;
+
+	if (flinfo == NULL) return NULL;
+	probe = (IntSetProbe *) flinfo->fn_extra;
+	if (probe != NULL && probe->argno == argno && probe->datum == PG_GETARG_DATUM(argno))
+		return probe;
+	if (!arg_is_const(flinfo, argno)) return NULL;
+
+	oldContext = MemoryContextSwitchTo(flinfo->fn_mcxt);
+	probe = (IntSetProbe *) palloc(sizeof(IntSetProbe));
+	probe->argno = argno;
+	probe->datum = PG_GETARG_DATUM(argno);
+	intSet = DatumGetIntSetP(probe->datum);
+	if (INTSET_FORMAT(intSet) != INTSET_FORMAT_ARRAY) {
+		IntSet *flat = new_intset(INTSET_SIZE(intSet));
+
+		memcpy(flat->data, intset_numbers(intSet), INTSET_SIZE(intSet) * sizeof(int32));
+		set_intset_size(flat, INTSET_SIZE(intSet));
+		intSet = flat;
+	}
+	probe->intSet = intSet;
+	probe->layout = (int32 *) palloc((INTSET_SIZE(intSet) + 1) * sizeof(int32));
+	eytzinger_fill(intSet->data, probe->layout, INTSET_SIZE(intSet), 0, 1);
+	MemoryContextSwitchTo(oldContext);
+
+	flinfo->fn_extra = probe;
+	return probe;
+}
+
+/*
+ * Lay sorted numbers out as an implicit binary search tree in breadth
+ * first order, the children of node k being 2k and 2k + 1. The top levels
+ * of every search share the same few cache lines.
+ */
+int32 eytzinger_fill(int32 *numbers, int32 *layout, int32 size, int32 pos, int32 node) {
+	if (node > size) return pos;
+	pos = eytzinger_fill(numbers, layout, size, pos, 2 * node);
+	layout[node] = numbers[pos++];
+	return eytzinger_fill(numbers, layout, size, pos, 2 * node + 1);
+}
+
+/*
+ * Branch-free descent to the first number not less than num: the trailing
+ * ones of the final node are the right turns taken below it
+ */
+bool probe_has(IntSetProbe *probe, int32 num) {
+	int32 *layout = probe->layout;
+	uint32 size = INTSET_SIZE(probe->intSet), node = 1;
+
+	while (node <= size)
+		node = 2 * node + (layout[node] < num);
+	node >>= pg_rightmost_one_pos32(~node) + 1;
+	return node != 0 && layout[node] == num;
+}
+
+/*
+ * Check whether intSet is a subset of the probed set, probing number by
+ * number when intSet is small enough next to it
+ */
+bool probe_is_subset(IntSetProbe *probe, IntSet *intSet) {
+	int32 *data;
+
+	if (INTSET_SIZE(intSet) > INTSET_SIZE(probe->intSet)) return false;
+	if (!use_galloping("subset", INTSET_SIZE(probe->intSet), INTSET_SIZE(intSet)))
+		return intset_is_subset(probe->intSet, intSet);
+
+	data = intset_numbers(intSet);
+	for (int32 i = 0; i < INTSET_SIZE(intSet); i++)
+		if (!probe_has(probe, data[i])) return false;
+	return true;
+}
+
+/*****************************************************************************
+ * Index conditions
+ *****************************************************************************/
+
+/*
+ * Position of the set among the arguments of either ? function
+ */
+int element_set_argno(List *args) {
+	return exprType((Node *) linitial(args)) == INT4OID ? 1 : 0;
+}
+
+/*
+ * Index clauses for key ? intSet on an index of key: an exact = ANY over
+ * the numbers when the index searches arrays and the set is small, or
+ * else a lossy range between its extremes. NIL when the operator family
+ * lacks the operators needed.
+ */
+List *element_index_quals(SupportRequestIndexCondition *req, Node *key, Datum intSetDatum) {
+	IntSet *intSet = DatumGetIntSetP(intSetDatum);
+	Expr *lower, *upper;
+	int32 first, last;
+
+	if (INTSET_SIZE(intSet) == 0) return NIL;
+
+	if (req->index->amsearcharray && INTSET_SIZE(intSet) <= INTSET_INDEX_MAX_KEYS) {
+		Oid eqop = get_opfamily_member(req->opfamily, exprType(key), INT4OID, BTEqualStrategyNumber);
+
+		if (OidIsValid(eqop)) {
+			ScalarArrayOpExpr *saop = makeNode(ScalarArrayOpExpr);
+			int32 *data = intset_numbers(intSet);
+			Datum *elems = (Datum *) palloc(INTSET_SIZE(intSet) * sizeof(Datum));
+
+			for (int32 i = 0; i < INTSET_SIZE(intSet); i++)
+				elems[i] = Int32GetDatum(data[i]);
+			saop->opno = eqop;
+			saop->opfuncid = get_opcode(eqop);
+			saop->useOr = true;
+			saop->inputcollid = InvalidOid;
+			saop->args = list_make2(key, makeConst(INT4ARRAYOID, -1, InvalidOid, -1,
+			                                       PointerGetDatum(construct_array(elems, INTSET_SIZE(intSet), INT4OID,
+			                                                                       sizeof(int32), true, 'i')),
+			                                       false, false));
+			saop->location = -1;
+			req->lossy = false;
+			return list_make1(saop);
+		}
+	}
+
+	intset_bound(intSetDatum, false, &first);
+	intset_bound(intSetDatum, true, &last);
+	lower = index_comparison(req->opfamily, key, BTGreaterEqualStrategyNumber, first);
+	upper = index_comparison(req->opfamily, key, BTLessEqualStrategyNumber, last);
+	if (lower == NULL || upper == NULL) return NIL;
+	req->lossy = true;
+	return list_make2(lower, upper);
+}
+
+/*
+ * key compared with num by the operator of the family at strategy, NULL
+ * if there is none
+ */
+Expr *index_comparison(Oid opfamily, Node *key, StrategyNumber strategy, int32 num) {
+	Oid opno = get_opfamily_member(opfamily, exprType(key), INT4OID, strategy);
+
+	if (!OidIsValid(opno)) return NULL;
+	return make_opclause(opno, BOOLOID, false, (Expr *) key,
+	                     (Expr *) makeConst(INT4OID, -1, InvalidOid, sizeof(int32), Int32GetDatum(num),
+	                                        false, true),
+	                     InvalidOid, InvalidOid);
+}
+
+/*****************************************************************************
+ * Integer arrays
+ *****************************************************************************/
+
+/*
+ * The numbers of a one-dimensional int4[], read in place
+ */
+int32 *array_numbers(ArrayType *array, int32 *size) {
+	if (ARR_NDIM(array) > 1)
+		ereport(ERROR,
+			(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				errmsg("array must be one-dimensional")));
+	if (array_contains_nulls(array))
+		ereport(ERROR,
+			(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				errmsg("array must not contain nulls")));
+
+	*size = ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array));
+	return (int32 *) ARR_DATA_PTR(array);
+}
+
+/*
+ * Check whether the numbers are sorted and free of duplicates
+ */
+bool numbers_ascending(int32 *data, int32 size) {
+	for (int32 i = 1; i < size; i++)
+		if (data[i - 1] >= data[i]) return false;
+	return true;
+}
+
+/*
+ * Check whether intSet holds all the numbers, or any of them. Sorted
+ * numbers are merged with an array set and walk a packed one block by
+ * block; the others are probed one at a time.
+ */
+bool intset_has_numbers(IntSet *intSet, int32 *data, int32 size, bool all) {
+	BlockReader reader;
+	int32 block = 0;
+	bool ascending, found;
+
+	if (size == 0 || INTSET_SIZE(intSet) == 0) return all ? size == 0 : false;
+
+	ascending = numbers_ascending(data, size);
+	if (ascending && INTSET_FORMAT(intSet) == INTSET_FORMAT_ARRAY)
+		return all ? is_subset(intSet->data, INTSET_SIZE(intSet), data, size)
+		           : numbers_overlap(intSet->data, INTSET_SIZE(intSet), data, size);
+	if (ascending && INTSET_FORMAT(intSet) == INTSET_FORMAT_PACKED) init_block_reader(&reader, intSet);
+
+	for (int32 i = 0; i < size; i++) {
+		if (ascending && INTSET_FORMAT(intSet) == INTSET_FORMAT_PACKED)
+			found = probe_number(&reader, &block, data[i]);
+		else
+			found = intset_has(intSet, data[i]);
+		if (found != all) return found;
+	}
+	return all;
+}
+
+/*****************************************************************************
+ * Partial reads
+ *
+ * The type is stored uncompressed out of line (STORAGE external), so a
+ * slice of a large set costs only the TOAST chunks it lies in. The packed
+ * and roaring formats are compressed already, pglz would gain little.
+ * bigintset has no such formats and keeps the default STORAGE extended,
+ * so a compressed value is decompressed whole before the slice is taken.
+ *****************************************************************************/
+
+/*
+ * Copy length bytes of an intset datum, starting offset bytes into the
+ * IntSet struct
+ */
+void read_intset_slice(Datum intSetDatum, Size offset, Size length, void *result) {
+	struct varlena *slice = PG_DETOAST_DATUM_SLICE(intSetDatum, offset - VARHDRSZ, length);
+
+	if (VARSIZE_ANY_EXHDR(slice) < length)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("intset value is truncated")));
+	memcpy(result, VARDATA_ANY(slice), length);
+	pfree(slice);
+}
+
+/*
+ * Find the smallest or, if last is set, the largest number of a set,
+ * reading as little of it as its format allows
+ * Returns false for an empty set
+ */
+bool intset_bound(Datum intSetDatum, bool last, int32 *result) {
+	ExpandedIntSet *eis = get_expanded(intSetDatum);
+	uint32 header;
+	int32 first;            // first word of data
+	int32 size, format;
+	Size dataStart = offsetof(IntSet, data);
+
+	if (eis != NULL) {
+		sort_expanded(eis);
+		if (eis->sorted == 0) return false;
+		*result = eis->numbers[last ? eis->sorted - 1 : 0];
+		return true;
+	}
+
+	// an empty set ends before the first word of data
+	read_intset_slice(intSetDatum, offsetof(IntSet, header), sizeof(uint32), &header);
+	size = (int32) (header & INTSET_MAX_SIZE);
+	format = (int32) (header >> INTSET_FORMAT_SHIFT);
+	if (size == 0) return false;
+	read_intset_slice(intSetDatum, dataStart, sizeof(int32), &first);
+
+	if (format == INTSET_FORMAT_ARRAY) {
+		if (!last) *result = first;
+		else read_intset_slice(intSetDatum, dataStart + (size - 1) * sizeof(int32), sizeof(int32), result);
+	} else if (format == INTSET_FORMAT_PACKED) {
+		// the first block header starts with the smallest number
+		if (!last) *result = first;
+		else read_intset_slice(intSetDatum,
+		                       dataStart + (INTSET_NBLOCKS(size) - 1) * sizeof(IntSetBlock)
+		                       + offsetof(IntSetBlock, last),
+		                       sizeof(int32), result);
+	} else {
+		int32 nchunks = first;
+		Size chunksStart = dataStart + ROARING_HEADER_SIZE;
+		RoaringChunk chunk;
+
+		read_intset_slice(intSetDatum, chunksStart + (last ? nchunks - 1 : 0) * sizeof(RoaringChunk),
+		                  sizeof(RoaringChunk), &chunk);
+		*result = roaring_number(chunk.key,
+		                         container_bound(intSetDatum, &chunk,
+		                                         chunksStart + nchunks * sizeof(RoaringChunk) + chunk.offset,
+		                                         last));
+	}
+	return true;
+}
+
+/*
+ * Smallest or largest lower bits of a roaring container starting start
+ * bytes into the IntSet struct
+ */
+uint32 container_bound(Datum intSetDatum, RoaringChunk *chunk, Size start, bool last) {
+	uint16 values[2];
+	uint64 *words;
+	uint32 result = 0;
+
+	if (chunk->type == ROARING_ARRAY) {
+		read_intset_slice(intSetDatum, start + (last ? chunk->cardinality - 1 : 0) * sizeof(uint16),
+		                  sizeof(uint16), values);
+		return values[0];
+	}
+	if (chunk->type == ROARING_RUN) {
+		read_intset_slice(intSetDatum, start + (last ? chunk->runs - 1 : 0) * 2 * sizeof(uint16),
+		                  2 * sizeof(uint16), values);
+		return last ? values[0] + values[1] : values[0];
+	}
+
+	words = (uint64 *) palloc(ROARING_BITMAP_WORDS * sizeof(uint64));
+	read_intset_slice(intSetDatum, start, ROARING_BITMAP_WORDS * sizeof(uint64), words);
+	for (int32 k = 0; k < ROARING_BITMAP_WORDS; k++) {
+		int32 w = last ? ROARING_BITMAP_WORDS - 1 - k : k;
+
+		if (words[w] != 0) {
+			result = w * 64 + (last ? pg_leftmost_one_pos64(words[w]) : pg_rightmost_one_pos64(words[w]));
+			break;
+		}
+	}
+	pfree(words);
+	return result;
+}
+
+/*****************************************************************************
+ * Packed format
+ *
+ * Sets of at least INTSET_BLOCK_SIZE numbers are stored packed when that
+ * saves a quarter of the space or more. The numbers are cut into blocks of
+ * INTSET_BLOCK_SIZE, and every block keeps its first and last number in
+ * the block header, so searches can skip whole blocks without unpacking
+ * them.
+ *
+ * Inside a block the numbers are spread over four lanes, number i going to
+ * lane i % 4, and each lane stores the gap to the previous number of the
+ * same lane, less the 4 that a run of consecutive numbers would give. All
+ * gaps of a block are bit-packed with the width of the largest one, lane
+ * by lane in interleaved 32-bit words, so four gaps are unpacked with a
+ * single vector shift and a prefix over lanes is never needed. A block of
+ * consecutive numbers packs to no words at all.
+ *****************************************************************************/
+
+/*
+ * Return the roaring or packed form of intSet if it is worth it, freeing
+ * the array form, or intSet itself otherwise
+ * The choice only depends on the numbers, so equal sets always end up
+ * with equal bytes
+ */
+IntSet *compress_intset(IntSet *intSet) {
+	IntSet *packed = compressed_form(intSet);
+
+	if (packed == NULL) return intSet;
+	pfree(intSet);
+	return packed;
+}
+
+/*
+ * Build the packed or roaring form of an array set, or return NULL if the
+ * set is already stored the way compress_intset leaves it
+ */
+IntSet *compressed_form(IntSet *intSet) {
+	if (INTSET_FORMAT(intSet) != INTSET_FORMAT_ARRAY || INTSET_SIZE(intSet) < INTSET_BLOCK_SIZE)
+		return NULL;
+	// roaring sets have to take at most a byte per number, see finish_roaring
+	if (roaring_size(intSet->data, INTSET_SIZE(intSet)) <= INTSET_SIZE(intSet))
+		return make_roaring(intSet->data, INTSET_SIZE(intSet));
+	return pack_intset(intSet->data, INTSET_SIZE(intSet));
+}
+
+/*
+ * Build the packed form of the sorted array, or return NULL if it would
+ * not save a quarter of the array form
+ */
+IntSet *pack_intset(int32 *data, int32 size) {
+	int32 nblocks = INTSET_NBLOCKS(size), words = 0, offset = 0;
+	int32 *widths = (int32 *) palloc(nblocks * sizeof(int32));
+	Size packedSize;
+	IntSet *result;
+	IntSetBlock *blocks;
+	uint32 *packedWords;
+
+	for (int b = 0; b < nblocks; b++) {
+		int32 start = b * INTSET_BLOCK_SIZE;
+
+		widths[b] = pack_block(&data[start], Min(INTSET_BLOCK_SIZE, size - start), NULL);
+		words += widths[b] * 4;
+	}
+	packedSize = INTSET_HEADER_SIZE + nblocks * sizeof(IntSetBlock) + words * sizeof(uint32);
+	if (packedSize * 4 > (INTSET_HEADER_SIZE + size * sizeof(int32)) * 3) {
+		pfree(widths);
+		return NULL;
+	}
+
+	// the packing ORs the gaps in, so start from zeroed words
+	result = (IntSet *) palloc0(packedSize);
+	SET_VARSIZE(result, packedSize);
+	SET_INTSET_HEADER(result, size, INTSET_FORMAT_PACKED);
+	blocks = INTSET_BLOCKS(result);
+	packedWords = (uint32 *) &blocks[nblocks];
+	for (int b = 0; b < nblocks; b++) {
+		int32 start = b * INTSET_BLOCK_SIZE, count = Min(INTSET_BLOCK_SIZE, size - start);
+
+		blocks[b].first = data[start];
+		blocks[b].last = data[start + count - 1];
+		blocks[b].offset = offset;
+		blocks[b].width = widths[b];
+		pack_block(&data[start], count, &packedWords[offset]);
+		offset += widths[b] * 4;
+	}
+	pfree(widths);
+	return result;
+}
+
+/*
+ * Compute the gaps of up to INTSET_BLOCK_SIZE sorted numbers and return
+ * the bit width they need; also pack them into words unless it is NULL
+ * words must be zeroed and have room for width * 4 words
+ */
+int32 pack_block(int32 *data, int32 count, uint32 *words) {
+	uint32 gaps[INTSET_BLOCK_SIZE], all = 0;
+	int32 width;
+
+	// unsigned arithmetic, gaps between far apart numbers may pass INT32_MAX
+	for (int i = 0; i < INTSET_BLOCK_SIZE; i++) {
+		if (i >= count) gaps[i] = 0;
+		else if (i < 4) gaps[i] = (uint32) data[i] - (uint32) data[0] - i;
+		else gaps[i] = (uint32) data[i] - (uint32) data[i - 4] - 4;
+		all |= gaps[i];
+	}
+	width = all == 0 ? 0 : pg_leftmost_one_pos32(all) + 1;
+	if (words == NULL || width == 0) return width;
+
+	for (int i = 0; i < INTSET_BLOCK_SIZE; i++) {
+		int32 bit = (i >> 2) * width, word = bit >> 5, shift = bit & 31, lane = i & 3;
+
+		words[word * 4 + lane] |= gaps[i] << shift;
+		if (shift + width > 32)
+			words[(word + 1) * 4 + lane] |= gaps[i] >> (32 - shift);
+	}
+	return width;
+}
+
+/*
+ * The numbers of intSet as a sorted array, unpacking packed sets into a
+ * new one with room for the set kernels' slack
+ */
+int32 *intset_numbers(IntSet *intSet) {
+	int32 *result;
+	int32 nblocks = INTSET_NBLOCKS(INTSET_SIZE(intSet));
+
+	if (INTSET_FORMAT(intSet) == INTSET_FORMAT_ARRAY) return intSet->data;
+	if (INTSET_FORMAT(intSet) == INTSET_FORMAT_ROARING) {
+		result = (int32 *) palloc((INTSET_SIZE(intSet) + INTSET_KERNEL_SLACK) * sizeof(int32));
+		roaring_decode(ROARING_CHUNKS(intSet), ROARING_NCHUNKS(intSet),
+		               ROARING_CONTAINERS(intSet), result);
+		return result;
+	}
+
+	// every block unpacks INTSET_BLOCK_SIZE numbers, even the last one
+	result = (int32 *) palloc((nblocks * INTSET_BLOCK_SIZE + INTSET_KERNEL_SLACK) * sizeof(int32));
+	for (int b = 0; b < nblocks; b++) {
+		IntSetBlock *block = &INTSET_BLOCKS(intSet)[b];
+
+		current_set_kernels()->unpack_block((uint32 *) &INTSET_BLOCKS(intSet)[nblocks] + block->offset,
+		                                    block->width, block->first,
+		                                    &result[b * INTSET_BLOCK_SIZE]);
+	}
+	return result;
+}
+
+void init_block_reader(BlockReader *reader, IntSet *intSet) {
+	reader->intSet = intSet;
+	reader->current = -1;
+}
+
+/*
+ * Number of elements in the given block
+ */
+int32 block_count(IntSet *intSet, int32 block) {
+	return Min(INTSET_BLOCK_SIZE, INTSET_SIZE(intSet) - block * INTSET_BLOCK_SIZE);
+}
+
+int32 block_first(IntSet *intSet, int32 block) {
+	if (INTSET_FORMAT(intSet) == INTSET_FORMAT_PACKED) return INTSET_BLOCKS(intSet)[block].first;
+	return intSet->data[block * INTSET_BLOCK_SIZE];
+}
+
+int32 block_last(IntSet *intSet, int32 block) {
+	if (INTSET_FORMAT(intSet) == INTSET_FORMAT_PACKED) return INTSET_BLOCKS(intSet)[block].last;
+	return intSet->data[block * INTSET_BLOCK_SIZE + block_count(intSet, block) - 1];
+}
+
+/*
+ * The numbers of the given block, valid until the next read from reader
+ */
+int32 *read_block(BlockReader *reader, int32 block) {
+	IntSet *intSet = reader->intSet;
+
+	if (INTSET_FORMAT(intSet) == INTSET_FORMAT_ARRAY) return &intSet->data[block * INTSET_BLOCK_SIZE];
+	if (reader->current != block) {
+		IntSetBlock *header = &INTSET_BLOCKS(intSet)[block];
+		uint32 *words = (uint32 *) &INTSET_BLOCKS(intSet)[INTSET_NBLOCKS(INTSET_SIZE(intSet))];
+
+		current_set_kernels()->unpack_block(words + header->offset, header->width,
+		                                    header->first, reader->buffer);
+		reader->current = block;
+	}
+	return reader->buffer;
+}
+
+/*
+ * Index of the first block from `from` on whose last number is not
+ * smaller than target, or the number of blocks if there is none
+ */
+int32 find_block(IntSet *intSet, int32 from, int32 target) {
+	int32 lo = from, hi = INTSET_NBLOCKS(INTSET_SIZE(intSet));
+
+	while (lo < hi) {
+		int32 mid = lo + (hi - lo) / 2;
+
+		if (block_last(intSet, mid) < target) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Check whether num is in the set of reader, starting the search at
+ * *block and leaving there the block num belongs to
+ * Successive probes must come in ascending order
+ */
+bool probe_number(BlockReader *reader, int32 *block, int32 num) {
+	IntSet *intSet = reader->intSet;
+
+	*block = find_block(intSet, *block, num);
+	if (*block == INTSET_NBLOCKS(INTSET_SIZE(intSet)) || block_first(intSet, *block) > num)
+		return false;
+	return num_exist(read_block(reader, *block), num, block_count(intSet, *block));
+}
+
+/*
+ * Check whether num is in an intset datum, flat or expanded
+ */
+bool datum_has(Datum intSetDatum, int32 num) {
+	ExpandedIntSet *eis = get_expanded(intSetDatum);
+
+	if (eis != NULL) {
+		sort_expanded(eis);
+		return num_exist(eis->numbers, num, eis->sorted);
+	}
+	return intset_has(DatumGetIntSetP(intSetDatum), num);
+}
+
+/*
+ * Check whether num is in intSet, unpacking at most one block
+ */
+bool intset_has(IntSet *intSet, int32 num) {
+	BlockReader reader;
+	int32 block = 0;
+
+	if (INTSET_FORMAT(intSet) == INTSET_FORMAT_ARRAY) return num_exist(intSet->data, num, INTSET_SIZE(intSet));
+	if (INTSET_FORMAT(intSet) == INTSET_FORMAT_ROARING) return roaring_has(intSet, num);
+	init_block_reader(&reader, intSet);
+	return probe_number(&reader, &block, num);
+}
+
+/*
+ * Check whether setB is a subset of setA
+ * Each block of setB only meets the blocks of setA its range overlaps
+ */
+bool intset_is_subset(IntSet *setA, IntSet *setB) {
+	const SetKernels *kernels = current_set_kernels();
+	BlockReader *readerA, *readerB;
+	int32 remainder[2][INTSET_BLOCK_SIZE + INTSET_KERNEL_SLACK];
+	int32 nblocksA = INTSET_NBLOCKS(INTSET_SIZE(setA)), nblocksB = INTSET_NBLOCKS(INTSET_SIZE(setB));
+	int32 blockA = 0;
+
+	if (INTSET_FORMAT(setA) == INTSET_FORMAT_ARRAY && INTSET_FORMAT(setB) == INTSET_FORMAT_ARRAY)
+		return is_subset(setA->data, INTSET_SIZE(setA), setB->data, INTSET_SIZE(setB));
+	if (INTSET_FORMAT(setA) == INTSET_FORMAT_ROARING || INTSET_FORMAT(setB) == INTSET_FORMAT_ROARING)
+		return roaring_is_subset(setA, setB);
+	if (INTSET_SIZE(setB) == 0) return true;
+	if (INTSET_SIZE(setB) > INTSET_SIZE(setA) || block_first(setB, 0) < block_first(setA, 0)
+		|| block_last(setB, nblocksB - 1) > block_last(setA, nblocksA - 1))
+		return false;
+
+	readerA = (BlockReader *) palloc(sizeof(BlockReader));
+	init_block_reader(readerA, setA);
+	if (use_galloping("subset", INTSET_SIZE(setA), INTSET_SIZE(setB))) {
+		int32 *data = intset_numbers(setB);
+
+		for (int i = 0; i < INTSET_SIZE(setB); i++) {
+			if (!probe_number(readerA, &blockA, data[i])) return false;
+		}
+		return true;
+	}
+
+	readerB = (BlockReader *) palloc(sizeof(BlockReader));
+	init_block_reader(readerB, setB);
+	for (int b = 0; b < nblocksB; b++) {
+		int32 first = block_first(setB, b), last = block_last(setB, b);
+		int32 *rest = read_block(readerB, b), count = block_count(setB, b), turn = 0;
+
+		// take away every overlapping block of setA, nothing may be left
+		while (blockA < nblocksA && block_last(setA, blockA) < first) blockA++;
+		for (int a = blockA; a < nblocksA && count > 0 && block_first(setA, a) <= last; a++) {
+			count = kernels->difference(rest, count, read_block(readerA, a),
+			                            block_count(setA, a), remainder[turn]);
+			rest = remainder[turn];
+			turn ^= 1;
+		}
+		if (count > 0) return false;
+	}
+	return true;
+}
+
+/*
+ * Check whether two intSets are the same
+ */
+bool intset_is_equal(IntSet *setA, IntSet *setB) {
+	if (INTSET_SIZE(setA) != INTSET_SIZE(setB)) return false;
+	if (INTSET_FORMAT(setA) == INTSET_FORMAT(setB))
+		return VARSIZE(setA) == VARSIZE(setB) && memcmp(setA, setB, VARSIZE(setA)) == 0;
+	return is_equal(intset_numbers(setA), INTSET_SIZE(setA), intset_numbers(setB), INTSET_SIZE(setB));
+}
+
+/*
+ * Intersection of two intSets as a sorted array
+ * Blocks are intersected pairwise, only where their ranges overlap
+ * result must have room for Min(setA->size, setB->size) numbers
+ */
+int32 intset_intersection(IntSet *setA, IntSet *setB, int32 *result) {
+	const SetKernels *kernels = current_set_kernels();
+	BlockReader *readerA, *readerB;
+	int32 nblocksA = INTSET_NBLOCKS(INTSET_SIZE(setA)), nblocksB = INTSET_NBLOCKS(INTSET_SIZE(setB));
+	int32 blockB = 0, size = 0;
+
+	if (INTSET_FORMAT(setA) == INTSET_FORMAT_ARRAY && INTSET_FORMAT(setB) == INTSET_FORMAT_ARRAY)
+		return get_intersection(setA->data, INTSET_SIZE(setA), setB->data, INTSET_SIZE(setB), result);
+
+	readerA = (BlockReader *) palloc(sizeof(BlockReader));
+	readerB = (BlockReader *) palloc(sizeof(BlockReader));
+	init_block_reader(readerA, setA);
+	init_block_reader(readerB, setB);
+	if (use_galloping("intersection", INTSET_SIZE(setA), INTSET_SIZE(setB))) {
+		// look each number of the small set up in the large one
+		IntSet *small = INTSET_SIZE(setA) <= INTSET_SIZE(setB) ? setA : setB;
+		BlockReader *reader = small == setA ? readerB : readerA;
+		int32 *data = intset_numbers(small);
+
+		for (int i = 0; i < INTSET_SIZE(small); i++) {
+			if (probe_number(reader, &blockB, data[i])) result[size++] = data[i];
+		}
+		return size;
+	}
+
+	for (int a = 0; a < nblocksA; a++) {
+		int32 first = block_first(setA, a), last = block_last(setA, a);
+
+		while (blockB < nblocksB && block_last(setB, blockB) < first) blockB++;
+		for (int b = blockB; b < nblocksB && block_first(setB, b) <= last; b++)
+			size += kernels->intersection(read_block(readerA, a), block_count(setA, a),
+			                              read_block(readerB, b), block_count(setB, b),
+			                              &result[size]);
+	}
+	return size;
+}
+
+/*
+ * Jaccard index from the sizes of two sets and of their intersection.
+ * Two empty sets have nothing in common, so their index is 0.
+ */
+double jaccard_index(int32 common, int32 sizeA, int32 sizeB) {
+	if (common == 0) return 0.0;
+	return (double) common / ((double) sizeA + sizeB - common);
+}
+
+/*
+ * Size of the intersection of two intSets, in any format, without
+ * building it. Readers live on the stack, so nothing is allocated.
+ */
+int32 count_intersection(IntSet *setA, IntSet *setB) {
+	const SetKernels *kernels = current_set_kernels();
+	BlockReader readerA, readerB;
+	int32 nblocksA = INTSET_NBLOCKS(INTSET_SIZE(setA)), nblocksB = INTSET_NBLOCKS(INTSET_SIZE(setB));
+	int32 blockB = 0, size = 0;
+
+	if (INTSET_SIZE(setA) == 0 || INTSET_SIZE(setB) == 0) return 0;
+	if (INTSET_FORMAT(setA) == INTSET_FORMAT_ARRAY && INTSET_FORMAT(setB) == INTSET_FORMAT_ARRAY)
+		return get_intersection_count(setA->data, INTSET_SIZE(setA), setB->data, INTSET_SIZE(setB));
+	if (INTSET_FORMAT(setA) == INTSET_FORMAT_ROARING && INTSET_FORMAT(setB) == INTSET_FORMAT_ROARING)
+		return roaring_intersection_count(setA, setB);
+
+	if (INTSET_FORMAT(setA) == INTSET_FORMAT_ROARING || INTSET_FORMAT(setB) == INTSET_FORMAT_ROARING) {
+		// probe the roaring set with every number of the other one
+		IntSet *roaring = INTSET_FORMAT(setA) == INTSET_FORMAT_ROARING ? setA : setB;
+		IntSet *other = roaring == setA ? setB : setA;
+
+		init_block_reader(&readerA, other);
+		for (int b = 0; b < INTSET_NBLOCKS(INTSET_SIZE(other)); b++) {
+			int32 *data = read_block(&readerA, b), count = block_count(other, b);
+
+			for (int i = 0; i < count; i++)
+				size += roaring_has(roaring, data[i]);
+		}
+		return size;
+	}
+
+	init_block_reader(&readerA, setA);
+	init_block_reader(&readerB, setB);
+	if (use_galloping("intersection", INTSET_SIZE(setA), INTSET_SIZE(setB))) {
+		IntSet *small = INTSET_SIZE(setA) <= INTSET_SIZE(setB) ? setA : setB;
+		BlockReader *smallReader = small == setA ? &readerA : &readerB;
+		BlockReader *largeReader = small == setA ? &readerB : &readerA;
+
+		for (int b = 0; b < INTSET_NBLOCKS(INTSET_SIZE(small)); b++) {
+			int32 *data = read_block(smallReader, b), count = block_count(small, b);
+
+			for (int i = 0; i < count; i++)
+				size += probe_number(largeReader, &blockB, data[i]);
+		}
+		return size;
+	}
+
+	for (int a = 0; a < nblocksA; a++) {
+		int32 first = block_first(setA, a), last = block_last(setA, a);
+
+		while (blockB < nblocksB && block_last(setB, blockB) < first) blockB++;
+		for (int b = blockB; b < nblocksB && block_first(setB, b) <= last; b++)
+			size += kernels->intersection_count(read_block(&readerA, a), block_count(setA, a),
+			                                    read_block(&readerB, b), block_count(setB, b));
+	}
+	return size;
+}
+
+/*
+ * Numbers of setA not in setB as a sorted array
+ * Each block of setA only meets the blocks of setB its range overlaps
+ * result must have room for setA->size numbers
+ */
+int32 intset_difference(IntSet *setA, IntSet *setB, int32 *result) {
+	const SetKernels *kernels = current_set_kernels();
+	BlockReader *readerA, *readerB;
+	int32 remainder[2][INTSET_BLOCK_SIZE + INTSET_KERNEL_SLACK];
+	int32 nblocksA = INTSET_NBLOCKS(INTSET_SIZE(setA)), nblocksB = INTSET_NBLOCKS(INTSET_SIZE(setB));
+	int32 blockB = 0, size = 0;
+
+	if (INTSET_FORMAT(setA) == INTSET_FORMAT_ARRAY && INTSET_FORMAT(setB) == INTSET_FORMAT_ARRAY)
+		return get_difference(setA->data, INTSET_SIZE(setA), setB->data, INTSET_SIZE(setB), result);
+
+	if (use_galloping("difference", INTSET_SIZE(setA), INTSET_SIZE(setB))) {
+		int32 *dataA = intset_numbers(setA);
+
+		if (INTSET_SIZE(setA) > INTSET_SIZE(setB)) {
+			// the result is most of setA anyway
+			return gallop_difference(dataA, INTSET_SIZE(setA), intset_numbers(setB),
+			                         INTSET_SIZE(setB), result);
+		}
+		readerB = (BlockReader *) palloc(sizeof(BlockReader));
+		init_block_reader(readerB, setB);
+		for (int i = 0; i < INTSET_SIZE(setA); i++) {
+			if (!probe_number(readerB, &blockB, dataA[i])) result[size++] = dataA[i];
+		}
+		return size;
+	}
+
+	readerA = (BlockReader *) palloc(sizeof(BlockReader));
+	readerB = (BlockReader *) palloc(sizeof(BlockReader));
+	init_block_reader(readerA, setA);
+	init_block_reader(readerB, setB);
+	for (int a = 0; a < nblocksA; a++) {
+		int32 first = block_first(setA, a), last = block_last(setA, a);
+		int32 *rest = read_block(readerA, a), count = block_count(setA, a), turn = 0;
+
+		while (blockB < nblocksB && block_last(setB, blockB) < first) blockB++;
+		for (int b = blockB; b < nblocksB && count > 0 && block_first(setB, b) <= last; b++) {
+			count = kernels->difference(rest, count, read_block(readerB, b),
+			                            block_count(setB, b), remainder[turn]);
+			rest = remainder[turn];
+			turn ^= 1;
+		}
+		memcpy(&result[size], rest, count * sizeof(int32));
+		size += count;
+	}
+	return size;
+}
+
+/*
+ * Check whether the two sets have a number in common
+ */
+bool intset_overlaps(IntSet *setA, IntSet *setB) {
+	if (INTSET_SIZE(setA) == 0 || INTSET_SIZE(setB) == 0) return false;
+	return numbers_overlap(intset_numbers(setA), INTSET_SIZE(setA), intset_numbers(setB), INTSET_SIZE(setB));
+}
+
+/*
+ * Three-way lexicographic comparison of two sets. Array and packed sets
+ * are compared a block at a time, so that sets which differ early are
+ * told apart without unpacking the rest.
+ */
+int32 intset_compare(IntSet *setA, IntSet *setB) {
+	BlockReader readerA, readerB;
+	int32 *dataA, *dataB;
+	int32 nblocks = Min(INTSET_NBLOCKS(INTSET_SIZE(setA)), INTSET_NBLOCKS(INTSET_SIZE(setB)));
+
+	if (INTSET_FORMAT(setA) == INTSET_FORMAT(setB) && VARSIZE(setA) == VARSIZE(setB)
+		&& memcmp(setA, setB, VARSIZE(setA)) == 0)
+		return 0;
+
+	if (INTSET_FORMAT(setA) == INTSET_FORMAT_ROARING || INTSET_FORMAT(setB) == INTSET_FORMAT_ROARING)
+		return compare_elements(setA, setB);
+
+	init_block_reader(&readerA, setA);
+	init_block_reader(&readerB, setB);
+	for (int b = 0; b < nblocks; b++) {
+		int32 count = Min(block_count(setA, b), block_count(setB, b));
+
+		// blocks of the same position start at the same element
+		if (block_first(setA, b) != block_first(setB, b))
+			return block_first(setA, b) < block_first(setB, b) ? -1 : 1;
+		dataA = read_block(&readerA, b);
+		dataB = read_block(&readerB, b);
+		for (int i = 0; i < count; i++) {
+			if (dataA[i] != dataB[i]) return dataA[i] < dataB[i] ? -1 : 1;
+		}
+	}
+	return (INTSET_SIZE(setA) > INTSET_SIZE(setB)) - (INTSET_SIZE(setA) < INTSET_SIZE(setB));
+}
+
+/*
+ * Lexicographic comparison reading both sets in order, one block or chunk
+ * at a time, for when either is roaring. Leading chunks that two roaring
+ * sets store alike are skipped without decoding them.
+ */
+int32 compare_elements(IntSet *setA, IntSet *setB) {
+	IntSetElements a, b;
+	int32 result;
+
+	init_elements(&a, setA);
+	init_elements(&b, setB);
+	if (INTSET_FORMAT(setA) == INTSET_FORMAT_ROARING && INTSET_FORMAT(setB) == INTSET_FORMAT_ROARING) {
+		int32 nchunks = Min(ROARING_NCHUNKS(setA), ROARING_NCHUNKS(setB));
+
+		while (a.next < nchunks
+			   && same_container(setA, &ROARING_CHUNKS(setA)[a.next], setB, &ROARING_CHUNKS(setB)[a.next]))
+			a.next++;
+		b.next = a.next;
+	}
+
+	for (;;) {
+		if (a.pos == a.count && !next_elements(&a)) {
+			result = b.pos < b.count || next_elements(&b) ? -1 : 0;
+			break;
+		}
+		if (b.pos == b.count && !next_elements(&b)) {
+			result = 1;
+			break;
+		}
+		if (a.numbers[a.pos] != b.numbers[b.pos]) {
+			result = a.numbers[a.pos] < b.numbers[b.pos] ? -1 : 1;
+			break;
+		}
+		a.pos++;
+		b.pos++;
+	}
+	if (a.chunk != NULL) pfree(a.chunk);
+	if (b.chunk != NULL) pfree(b.chunk);
+	return result;
+}
+
+/*
+ * Copy the smallest count numbers of the set into result, returning how
+ * many there are
+ */
+int32 intset_prefix(IntSet *intSet, int32 count, int32 *result) {
+	BlockReader reader;
+
+	count = Min(count, INTSET_SIZE(intSet));
+	if (count == 0) return 0;
+	if (INTSET_FORMAT(intSet) == INTSET_FORMAT_ROARING) {
+		int32 n = 0;
+
+		// only the leading containers are read, usually just the first
+		for (int32 c = 0; n < count; c++) {
+			RoaringChunk *chunk = &ROARING_CHUNKS(intSet)[c];
+			int32 found = container_prefix(chunk, ROARING_CONTAINER(intSet, chunk), count - n, &result[n]);
+
+			for (int32 i = 0; i < found; i++, n++) result[n] = roaring_number(chunk->key, result[n]);
+		}
+	} else {
+		init_block_reader(&reader, intSet);
+		memcpy(result, read_block(&reader, 0), count * sizeof(int32));
+	}
+	return count;
+}
+
+/*
+ * Sort comparator on the full sets
+ */
+int intset_fastcmp(Datum x, Datum y, SortSupport ssup) {
+	IntSet *setA = DatumGetIntSetP(x);
+	IntSet *setB = DatumGetIntSetP(y);
+	int result = intset_compare(setA, setB);
+
+	if ((Pointer) setA != DatumGetPointer(x)) pfree(setA);
+	if ((Pointer) setB != DatumGetPointer(y)) pfree(setB);
+	return result;
+}
+
+int intset_abbrev_cmp(Datum x, Datum y, SortSupport ssup) {
+	return (x > y) - (x < y);
+}
+
+/*
+ * Abbreviate a set to an unsigned 64-bit key ordered like the sets: the
+ * first element, sign flipped, in the upper 33 bits, then the upper 30
+ * bits of the second element in the lower 31. Each part is offset by one
+ * so that a missing element sorts first, which also folds the size into
+ * the key as far as it decides the order.
+ */
+Datum intset_abbrev_convert(Datum original, SortSupport ssup) {
+	IntSetSortSupport *state = (IntSetSortSupport *) ssup->ssup_extra;
+	IntSet *intSet = DatumGetIntSetP(original);
+	int32 prefix[2];
+	int32 count = intset_prefix(intSet, 2, prefix);
+	uint64 key = 0;
+
+	if (count > 0) key = ((uint64) ((uint32) prefix[0] ^ 0x80000000) + 1) << 31;
+	if (count > 1) key |= (((uint32) prefix[1] ^ 0x80000000) >> 2) + 1;
+
+	state->inputCount++;
+	if (state->estimating)
+		addHyperLogLog(&state->abbrCard, DatumGetUInt32(hash_uint32((uint32) (key ^ (key >> 32)))));
+
+	if ((Pointer) intSet != DatumGetPointer(original)) pfree(intSet);
+	return (Datum) key;
+}
+
+/*
+ * Give up on the abbreviation when the keys are mostly duplicates, such
+ * as for sets sharing their first elements. Same thresholds as the uuid
+ * sort support.
+ */
+bool intset_abbrev_abort(int memtupcount, SortSupport ssup) {
+	IntSetSortSupport *state = (IntSetSortSupport *) ssup->ssup_extra;
+	double abbrCard;
+
+	if (memtupcount < 10000 || state->inputCount < 10000 || !state->estimating)
+		return false;
+
+	abbrCard = estimateHyperLogLog(&state->abbrCard);
+	// once the keys are this distinct, stop paying for the estimate
+	if (abbrCard > 100000.0) {
+		state->estimating = false;
+		return false;
+	}
+	if (abbrCard < state->inputCount / 2000.0 + 0.5) {
+		elog(DEBUG1, "intset abbreviation aborted after %d tuples, %f distinct keys",
+		     memtupcount, abbrCard);
+		return true;
+	}
+	return false;
+}
+
+/*****************************************************************************
+ * Roaring format
+ *
+ * Sets that are dense somewhere are split into chunks of the numbers that
+ * share their upper 16 bits, the chunk key. Each chunk keeps the lower 16
+ * bits of its numbers in whichever container is smallest: a sorted array,
+ * a bitmap of 65536 bits or a list of runs. Numbers have their sign bit
+ * flipped before being split, so chunk keys sort like the numbers.
+ *
+ * A set is stored this way when it takes at most a byte per number,
+ * which only bitmap and run containers get to; any other set is better
+ * off as an array or packed. Set operations walk the chunks of both sets
+ * by key and combine the containers pairwise, bitmaps a word at a time.
+ *
+ * Bitmaps are read as uint64 words, so containers start at multiples of 8
+ * bytes and the type is declared with double alignment.
+ *****************************************************************************/
+
+uint32 roaring_key(int32 num) {
+	return ((uint32) num ^ 0x80000000) >> 16;
+}
+
+int32 roaring_number(uint32 key, uint32 low) {
+	return (int32) (((key << 16) | low) ^ 0x80000000);
+}
+
+/*
+ * Pick the smallest container for a chunk and return its size in bytes,
+ * padded so that the next container stays aligned
+ */
+Size container_size(int32 cardinality, int32 runs, uint16 *type) {
+	Size arrayBytes = cardinality * sizeof(uint16);
+	Size runBytes = runs * 2 * sizeof(uint16);
+	Size bitmapBytes = ROARING_BITMAP_WORDS * sizeof(uint64);
+
+	if (runBytes < arrayBytes && runBytes < bitmapBytes) {
+		*type = ROARING_RUN;
+		return TYPEALIGN(sizeof(uint64), runBytes);
+	}
+	if (arrayBytes <= bitmapBytes) {
+		*type = ROARING_ARRAY;
+		return TYPEALIGN(sizeof(uint64), arrayBytes);
+	}
+	*type = ROARING_BITMAP;
+	return bitmapBytes;
+}
+
+/*
+ * Size in bytes the roaring form of the sorted array would take
+ */
+Size roaring_size(int32 *data, int32 size) {
+	Size total = INTSET_HEADER_SIZE + ROARING_HEADER_SIZE;
+	uint16 type;
+
+	for (int32 i = 0, j; i < size; i = j) {
+		uint32 key = roaring_key(data[i]);
+		int32 runs = 1;
+
+		for (j = i + 1; j < size && roaring_key(data[j]) == key; j++) {
+			if (data[j] != data[j - 1] + 1) runs++;
+		}
+		total += sizeof(RoaringChunk) + container_size(j - i, runs, &type);
+	}
+	return total;
+}
+
+void init_roaring_builder(RoaringBuilder *builder, int32 maxChunks) {
+	builder->chunks = (RoaringChunk *) palloc(Max(maxChunks, 1) * sizeof(RoaringChunk));
+	builder->nchunks = 0;
+	builder->cardinality = 0;
+	builder->allocated = ROARING_BITMAP_WORDS * sizeof(uint64);
+	builder->containers = (char *) palloc(builder->allocated);
+	builder->used = 0;
+}
+
+/*
+ * Append a chunk and return its zeroed container, whose type is chosen by
+ * container_size
+ */
+char *add_container(RoaringBuilder *builder, uint32 key, int32 cardinality, int32 runs,
+                    uint16 *type) {
+	RoaringChunk *chunk = &builder->chunks[builder->nchunks++];
+	Size bytes = container_size(cardinality, runs, type);
+	char *container;
+
+	if (builder->used + bytes > builder->allocated) {
+		builder->allocated = Max(builder->allocated * 2, builder->used + bytes);
+		builder->containers = (char *) repalloc(builder->containers, builder->allocated);
+	}
+	container = builder->containers + builder->used;
+	memset(container, 0, bytes);
+
+	chunk->key = key;
+	chunk->type = *type;
+	chunk->cardinality = cardinality;
+	chunk->runs = runs;
+	chunk->offset = builder->used;
+	builder->used += bytes;
+	builder->cardinality += cardinality;
+	return container;
+}
+
+/*
+ * Append a chunk holding the given sorted lower bits
+ * Only the lower 16 bits of each number are used
+ */
+void emit_numbers(RoaringBuilder *builder, uint32 key, int32 *lows, int32 count) {
+	int32 runs = 1, run = 0;
+	uint16 type;
+	char *container;
+
+	if (count == 0) return;
+	for (int32 i = 1; i < count; i++) {
+		if (lows[i] != lows[i - 1] + 1) runs++;
+	}
+
+	container = add_container(builder, key, count, runs, &type);
+	if (type == ROARING_ARRAY) {
+		for (int32 i = 0; i < count; i++) ((uint16 *) container)[i] = (uint16) lows[i];
+	} else if (type == ROARING_RUN) {
+		uint16 *pairs = (uint16 *) container;
+
+		for (int32 i = 0; i < count; i++) {
+			if (i > 0 && lows[i] != lows[i - 1] + 1) run++;
+			if (i == 0 || lows[i] != lows[i - 1] + 1) pairs[run * 2] = (uint16) lows[i];
+			pairs[run * 2 + 1] = (uint16) lows[i] - pairs[run * 2];
+		}
+	} else {
+		uint64 *words = (uint64 *) container;
+
+		for (int32 i = 0; i < count; i++) {
+			uint32 low = (uint16) lows[i];
+
+			words[low >> 6] |= UINT64CONST(1) << (low & 63);
+		}
+	}
+}
+
+/*
+ * Append a chunk holding the bits set in words, whose cardinality and
+ * number of runs are known already
+ */
+void emit_bitmap(RoaringBuilder *builder, uint32 key, uint64 *words, int32 cardinality,
+                 int32 runs) {
+	uint16 type;
+	char *container;
+
+	if (cardinality == 0) return;
+	container = add_container(builder, key, cardinality, runs, &type);
+	if (type == ROARING_BITMAP) {
+		memcpy(container, words, ROARING_BITMAP_WORDS * sizeof(uint64));
+	} else if (type == ROARING_ARRAY) {
+		uint16 *lows = (uint16 *) container;
+
+		for (int32 k = 0, n = 0; k < ROARING_BITMAP_WORDS; k++) {
+			for (uint64 word = words[k]; word != 0; word &= word - 1)
+				lows[n++] = k * 64 + pg_rightmost_one_pos64(word);
+		}
+	} else {
+		uint16 *pairs = (uint16 *) container;
+		int32 starts = 0, ends = 0;
+
+		// a run starts at a set bit after a clear one and ends before one
+		for (int32 k = 0; k < ROARING_BITMAP_WORDS; k++) {
+			uint64 before = k > 0 ? words[k - 1] >> 63 : 0;
+			uint64 after = k + 1 < ROARING_BITMAP_WORDS ? words[k + 1] << 63 : 0;
+			uint64 first = words[k] & ~((words[k] << 1) | before);
+			uint64 last = words[k] & ~((words[k] >> 1) | after);
+
+			for (; first != 0; first &= first - 1)
+				pairs[2 * starts++] = k * 64 + pg_rightmost_one_pos64(first);
+			for (; last != 0; last &= last - 1, ends++)
+				pairs[2 * ends + 1] = k * 64 + pg_rightmost_one_pos64(last) - pairs[2 * ends];
+		}
+	}
+}
+
+/*
+ * Append a copy of a chunk of intSet
+ */
+void emit_container(RoaringBuilder *builder, IntSet *intSet, RoaringChunk *chunk) {
+	uint16 type;
+	char *container = add_container(builder, chunk->key, chunk->cardinality, chunk->runs, &type);
+
+	memcpy(container, ROARING_CONTAINER(intSet, chunk),
+	       container_size(chunk->cardinality, chunk->runs, &type));
+}
+
+/*
+ * Turn the chunks collected so far into a roaring intSet
+ */
+IntSet *build_roaring(RoaringBuilder *builder) {
+	Size chunkBytes = builder->nchunks * sizeof(RoaringChunk);
+	Size total = INTSET_HEADER_SIZE + ROARING_HEADER_SIZE + chunkBytes + builder->used;
+	IntSet *result;
+
+	if (builder->cardinality > INTSET_MAX_SIZE || !AllocSizeIsValid(total))
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("intset has too many elements")));
+
+	result = (IntSet *) palloc(total);
+	SET_VARSIZE(result, total);
+	SET_INTSET_HEADER(result, builder->cardinality, INTSET_FORMAT_ROARING);
+	ROARING_NCHUNKS(result) = builder->nchunks;
+	result->data[1] = 0;    // the pad word, zero so that equal sets have equal bytes
+	memcpy(ROARING_CHUNKS(result), builder->chunks, chunkBytes);
+	memcpy(ROARING_CONTAINERS(result), builder->containers, builder->used);
+	pfree(builder->chunks);
+	pfree(builder->containers);
+	return result;
+}
+
+/*
+ * Turn the result of a set operation into an intSet, roaring if it takes
+ * at most a byte per number and array or packed otherwise
+ * compress_intset makes the same choice, so a set always ends up in the
+ * same form however it was computed
+ */
+IntSet *finish_roaring(RoaringBuilder *builder) {
+	Size total = INTSET_HEADER_SIZE + ROARING_HEADER_SIZE
+		+ builder->nchunks * sizeof(RoaringChunk) + builder->used;
+	IntSet *result;
+
+	if (builder->cardinality >= INTSET_BLOCK_SIZE && total <= (Size) builder->cardinality)
+		return build_roaring(builder);
+
+	result = new_intset(builder->cardinality);
+	set_intset_size(result, roaring_decode(builder->chunks, builder->nchunks,
+	                                       builder->containers, result->data));
+	pfree(builder->chunks);
+	pfree(builder->containers);
+	return compress_intset(result);
+}
+
+/*
+ * Build the roaring form of the sorted array, however sparse it is
+ */
+IntSet *make_roaring(int32 *data, int32 size) {
+	RoaringBuilder builder;
+
+	init_roaring_builder(&builder, Min(size, 0x10000));
+	for (int32 i = 0, j; i < size; i = j) {
+		uint32 key = roaring_key(data[i]);
+
+		for (j = i + 1; j < size && roaring_key(data[j]) == key; j++);
+		emit_numbers(&builder, key, &data[i], j - i);
+	}
+	return build_roaring(&builder);
+}
+
+/*
+ * intSet itself if it is roaring, or its roaring form otherwise
+ */
+IntSet *as_roaring(IntSet *intSet) {
+	if (INTSET_FORMAT(intSet) == INTSET_FORMAT_ROARING) return intSet;
+	return make_roaring(intset_numbers(intSet), INTSET_SIZE(intSet));
+}
+
+/*
+ * Write out the numbers of the chunks in order and return their count
+ */
+int32 roaring_decode(RoaringChunk *chunks, int32 nchunks, char *containers, int32 *result) {
+	int32 size = 0;
+
+	for (int32 c = 0; c < nchunks; c++) {
+		int32 count = container_numbers(&chunks[c], containers + chunks[c].offset, &result[size]);
+
+		for (int32 i = 0; i < count; i++)
+			result[size + i] = roaring_number(chunks[c].key, result[size + i]);
+		size += count;
+	}
+	return size;
+}
+
+/*
+ * Write out the lower bits held by a container and return their count
+ */
+int32 container_numbers(RoaringChunk *chunk, char *container, int32 *lows) {
+	int32 n = 0;
+
+	if (chunk->type == ROARING_ARRAY) {
+		for (; n < chunk->cardinality; n++) lows[n] = ((uint16 *) container)[n];
+	} else if (chunk->type == ROARING_RUN) {
+		uint16 *pairs = (uint16 *) container;
+
+		for (int32 r = 0; r < chunk->runs; r++) {
+			for (int32 low = pairs[2 * r]; low <= pairs[2 * r] + pairs[2 * r + 1]; low++)
+				lows[n++] = low;
+		}
+	} else {
+		uint64 *words = (uint64 *) container;
+
+		for (int32 k = 0; k < ROARING_BITMAP_WORDS; k++) {
+			for (uint64 word = words[k]; word != 0; word &= word - 1)
+				lows[n++] = k * 64 + pg_rightmost_one_pos64(word);
+		}
+	}
+	return n;
+}
+
+/*
+ * Write out the smallest count lower bits of a container, at most the
+ * cardinality of the container, and return how many there are
+ */
+int32 container_prefix(RoaringChunk *chunk, char *container, int32 count, int32 *lows) {
+	int32 n = 0;
+
+	count = Min(count, chunk->cardinality);
+	if (chunk->type == ROARING_ARRAY) {
+		for (; n < count; n++) lows[n] = ((uint16 *) container)[n];
+	} else if (chunk->type == ROARING_RUN) {
+		uint16 *pairs = (uint16 *) container;
+
+		for (int32 r = 0; n < count; r++) {
+			for (int32 low = pairs[2 * r]; low <= pairs[2 * r] + pairs[2 * r + 1] && n < count; low++)
+				lows[n++] = low;
+		}
+	} else {
+		uint64 *words = (uint64 *) container;
+
+		for (int32 k = 0; n < count; k++) {
+			for (uint64 word = words[k]; word != 0 && n < count; word &= word - 1)
+				lows[n++] = k * 64 + pg_rightmost_one_pos64(word);
+		}
+	}
+	return n;
+}
+
+/*
+ * Check whether two chunks hold the same numbers, which they do exactly
+ * when their headers and container bytes match
+ */
+bool same_container(IntSet *setA, RoaringChunk *chunkA, IntSet *setB, RoaringChunk *chunkB) {
+	Size size;
+
+	if (chunkA->key != chunkB->key || chunkA->type != chunkB->type
+		|| chunkA->cardinality != chunkB->cardinality || chunkA->runs != chunkB->runs)
+		return false;
+
+	if (chunkA->type == ROARING_ARRAY) size = chunkA->cardinality * sizeof(uint16);
+	else if (chunkA->type == ROARING_RUN) size = chunkA->runs * 2 * sizeof(uint16);
+	else size = ROARING_BITMAP_WORDS * sizeof(uint64);
+	return memcmp(ROARING_CONTAINER(setA, chunkA), ROARING_CONTAINER(setB, chunkB), size) == 0;
+}
+
+/*
+ * The container as a bitmap, either itself or filled into buffer
+ */
+uint64 *container_words(RoaringChunk *chunk, char *container, uint64 *buffer) {
+	if (chunk->type == ROARING_BITMAP) return (uint64 *) container;
+
+	memset(buffer, 0, ROARING_BITMAP_WORDS * sizeof(uint64));
+	if (chunk->type == ROARING_ARRAY) {
+		uint16 *lows = (uint16 *) container;
+
+		for (int32 i = 0; i < chunk->cardinality; i++)
+			buffer[lows[i] >> 6] |= UINT64CONST(1) << (lows[i] & 63);
+	} else {
+		uint16 *pairs = (uint16 *) container;
+
+		// set whole words between the partial first and last one of each run
+		for (int32 r = 0; r < chunk->runs; r++) {
+			uint32 start = pairs[2 * r], end = start + pairs[2 * r + 1];
+			uint64 head = ~UINT64CONST(0) << (start & 63);
+			uint64 tail = ~UINT64CONST(0) >> (63 - (end & 63));
+
+			if (start >> 6 == end >> 6) {
+				buffer[start >> 6] |= head & tail;
+				continue;
+			}
+			buffer[start >> 6] |= head;
+			for (uint32 k = (start >> 6) + 1; k < end >> 6; k++) buffer[k] = ~UINT64CONST(0);
+			buffer[end >> 6] |= tail;
+		}
+	}
+	return buffer;
+}
+
+/*
+ * Check whether a container holds the given lower bits
+ */
+bool container_has(RoaringChunk *chunk, char *container, uint32 low) {
+	uint16 *values = (uint16 *) container;
+	int32 lo = 0, hi;
+
+	if (chunk->type == ROARING_BITMAP)
+		return (((uint64 *) container)[low >> 6] >> (low & 63)) & 1;
+
+	if (chunk->type == ROARING_ARRAY) {
+		hi = chunk->cardinality - 1;
+		while (lo <= hi) {
+			int32 mid = lo + (hi - lo) / 2;
+
+			if (values[mid] == low) return true;
+			if (values[mid] < low) lo = mid + 1;
+			else hi = mid - 1;
+		}
+		return false;
+	}
+
+	// the last run starting at or before low
+	hi = chunk->runs;
+	while (lo < hi) {
+		int32 mid = lo + (hi - lo) / 2;
+
+		if (values[2 * mid] <= low) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo > 0 && low <= (uint32) values[2 * (lo - 1)] + values[2 * (lo - 1) + 1];
+}
+
+/*
+ * Check whether the container of chunkB is a subset of that of chunkA
+ */
+bool container_subset(IntSet *setA, RoaringChunk *chunkA, IntSet *setB, RoaringChunk *chunkB,
+                      RoaringScratch *scratch) {
+	char *containerA = ROARING_CONTAINER(setA, chunkA), *containerB = ROARING_CONTAINER(setB, chunkB);
+	uint64 *wordsA, *wordsB;
+
+	if (chunkB->cardinality > chunkA->cardinality) return false;
+	if (chunkB->type == ROARING_ARRAY) {
+		uint16 *lows = (uint16 *) containerB;
+
+		for (int32 i = 0; i < chunkB->cardinality; i++) {
+			if (!container_has(chunkA, containerA, lows[i])) return false;
+		}
+		return true;
+	}
+
+	wordsA = container_words(chunkA, containerA, scratch->wordsA);
+	wordsB = container_words(chunkB, containerB, scratch->wordsB);
+	for (int32 k = 0; k < ROARING_BITMAP_WORDS; k++) {
+		if (wordsB[k] & ~wordsA[k]) return false;
+	}
+	return true;
+}
+
+/*
+ * Append the result of op on the containers of two chunks with equal keys
+ * Two arrays go through the merge kernels, an array probes the other
+ * container when only its own numbers can be in the result, and anything
+ * else is combined as bitmaps.
+ */
+void combine_containers(RoaringBuilder *builder, RoaringScratch *scratch, SetOperation op,
+                        IntSet *setA, RoaringChunk *chunkA, IntSet *setB, RoaringChunk *chunkB) {
+	const SetKernels *kernels = current_set_kernels();
+	char *containerA = ROARING_CONTAINER(setA, chunkA), *containerB = ROARING_CONTAINER(setB, chunkB);
+	int32 count = 0, runs;
+
+	if (chunkA->type == ROARING_ARRAY && chunkB->type == ROARING_ARRAY) {
+		int32 sizeA = container_numbers(chunkA, containerA, scratch->lowsA);
+		int32 sizeB = container_numbers(chunkB, containerB, scratch->lowsB);
+
+		switch (op) {
+			case SET_INTERSECTION:
+				count = kernels->intersection(scratch->lowsA, sizeA, scratch->lowsB, sizeB, scratch->lows);
+				break;
+			case SET_UNION:
+				count = kernels->set_union(scratch->lowsA, sizeA, scratch->lowsB, sizeB, scratch->lows);
+				break;
+			case SET_DIFFERENCE:
+				count = kernels->difference(scratch->lowsA, sizeA, scratch->lowsB, sizeB, scratch->lows);
+				break;
+			case SET_DISJUNCTION:
+				count = get_disjunction(scratch->lowsA, sizeA, scratch->lowsB, sizeB, scratch->lows);
+				break;
+		}
+		emit_numbers(builder, chunkA->key, scratch->lows, count);
+		return;
+	}
+
+	if ((chunkA->type == ROARING_ARRAY && (op == SET_INTERSECTION || op == SET_DIFFERENCE))
+		|| (chunkB->type == ROARING_ARRAY && op == SET_INTERSECTION)) {
+		bool keep = op == SET_INTERSECTION;
+
+		if (chunkA->type != ROARING_ARRAY) {
+			RoaringChunk *chunk = chunkA;
+			char *container = containerA;
+
+			chunkA = chunkB;
+			containerA = containerB;
+			chunkB = chunk;
+			containerB = container;
+		}
+		for (int32 i = 0; i < chunkA->cardinality; i++) {
+			uint32 low = ((uint16 *) containerA)[i];
+
+			if (container_has(chunkB, containerB, low) == keep) scratch->lows[count++] = low;
+		}
+		emit_numbers(builder, chunkA->key, scratch->lows, count);
+		return;
+	}
+
+	count = kernels->bitmap_operation(container_words(chunkA, containerA, scratch->wordsA),
+	                                  container_words(chunkB, containerB, scratch->wordsB),
+	                                  op, scratch->words, &runs);
+	emit_bitmap(builder, chunkA->key, scratch->words, count, runs);
+}
+
+/*
+ * Check whether num is in a roaring intSet
+ */
+bool roaring_has(IntSet *intSet, int32 num) {
+	RoaringChunk *chunks = ROARING_CHUNKS(intSet);
+	uint32 key = roaring_key(num);
+	int32 lo = 0, hi = ROARING_NCHUNKS(intSet) - 1;
+
+	while (lo <= hi) {
+		int32 mid = lo + (hi - lo) / 2;
+
+		if (chunks[mid].key == key)
+			return container_has(&chunks[mid], ROARING_CONTAINER(intSet, &chunks[mid]),
+			                     (uint32) num & 0xFFFF);
+		if (chunks[mid].key < key) lo = mid + 1;
+		else hi = mid - 1;
+	}
+	return false;
+}
+
+/*
+ * Check whether setB is a subset of setA, one of which at least is roaring
+ */
+bool roaring_is_subset(IntSet *setA, IntSet *setB) {
+	RoaringChunk *chunksA, *chunksB;
+	RoaringScratch *scratch;
+	int32 a = 0;
+
+	if (INTSET_SIZE(setB) == 0) return true;
+	if (INTSET_SIZE(setB) > INTSET_SIZE(setA)) return false;
+
+	setA = as_roaring(setA);
+	setB = as_roaring(setB);
+	chunksA = ROARING_CHUNKS(setA);
+	chunksB = ROARING_CHUNKS(setB);
+	scratch = (RoaringScratch *) palloc(sizeof(RoaringScratch));
+	for (int32 b = 0; b < ROARING_NCHUNKS(setB); b++) {
+		while (a < ROARING_NCHUNKS(setA) && chunksA[a].key < chunksB[b].key) a++;
+		if (a == ROARING_NCHUNKS(setA) || chunksA[a].key != chunksB[b].key
+			|| !container_subset(setA, &chunksA[a], setB, &chunksB[b], scratch))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Size of the intersection of two roaring sets, chunk by chunk
+ */
+int32 roaring_intersection_count(IntSet *setA, IntSet *setB) {
+	RoaringChunk *chunksA = ROARING_CHUNKS(setA), *chunksB = ROARING_CHUNKS(setB);
+	int32 a = 0, b = 0, size = 0;
+
+	while (a < ROARING_NCHUNKS(setA) && b < ROARING_NCHUNKS(setB)) {
+		if (chunksA[a].key < chunksB[b].key) a++;
+		else if (chunksA[a].key > chunksB[b].key) b++;
+		else size += container_intersection_count(setA, &chunksA[a++], setB, &chunksB[b++]);
+	}
+	return size;
+}
+
+/*
+ * Size of the intersection of two containers of the same key. Arrays are
+ * merged or probed, anything else is turned into bitmaps.
+ */
+int32 container_intersection_count(IntSet *setA, RoaringChunk *chunkA, IntSet *setB, RoaringChunk *chunkB) {
+	char *containerA = ROARING_CONTAINER(setA, chunkA), *containerB = ROARING_CONTAINER(setB, chunkB);
+	uint64 bufferA[ROARING_BITMAP_WORDS], bufferB[ROARING_BITMAP_WORDS];
+	uint64 *wordsA, *wordsB;
+	int32 size = 0;
+
+	if (chunkA->type == ROARING_ARRAY && chunkB->type == ROARING_ARRAY) {
+		uint16 *lowsA = (uint16 *) containerA, *lowsB = (uint16 *) containerB;
+		int32 i = 0, j = 0;
+
+		while (i < chunkA->cardinality && j < chunkB->cardinality) {
+			uint16 lowA = lowsA[i], lowB = lowsB[j];
+
+			size += lowA == lowB;
+			i += lowA <= lowB;
+			j += lowB <= lowA;
+		}
+		return size;
+	}
+	if (chunkA->type == ROARING_ARRAY || chunkB->type == ROARING_ARRAY) {
+		RoaringChunk *arrayChunk = chunkA->type == ROARING_ARRAY ? chunkA : chunkB;
+		RoaringChunk *otherChunk = arrayChunk == chunkA ? chunkB : chunkA;
+		uint16 *lows = (uint16 *) (arrayChunk == chunkA ? containerA : containerB);
+		char *other = arrayChunk == chunkA ? containerB : containerA;
+
+		for (int32 i = 0; i < arrayChunk->cardinality; i++)
+			size += container_has(otherChunk, other, lows[i]);
+		return size;
+	}
+
+	wordsA = container_words(chunkA, containerA, bufferA);
+	wordsB = container_words(chunkB, containerB, bufferB);
+	for (int k = 0; k < ROARING_BITMAP_WORDS; k++)
+		size += pg_popcount64(wordsA[k] & wordsB[k]);
+	return size;
+}
+
+/*
+ * Apply op to two intSets, one of which at least is roaring, chunk by
+ * chunk
+ */
+IntSet *roaring_operation(IntSet *setA, IntSet *setB, SetOperation op) {
+	RoaringBuilder builder;
+	RoaringScratch *scratch = (RoaringScratch *) palloc(sizeof(RoaringScratch));
+	RoaringChunk *chunksA, *chunksB;
+	int32 a = 0, b = 0, nchunksA, nchunksB;
+
+	setA = as_roaring(setA);
+	setB = as_roaring(setB);
+	chunksA = ROARING_CHUNKS(setA);
+	chunksB = ROARING_CHUNKS(setB);
+	nchunksA = ROARING_NCHUNKS(setA);
+	nchunksB = ROARING_NCHUNKS(setB);
+	init_roaring_builder(&builder, nchunksA + nchunksB);
+
+	while (a < nchunksA || b < nchunksB) {
+		if (b == nchunksB || (a < nchunksA && chunksA[a].key < chunksB[b].key)) {
+			// only in setA
+			if (op != SET_INTERSECTION) emit_container(&builder, setA, &chunksA[a]);
+			a++;
+		} else if (a == nchunksA || chunksB[b].key < chunksA[a].key) {
+			// only in setB
+			if (op == SET_UNION || op == SET_DISJUNCTION) emit_container(&builder, setB, &chunksB[b]);
+			b++;
+		} else {
+			combine_containers(&builder, scratch, op, setA, &chunksA[a], setB, &chunksB[b]);
+			a++;
+			b++;
+		}
+	}
+	pfree(scratch);
+	return finish_roaring(&builder);
+}
+
+/*****************************************************************************
+ * Element statistics
+ *****************************************************************************/
+
+/*
+ * Compute the standard statistics, then the most common elements by lossy
+ * counting (Manku and Motwani) and the histogram of set sizes, the same
+ * way compute_array_stats does. The counting keeps an element only while
+ * its count plus the most it may have missed exceeds the number of
+ * buckets of bucketWidth elements seen, so memory stays bounded however
+ * large the sampled sets are.
+ */
+void compute_intset_stats(VacAttrStats *stats, AnalyzeAttrFetchFunc fetchfunc, int samplerows,
+                          double totalrows) {
+	IntSetAnalyzeData *extra = (IntSetAnalyzeData *) stats->extra_data;
+	int32 maxElements = stats->attr->attstattarget * 10;
+	int64 bucketWidth = (int64) maxElements * 1000 / 7;
+	int64 elementNo = 0, cutoff;
+	int32 bucket = 1, nonnull = 0, nitems = 0, nhist, slot = 0;
+	int32 *sizes = (int32 *) palloc(samplerows * sizeof(int32));
+	double totalSize = 0;
+	HASHCTL ctl;
+	HTAB *table;
+	HASH_SEQ_STATUS scan;
+	ElementCount *item, *items;
+	MemoryContext oldContext;
+
+	stats->extra_data = extra->stdExtraData;
+	extra->stdComputeStats(stats, fetchfunc, samplerows, totalrows);
+	stats->extra_data = extra;
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(int32);
+	ctl.entrysize = sizeof(ElementCount);
+	ctl.hcxt = CurrentMemoryContext;
+	table = hash_create("intset analyze elements", maxElements, &ctl,
+	                    HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	for (int row = 0; row < samplerows; row++) {
+		bool isnull, found;
+		Datum value;
+		IntSet *intSet;
+		int32 *data;
+
+		vacuum_delay_point();
+		value = fetchfunc(stats, row, &isnull);
+		if (isnull) continue;
+
+		intSet = DatumGetIntSetP(value);
+		data = intset_numbers(intSet);
+		sizes[nonnull++] = INTSET_SIZE(intSet);
+		totalSize += INTSET_SIZE(intSet);
+		for (int i = 0; i < INTSET_SIZE(intSet); i++) {
+			item = (ElementCount *) hash_search(table, &data[i], HASH_ENTER, &found);
+			if (found) {
+				item->frequency++;
+			} else {
+				item->frequency = 1;
+				item->delta = bucket - 1;
+			}
+			if (++elementNo % bucketWidth == 0) prune_element_counts(table, bucket++);
+		}
+		if (data != intSet->data) pfree(data);
+		if ((Pointer) intSet != DatumGetPointer(value)) pfree(intSet);
+	}
+	if (nonnull == 0) return;
+
+	while (slot < STATISTIC_NUM_SLOTS && stats->stakind[slot] != 0) slot++;
+	if (slot > STATISTIC_NUM_SLOTS - 2)
+		elog(ERROR, "insufficient pg_statistic slots for intset stats");
+
+	// keep the elements whose frequency is above 9/10 of the support
+	// threshold, which also covers every element reaching it
+	cutoff = 9 * elementNo / bucketWidth;
+	items = (ElementCount *) palloc(Max(hash_get_num_entries(table), 1) * sizeof(ElementCount));
+	hash_seq_init(&scan, table);
+	while ((item = (ElementCount *) hash_seq_search(&scan)) != NULL) {
+		if (item->frequency > cutoff) items[nitems++] = *item;
+	}
+	if (nitems > maxElements) {
+		qsort(items, nitems, sizeof(ElementCount), compare_element_frequency);
+		nitems = maxElements;
+	}
+
+	if (nitems > 0) {
+		Datum *values;
+		float4 *freqs;
+		int32 minFreq = INT_MAX, maxFreq = 0;
+
+		// element is the first field, so the items sort as int32s
+		qsort(items, nitems, sizeof(ElementCount), compare_int32);
+
+		oldContext = MemoryContextSwitchTo(stats->anl_context);
+		values = (Datum *) palloc(nitems * sizeof(Datum));
+		freqs = (float4 *) palloc((nitems + 3) * sizeof(float4));
+		for (int i = 0; i < nitems; i++) {
+			values[i] = Int32GetDatum(items[i].element);
+			freqs[i] = (double) items[i].frequency / nonnull;
+			minFreq = Min(minFreq, items[i].frequency);
+			maxFreq = Max(maxFreq, items[i].frequency);
+		}
+		// the least and most frequent, then that of null elements, which
+		// sets never have
+		freqs[nitems] = (double) minFreq / nonnull;
+		freqs[nitems + 1] = (double) maxFreq / nonnull;
+		freqs[nitems + 2] = 0.0;
+		MemoryContextSwitchTo(oldContext);
+
+		stats->stakind[slot] = STATISTIC_KIND_MCELEM;
+		stats->staop[slot] = Int4EqualOperator;
+		stats->stacoll[slot] = InvalidOid;
+		stats->stanumbers[slot] = freqs;
+		stats->numnumbers[slot] = nitems + 3;
+		stats->stavalues[slot] = values;
+		stats->numvalues[slot] = nitems;
+		stats->statypid[slot] = INT4OID;
+		stats->statyplen[slot] = sizeof(int32);
+		stats->statypbyval[slot] = true;
+		stats->statypalign[slot] = 'i';
+		slot++;
+	}
+
+	// equi-depth bounds of the sizes, followed by their average
+	nhist = Max(stats->attr->attstattarget, 1) + 1;
+	qsort(sizes, nonnull, sizeof(int32), compare_int32);
+	oldContext = MemoryContextSwitchTo(stats->anl_context);
+	stats->stanumbers[slot] = (float4 *) palloc((nhist + 1) * sizeof(float4));
+	MemoryContextSwitchTo(oldContext);
+	for (int i = 0; i < nhist; i++)
+		stats->stanumbers[slot][i] = sizes[(int64) i * (nonnull - 1) / (nhist - 1)];
+	stats->stanumbers[slot][nhist] = totalSize / nonnull;
+	stats->stakind[slot] = STATISTIC_KIND_DECHIST;
+	stats->staop[slot] = Int4EqualOperator;
+	stats->stacoll[slot] = InvalidOid;
+	stats->numnumbers[slot] = nhist + 1;
+
+	hash_destroy(table);
+}
+
+/*
+ * Drop the elements that cannot be frequent, now that bucket is complete
+ */
+void prune_element_counts(HTAB *table, int32 bucket) {
+	HASH_SEQ_STATUS scan;
+	ElementCount *item;
+
+	hash_seq_init(&scan, table);
+	while ((item = (ElementCount *) hash_seq_search(&scan)) != NULL) {
+		if (item->frequency + item->delta <= bucket)
+			hash_search(table, &item->element, HASH_REMOVE, NULL);
+	}
+}
+
+/*
+ * Order counted elements by decreasing frequency
+ */
+int compare_element_frequency(const void *a, const void *b) {
+	int32 freqA = ((const ElementCount *) a)->frequency, freqB = ((const ElementCount *) b)->frequency;
+
+	return (freqA < freqB) - (freqA > freqB);
+}
+
+/*
+ * Read the element statistics of a column, returning false when it has
+ * none. Elements missing from the most common ones are given half the
+ * least frequency, as arraycontsel does.
+ */
+bool load_intset_stats(VariableStatData *vardata, IntSetStats *stats) {
+	memset(stats, 0, sizeof(IntSetStats));
+	if (!HeapTupleIsValid(vardata->statsTuple)) return false;
+
+	stats->nullfrac = ((Form_pg_statistic) GETSTRUCT(vardata->statsTuple))->stanullfrac;
+	stats->otherFreq = INTSET_DEFAULT_SEL;
+	if (get_attstatsslot(&stats->mcelem, vardata->statsTuple, STATISTIC_KIND_MCELEM, InvalidOid,
+	                     ATTSTATSSLOT_VALUES | ATTSTATSSLOT_NUMBERS)
+		&& stats->mcelem.nnumbers == stats->mcelem.nvalues + 3) {
+		stats->elements = stats->mcelem.values;
+		stats->freqs = stats->mcelem.numbers;
+		stats->nelements = stats->mcelem.nvalues;
+		stats->otherFreq = Min(INTSET_DEFAULT_SEL, stats->freqs[stats->nelements] / 2);
+	}
+	if (get_attstatsslot(&stats->dechist, vardata->statsTuple, STATISTIC_KIND_DECHIST, InvalidOid,
+	                     ATTSTATSSLOT_NUMBERS)
+		&& stats->dechist.nnumbers >= 3) {
+		stats->hist = stats->dechist.numbers;
+		stats->nhist = stats->dechist.nnumbers - 1;
+		stats->avgSize = stats->hist[stats->nhist];
+	} else {
+		// every set holds at least its share of the common elements
+		for (int i = 0; i < stats->nelements; i++)
+			stats->avgSize += stats->freqs[i];
+	}
+
+	if (stats->elements == NULL && stats->hist == NULL) {
+		free_intset_stats(stats);
+		return false;
+	}
+	return true;
+}
+
+void free_intset_stats(IntSetStats *stats) {
+	free_attstatsslot(&stats->mcelem);
+	free_attstatsslot(&stats->dechist);
+}
+
+/*
+ * Fraction of the sets holding num
+ */
+float4 element_freq(IntSetStats *stats, int32 num) {
+	int32 l = 0, r = stats->nelements - 1, m;
+
+	while (l <= r) {
+		m = l + (r - l) / 2;
+		if (DatumGetInt32(stats->elements[m]) == num) return stats->freqs[m];
+		else if (DatumGetInt32(stats->elements[m]) < num) l = m + 1;
+		else r = m - 1;
+	}
+	return stats->otherFreq;
+}
+
+/*
+ * Expected value of p to the power of the set size, the chance that every
+ * element of a set passes a test each one passes with probability p
+ */
+double expected_power(IntSetStats *stats, double p) {
+	double sum = 0;
+
+	if (stats->nhist < 2) return pow(p, stats->avgSize);
+	for (int i = 0; i < stats->nhist - 1; i++)
+		sum += pow(p, (stats->hist[i] + stats->hist[i + 1]) / 2.0);
+	return sum / (stats->nhist - 1);
+}
+
+/*
+ * Selectivity of "column <strategy> query" over the non-null sets
+ */
+Selectivity set_selectivity(IntSetStats *stats, StrategyNumber strategy, Datum query) {
+	IntSet *querySet;
+	int32 *data;
+	double result;
+
+	if (strategy == INTSET_ELEMENT_STRATEGY) return element_freq(stats, DatumGetInt32(query));
+
+	querySet = DatumGetIntSetP(query);
+	data = intset_numbers(querySet);
+	switch (strategy) {
+		case INTSET_CONTAINS_STRATEGY:
+			result = 1.0;
+			for (int i = 0; i < INTSET_SIZE(querySet); i++)
+				result *= element_freq(stats, data[i]);
+			return result;
+		case INTSET_CONTAINED_STRATEGY:
+			// chance that an element of a set is one of the query's
+			result = 0.0;
+			for (int i = 0; i < INTSET_SIZE(querySet) && result < stats->avgSize; i++)
+				result += element_freq(stats, data[i]);
+			result = stats->avgSize > 0 ? Min(1.0, result / stats->avgSize) : 1.0;
+			return expected_power(stats, result);
+		case INTSET_OVERLAP_STRATEGY:
+			result = 1.0;
+			for (int i = 0; i < INTSET_SIZE(querySet); i++)
+				result *= 1.0 - element_freq(stats, data[i]);
+			return 1.0 - result;
+		default:
+			elog(ERROR, "unrecognized strategy number: %d", strategy);
+	}
+	return INTSET_DEFAULT_SEL;
+}
+
+/*
+ * Selectivity of an int4 column being in a constant set, from the most
+ * common values of the column, the rest sharing the other distinct values
+ */
+Selectivity number_in_set_selectivity(VariableStatData *vardata, IntSet *intSet) {
+	AttStatsSlot sslot;
+	double result = 0, mcvFreq = 0, nullfrac = 0, ndistinct;
+	int32 matched = 0, nmcv = 0;
+	bool isdefault;
+
+	if (HeapTupleIsValid(vardata->statsTuple)) {
+		nullfrac = ((Form_pg_statistic) GETSTRUCT(vardata->statsTuple))->stanullfrac;
+		if (get_attstatsslot(&sslot, vardata->statsTuple, STATISTIC_KIND_MCV, InvalidOid,
+		                     ATTSTATSSLOT_VALUES | ATTSTATSSLOT_NUMBERS)) {
+			nmcv = sslot.nvalues;
+			for (int i = 0; i < sslot.nvalues; i++) {
+				mcvFreq += sslot.numbers[i];
+				if (intset_has(intSet, DatumGetInt32(sslot.values[i]))) {
+					result += sslot.numbers[i];
+					matched++;
+				}
+			}
+			free_attstatsslot(&sslot);
+		}
+	}
+	ndistinct = Max(get_variable_numdistinct(vardata, &isdefault) - nmcv, 1.0);
+	result += Min(1.0, (INTSET_SIZE(intSet) - matched) / ndistinct) * Max(1.0 - mcvFreq - nullfrac, 0.0);
+	return result;
+}
+
+/*
+ * Expected number of elements of the set an expression yields: the size
+ * of a constant, or the average size of the sets the expression was seen
+ * to hold by ANALYZE
+ */
+double estimate_intset_size(PlannerInfo *root, Node *node) {
+	VariableStatData vardata;
+	IntSetStats stats;
+	double result = INTSET_DEFAULT_ELEMENTS;
+
+	if (IsA(node, Const)) {
+		Const *constant = (Const *) node;
+
+		if (constant->constisnull) return 0;
+		// only the size is needed, so only the first TOAST chunk is fetched
+		return INTSET_SIZE((IntSet *) PG_DETOAST_DATUM_SLICE(constant->constvalue, 0, sizeof(int32)));
+	}
+	if (root == NULL) return result;
+
+	examine_variable(root, node, 0, &vardata);
+	if (load_intset_stats(&vardata, &stats)) {
+		result = stats.avgSize;
+		free_intset_stats(&stats);
+	}
+	ReleaseVariableStats(vardata);
+	return result;
+}
+
+/*
+ * Selectivity of joining sets with query sets on containment, or on
+ * overlap, from the chance that a common element of a query set is in
+ * a set
+ */
+Selectivity set_join_selectivity(IntSetStats *sets, IntSetStats *queries, bool overlap) {
+	double weight = 0, hits = 0, p;
+
+	for (int i = 0; i < queries->nelements; i++) {
+		weight += queries->freqs[i];
+		hits += queries->freqs[i] * element_freq(sets, DatumGetInt32(queries->elements[i]));
+	}
+	p = weight > 0 ? hits / weight : sets->otherFreq;
+	return overlap ? 1.0 - expected_power(queries, 1.0 - p) : expected_power(queries, p);
+}
+
+/*
+ * Selectivity of joining an int4 column with sets on membership. Common
+ * values count with the frequency of the matching element; the others
+ * are assumed to be spread over the sets' remaining elements.
+ */
+Selectivity number_join_selectivity(VariableStatData *vardata, IntSetStats *sets) {
+	AttStatsSlot sslot;
+	double result = 0, mcvFreq = 0, nullfrac = 0, rest = sets->avgSize, ndistinct;
+	int32 nmcv = 0;
+	bool isdefault;
+
+	if (HeapTupleIsValid(vardata->statsTuple)) {
+		nullfrac = ((Form_pg_statistic) GETSTRUCT(vardata->statsTuple))->stanullfrac;
+		if (get_attstatsslot(&sslot, vardata->statsTuple, STATISTIC_KIND_MCV, InvalidOid,
+		                     ATTSTATSSLOT_VALUES | ATTSTATSSLOT_NUMBERS)) {
+			nmcv = sslot.nvalues;
+			for (int i = 0; i < sslot.nvalues; i++) {
+				mcvFreq += sslot.numbers[i];
+				result += sslot.numbers[i] * element_freq(sets, DatumGetInt32(sslot.values[i]));
+			}
+			free_attstatsslot(&sslot);
+		}
+	}
+	for (int i = 0; i < sets->nelements; i++)
+		rest -= sets->freqs[i];
+	ndistinct = Max(get_variable_numdistinct(vardata, &isdefault) - nmcv, 1.0);
+	result += Min(1.0, Max(rest, 0.0) / ndistinct) * Max(1.0 - mcvFreq - nullfrac, 0.0);
+	return result;
+}
+
+/*
+ * Restriction selectivity of an intset operator with a constant side
+ */
+float8 intset_restriction_sel(PlannerInfo *root, List *args, int varRelid, StrategyNumber strategy) {
+	VariableStatData vardata;
+	Node *other;
+	bool varonleft;
+	IntSetStats stats;
+	Selectivity result;
+
+	if (!get_restriction_variable(root, args, varRelid, &vardata, &other, &varonleft))
+		return INTSET_DEFAULT_SEL;
+	if (!IsA(other, Const)) {
+		ReleaseVariableStats(vardata);
+		return INTSET_DEFAULT_SEL;
+	}
+	if (((Const *) other)->constisnull) {
+		ReleaseVariableStats(vardata);
+		return 0.0;
+	}
+
+	if (strategy == INTSET_ELEMENT_STRATEGY && vardata.vartype == INT4OID) {
+		result = number_in_set_selectivity(&vardata, DatumGetIntSetP(((Const *) other)->constvalue));
+	} else if (load_intset_stats(&vardata, &stats)) {
+		// with the column on the right, containment is seen from the other side
+		if (!varonleft && strategy == INTSET_CONTAINS_STRATEGY) strategy = INTSET_CONTAINED_STRATEGY;
+		else if (!varonleft && strategy == INTSET_CONTAINED_STRATEGY) strategy = INTSET_CONTAINS_STRATEGY;
+		result = set_selectivity(&stats, strategy, ((Const *) other)->constvalue) * (1.0 - stats.nullfrac);
+		free_intset_stats(&stats);
+	} else {
+		result = INTSET_DEFAULT_SEL;
+	}
+
+	ReleaseVariableStats(vardata);
+	CLAMP_PROBABILITY(result);
+	return result;
+}
+
+/*
+ * Join selectivity of an intset operator
+ */
+float8 intset_join_sel(PlannerInfo *root, List *args, SpecialJoinInfo *sjinfo, StrategyNumber strategy) {
+	VariableStatData vardata1, vardata2;
+	IntSetStats stats1, stats2;
+	bool reversed;
+	Selectivity result = INTSET_DEFAULT_SEL;
+
+	get_join_variables(root, args, sjinfo, &vardata1, &vardata2, &reversed);
+
+	if (strategy == INTSET_ELEMENT_STRATEGY) {
+		bool numberOnLeft = vardata1.vartype == INT4OID;
+
+		if (load_intset_stats(numberOnLeft ? &vardata2 : &vardata1, &stats1)) {
+			result = number_join_selectivity(numberOnLeft ? &vardata1 : &vardata2, &stats1)
+				* (1.0 - stats1.nullfrac);
+			free_intset_stats(&stats1);
+		}
+	} else if (load_intset_stats(&vardata1, &stats1)) {
+		if (load_intset_stats(&vardata2, &stats2)) {
+			if (strategy == INTSET_CONTAINS_STRATEGY)
+				result = set_join_selectivity(&stats1, &stats2, false);
+			else if (strategy == INTSET_CONTAINED_STRATEGY)
+				result = set_join_selectivity(&stats2, &stats1, false);
+			else
+				result = set_join_selectivity(&stats1, &stats2, true);
+			result *= (1.0 - stats1.nullfrac) * (1.0 - stats2.nullfrac);
+			free_intset_stats(&stats2);
+		}
+		free_intset_stats(&stats1);
+	}
+
+	ReleaseVariableStats(vardata1);
+	ReleaseVariableStats(vardata2);
+	CLAMP_PROBABILITY(result);
+	return result;
+}
+
+/*****************************************************************************
+ * GiST signatures
+ *
+ * Every number sets the bit its murmur hash selects, so clustered numbers
+ * spread over the whole signature instead of filling a few words. Keys
+ * of every kind can be read as signature words through key_words.
+ *****************************************************************************/
+
+/*
+ * Allocate a zeroed key of the given kind with room for size int32s
+ */
+IntSetSignature *new_gist_key(int32 flag, int32 size) {
+	Size length = INTSET_GIST_HEADER_SIZE + size * sizeof(int32);
+	IntSetSignature *key = (IntSetSignature *) palloc0(length);
+
+	SET_VARSIZE(key, length);
+	key->flag = flag;
+	return key;
+}
+
+/*
+ * Build the leaf key of a set: its numbers when there are few enough,
+ * its signature otherwise
+ */
+IntSetSignature *make_gist_key(int32 *data, int32 size) {
+	IntSetSignature *key;
+
+	if (size <= INTSET_GIST_MAX_ARRAY) {
+		key = new_gist_key(INTSET_GIST_ARRAY, size);
+		memcpy(key->data, data, size * sizeof(int32));
+		return key;
+	}
+	key = new_gist_key(INTSET_GIST_SIGNATURE, INTSET_SIGLEN / sizeof(int32));
+	sign_numbers(INTSET_GIST_WORDS(key), data, size);
+	return finish_signature(key);
+}
+
+/*
+ * Replace a signature with every bit set by the short ALLTRUE key
+ */
+IntSetSignature *finish_signature(IntSetSignature *key) {
+	uint64 *words = INTSET_GIST_WORDS(key);
+
+	for (int i = 0; i < INTSET_SIGLEN_WORDS; i++) {
+		if (words[i] != ~UINT64CONST(0)) return key;
+	}
+	pfree(key);
+	return new_gist_key(INTSET_GIST_ALLTRUE, 0);
+}
+
+uint32 signature_bit(int32 num) {
+	return murmurhash32((uint32) num) % INTSET_SIGLEN_BITS;
+}
+
+void sign_numbers(uint64 *words, int32 *data, int32 size) {
+	for (int i = 0; i < size; i++) {
+		uint32 bit = signature_bit(data[i]);
+
+		words[bit / 64] |= UINT64CONST(1) << (bit % 64);
+	}
+}
+
+/*
+ * Add every number the key stands for to the signature words
+ */
+void merge_signature(uint64 *words, IntSetSignature *key) {
+	switch (key->flag) {
+		case INTSET_GIST_ARRAY:
+			sign_numbers(words, key->data, INTSET_GIST_SIZE(key));
+			break;
+		case INTSET_GIST_SIGNATURE:
+			for (int i = 0; i < INTSET_SIGLEN_WORDS; i++)
+				words[i] |= INTSET_GIST_WORDS(key)[i];
+			break;
+		default:
+			memset(words, 0xff, INTSET_SIGLEN);
+	}
+}
+
+/*
+ * Return the signature words of any key, building them in buffer unless
+ * the key stores them
+ */
+uint64 *key_words(IntSetSignature *key, uint64 *buffer) {
+	if (key->flag == INTSET_GIST_SIGNATURE) return INTSET_GIST_WORDS(key);
+	memset(buffer, 0, INTSET_SIGLEN);
+	merge_signature(buffer, key);
+	return buffer;
+}
+
+bool signature_has_all(uint64 *words, int32 *data, int32 size) {
+	for (int i = 0; i < size; i++) {
+		uint32 bit = signature_bit(data[i]);
+
+		if ((words[bit / 64] & (UINT64CONST(1) << (bit % 64))) == 0) return false;
+	}
+	return true;
+}
+
+bool signature_has_any(uint64 *words, int32 *data, int32 size) {
+	for (int i = 0; i < size; i++) {
+		uint32 bit = signature_bit(data[i]);
+
+		if (words[bit / 64] & (UINT64CONST(1) << (bit % 64))) return true;
+	}
+	return false;
+}
+
+/*
+ * Jaccard index of the query and the sets under a GiST key: exact for keys
+ * holding numbers, an upper bound for signatures. No more numbers are in
+ * common than query numbers hitting a set bit, and the union is at least
+ * as large as the query and, on a leaf, as the set itself, which has more
+ * numbers than fit a key and at least as many as bits set.
+ */
+double key_similarity(IntSetSignature *key, bool leaf, int32 *data, int32 size) {
+	uint64 buffer[INTSET_SIGLEN_WORDS];
+	uint64 *words;
+	int32 common = 0, unionSize = size;
+
+	if (key->flag == INTSET_GIST_ARRAY) {
+		int32 keySize = INTSET_GIST_SIZE(key);
+
+		return jaccard_index(get_intersection_count(key->data, keySize, data, size), keySize, size);
+	}
+
+	words = key_words(key, buffer);
+	for (int i = 0; i < size; i++) {
+		uint32 bit = signature_bit(data[i]);
+
+		if (words[bit / 64] & (UINT64CONST(1) << (bit % 64))) common++;
+	}
+	if (common == 0) return 0.0;
+
+	if (leaf) {
+		int32 bits = 0;
+
+		for (int i = 0; i < INTSET_SIGLEN_WORDS; i++)
+			bits += pg_popcount64(words[i]);
+		unionSize = Max(unionSize, Max(bits, INTSET_GIST_MAX_ARRAY + 1));
+	}
+	return (double) common / unionSize;
+}
+
+/*
+ * Hamming distance, the number of bits set in only one of the signatures
+ */
+int32 words_distance(uint64 *wordsA, uint64 *wordsB) {
+	int32 distance = 0;
+
+	for (int i = 0; i < INTSET_SIGLEN_WORDS; i++)
+		distance += pg_popcount64(wordsA[i] ^ wordsB[i]);
+	return distance;
+}
+
+int32 signature_distance(IntSetSignature *keyA, IntSetSignature *keyB) {
+	uint64 bufferA[INTSET_SIGLEN_WORDS], bufferB[INTSET_SIGLEN_WORDS];
+
+	return words_distance(key_words(keyA, bufferA), key_words(keyB, bufferB));
+}
+
+/*
+ * Order split entries by decreasing cost
+ */
+int compare_split_cost(const void *a, const void *b) {
+	int32 costA = ((const SplitCost *) a)->cost, costB = ((const SplitCost *) b)->cost;
+
+	return (costA < costB) - (costA > costB);
+}
+
+/*****************************************************************************
+ * Big intsets
+ *
+ * A bigintset keeps its sorted numbers as offsets from the smallest one,
+ * in the fewest bytes its range allows: 2 bytes for sets spanning at most
+ * 65536 values, 4 bytes up to 2^32 values, and the numbers themselves
+ * with a zero base beyond that. The width only depends on the numbers,
+ * so equal sets have equal bytes. Lookups search the stored offsets with
+ * the narrow kernels, and set operations decode to int64 unless both sets
+ * share their width and base.
+ *****************************************************************************/
+
+/*
+ * Parse a bigintset literal, as parse_intset does
+ */
+BigIntSet *parse_bigintset(char *str) {
+	int64 *data = (int64 *) palloc((strlen(str) / 2 + 1) * sizeof(int64));
+	bool sorted;
+	int32 size = parse_numbers_int64(str, data, &sorted);
+
+	if (!sorted) qsort(data, size, sizeof(int64), compare_int64);
+	return make_bigintset(data, remove_duplicates_int64(data, size));
+}
+
+int compare_int64(const void *a, const void *b) {
+	int64 x = *(const int64 *) a, y = *(const int64 *) b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Build a bigintset of sorted, duplicate free numbers in the narrowest
+ * width their range fits
+ */
+BigIntSet *make_bigintset(int64 *data, int32 size) {
+	BigIntSet *bigSet;
+	int32 width = 2;
+	int64 base = 0;
+
+	if (size > BIGINTSET_MAX_NUMBERS)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("bigintset cannot hold more than %d elements", BIGINTSET_MAX_NUMBERS)));
+
+	if (size > 0) {
+		uint64 range = (uint64) data[size - 1] - (uint64) data[0];
+
+		if (range > PG_UINT32_MAX) width = 8;
+		else if (range > PG_UINT16_MAX) width = 4;
+		if (width < 8) base = data[0];
+	}
+
+	// zeroed, so that the padding of equal sets matches too
+	bigSet = (BigIntSet *) palloc0(BIGINTSET_HEADER_SIZE + (Size) size * width);
+	SET_VARSIZE(bigSet, BIGINTSET_HEADER_SIZE + (Size) size * width);
+	bigSet->size = size;
+	bigSet->width = width;
+	bigSet->base = base;
+	if (width == 2) {
+		uint16 *offsets = (uint16 *) bigSet->data;
+
+		for (int i = 0; i < size; i++) offsets[i] = (uint16) ((uint64) data[i] - (uint64) base);
+	} else if (width == 4) {
+		uint32 *offsets = (uint32 *) bigSet->data;
+
+		for (int i = 0; i < size; i++) offsets[i] = (uint32) ((uint64) data[i] - (uint64) base);
+	} else {
+		memcpy(bigSet->data, data, (Size) size * sizeof(int64));
+	}
+	return bigSet;
+}
+
+/*
+ * The i-th smallest number of a bigintset
+ */
+int64 bigintset_number(BigIntSet *bigSet, int32 i) {
+	if (bigSet->width == 2) return (int64) ((uint64) bigSet->base + ((uint16 *) bigSet->data)[i]);
+	if (bigSet->width == 4) return (int64) ((uint64) bigSet->base + ((uint32 *) bigSet->data)[i]);
+	return ((int64 *) bigSet->data)[i];
+}
+
+/*
+ * The numbers of a bigintset as a sorted array. Narrow sets are decoded
+ * into a new array, full width ones are returned in place
+ */
+int64 *bigintset_numbers(BigIntSet *bigSet) {
+	uint64 base = (uint64) bigSet->base;
+	int64 *result;
+
+	if (bigSet->width == 8) return (int64 *) bigSet->data;
+
+	result = (int64 *) palloc(Max(bigSet->size, 1) * sizeof(int64));
+	if (bigSet->width == 2) {
+		uint16 *offsets = (uint16 *) bigSet->data;
+
+		for (int i = 0; i < bigSet->size; i++) result[i] = (int64) (base + offsets[i]);
+	} else {
+		uint32 *offsets = (uint32 *) bigSet->data;
+
+		for (int i = 0; i < bigSet->size; i++) result[i] = (int64) (base + offsets[i]);
+	}
+	return result;
 }
 
 /*
- * Check if intSet A contain all the values in intSet B
- * for every element of B, it is an element of A
- * i.e. A >@ B
+ * Find the smallest or, if last is set, the largest number of a set,
+ * reading only its header and that number
+ * Returns false for an empty set
  */
-bool is_subset(int32 *dataA, int32 sizeA, int32 *dataB, int32 sizeB) {
-	for (int i = 0; i < sizeB; i++) {
-		// do binary search
-		if (!num_exist(dataA, dataB[i], sizeA)) return false;
+bool bigintset_bound(Datum bigSetDatum, bool last, int64 *result) {
+	BigIntSet header;
+	Size offset;
+
+	read_intset_slice(bigSetDatum, offsetof(BigIntSet, size),
+	                  BIGINTSET_HEADER_SIZE - offsetof(BigIntSet, size), &header.size);
+	if (header.size == 0) return false;
+
+	offset = BIGINTSET_HEADER_SIZE + (Size) (last ? header.size - 1 : 0) * header.width;
+	if (header.width == 2) {
+		uint16 low;
+
+		read_intset_slice(bigSetDatum, offset, sizeof(uint16), &low);
+		*result = (int64) ((uint64) header.base + low);
+	} else if (header.width == 4) {
+		uint32 low;
+
+		read_intset_slice(bigSetDatum, offset, sizeof(uint32), &low);
+		*result = (int64) ((uint64) header.base + low);
+	} else {
+		read_intset_slice(bigSetDatum, offset, sizeof(int64), result);
 	}
 	return true;
 }
 
 /*
- * Check whether two intSets are the same
+ * Check whether num is in a bigintset, searching the stored offsets
  */
-bool is_equal(int32 *dataA, int32 sizeA, int32 *dataB, int32 sizeB) {
-	if (sizeA != sizeB) return false;
-	for (int i = 0; i < sizeA; i++) {
-		if (dataA[i] != dataB[i]) return false;
+bool bigintset_has(BigIntSet *bigSet, int64 num) {
+	uint64 offset;
+
+	if (bigSet->width == 8) return num_exist_int64((int64 *) bigSet->data, num, bigSet->size);
+	if (num < bigSet->base) return false;
+
+	offset = (uint64) num - (uint64) bigSet->base;
+	if (bigSet->width == 2)
+		return offset <= PG_UINT16_MAX && num_exist_uint16((uint16 *) bigSet->data, (uint16) offset, bigSet->size);
+	return offset <= PG_UINT32_MAX && num_exist_uint32((uint32 *) bigSet->data, (uint32) offset, bigSet->size);
+}
+
+/*
+ * Check whether setB is a subset of setA
+ * Sets of the same width and base are compared on their stored offsets
+ */
+bool bigintset_is_subset(BigIntSet *setA, BigIntSet *setB) {
+	int32 sizeA = setA->size, sizeB = setB->size;
+	int64 *dataA, *dataB;
+	bool gallop;
+
+	if (sizeB == 0) return true;
+	if (sizeB > sizeA) return false;
+
+	gallop = use_galloping("subset", sizeA, sizeB);
+	if (setA->width == setB->width && setA->base == setB->base) {
+		if (setA->width == 2) {
+			uint16 *offsetsA = (uint16 *) setA->data, *offsetsB = (uint16 *) setB->data;
+
+			return gallop ? gallop_subset_uint16(offsetsA, sizeA, offsetsB, sizeB)
+			              : merge_subset_uint16(offsetsA, sizeA, offsetsB, sizeB);
+		}
+		if (setA->width == 4) {
+			uint32 *offsetsA = (uint32 *) setA->data, *offsetsB = (uint32 *) setB->data;
+
+			return gallop ? gallop_subset_uint32(offsetsA, sizeA, offsetsB, sizeB)
+			              : merge_subset_uint32(offsetsA, sizeA, offsetsB, sizeB);
+		}
+	}
+
+	dataA = bigintset_numbers(setA);
+	dataB = bigintset_numbers(setB);
+	if (dataB[0] < dataA[0] || dataB[sizeB - 1] > dataA[sizeA - 1]) return false;
+	return gallop ? gallop_subset_int64(dataA, sizeA, dataB, sizeB)
+	              : merge_subset_int64(dataA, sizeA, dataB, sizeB);
+}
+
+/*
+ * Check whether two bigintsets share a number
+ */
+bool bigintset_overlaps(BigIntSet *setA, BigIntSet *setB) {
+	if (setA->size == 0 || setB->size == 0) return false;
+
+	if (setA->width == setB->width && setA->base == setB->base) {
+		if (setA->width == 2)
+			return numbers_overlap_uint16((uint16 *) setA->data, setA->size,
+			                              (uint16 *) setB->data, setB->size);
+		if (setA->width == 4)
+			return numbers_overlap_uint32((uint32 *) setA->data, setA->size,
+			                              (uint32 *) setB->data, setB->size);
+	}
+	return numbers_overlap_int64(bigintset_numbers(setA), setA->size,
+	                             bigintset_numbers(setB), setB->size);
+}
+
+/*
+ * Encoding is canonical, so equal sets have equal bytes
+ */
+bool bigintset_is_equal(BigIntSet *setA, BigIntSet *setB) {
+	return VARSIZE(setA) == VARSIZE(setB) && memcmp(setA, setB, VARSIZE(setA)) == 0;
+}
+
+/*
+ * Compare two bigintsets lexicographically, as intset_compare does
+ */
+int32 bigintset_compare(BigIntSet *setA, BigIntSet *setB) {
+	int32 size = Min(setA->size, setB->size);
+
+	if (bigintset_is_equal(setA, setB)) return 0;
+
+	for (int i = 0; i < size; i++) {
+		int64 numA = bigintset_number(setA, i), numB = bigintset_number(setB, i);
+
+		if (numA != numB) return numA < numB ? -1 : 1;
+	}
+	return (setA->size > setB->size) - (setA->size < setB->size);
+}
+
+/*
+ * Combine two bigintsets with the int64 kernels, galloping through the
+ * larger one when the sizes are skewed
+ */
+BigIntSet *bigintset_operation(BigIntSet *setA, BigIntSet *setB, SetOperation op) {
+	int32 sizeA = setA->size, sizeB = setB->size, size;
+	int64 *dataA = bigintset_numbers(setA), *dataB = bigintset_numbers(setB);
+	int64 *result = (int64 *) palloc(Max((Size) sizeA + sizeB, 1) * sizeof(int64));
+
+	switch (op) {
+		case SET_INTERSECTION:
+			if (use_galloping("intersection", sizeA, sizeB))
+				size = gallop_intersection_int64(dataA, sizeA, dataB, sizeB, result);
+			else
+				size = merge_intersection_int64(dataA, sizeA, dataB, sizeB, result);
+			break;
+		case SET_UNION:
+			size = merge_union_int64(dataA, sizeA, dataB, sizeB, result);
+			break;
+		case SET_DIFFERENCE:
+			if (use_galloping("difference", sizeA, sizeB))
+				size = gallop_difference_int64(dataA, sizeA, dataB, sizeB, result);
+			else
+				size = merge_difference_int64(dataA, sizeA, dataB, sizeB, result);
+			break;
+		default:
+			size = get_disjunction_int64(dataA, sizeA, dataB, sizeB, result);
+			break;
+	}
+	return make_bigintset(result, size);
+}
+
+/*****************************************************************************
+ * Set kernels
+ *
+ * Scalar merges, from intset_kernels.h, work everywhere. On x86-64 the same operations are also
+ * built for SSE4.2, AVX2 and AVX-512 with function level target
+ * attributes, so the library still loads on CPUs lacking them.
+ *
+ * The vector intersection, difference and subset kernels compare a block
+ * of setA with a block of setB by testing every rotation of one block
+ * against the other, then advance the block whose largest number is
+ * smaller. Matches are moved to the front of the register with a shuffle
+ * (or a compressing store) and written out. The vector union runs a
+ * min/max merge network and drops duplicates before storing.
+ *****************************************************************************/
+
+/*
+ * Unpack a block of the packed format, see pack_block
+ * result must have room for INTSET_BLOCK_SIZE numbers
+ */
+void scalar_unpack_block(uint32 *words, int32 width, int32 first, int32 *result) {
+	uint32 mask = width == 32 ? ~0U : (1U << width) - 1;
+
+	for (int i = 0; i < INTSET_BLOCK_SIZE; i++) {
+		int32 bit = (i >> 2) * width, word = bit >> 5, shift = bit & 31, lane = i & 3;
+		uint32 gap = 0;
+		uint32 prev = i < 4 ? (uint32) first + i - 4 : (uint32) result[i - 4];
+
+		if (width > 0) {
+			gap = words[word * 4 + lane] >> shift;
+			if (shift + width > 32) gap |= words[(word + 1) * 4 + lane] << (32 - shift);
+		}
+		result[i] = (int32) (prev + (gap & mask) + 4);
+	}
+}
+
+/*
+ * Combine two bitmaps word by word into result, counting the bits set and
+ * the runs they form on the way: a run starts at every set bit whose lower
+ * neighbour is clear
+ */
+#define BITMAP_OPERATION(expression, popcount) \
+	for (int32 k = 0; k < ROARING_BITMAP_WORDS; k++) { \
+		uint64 word = (expression); \
+		result[k] = word; \
+		cardinality += popcount(word); \
+		starts += popcount(word & ~((word << 1) | carry)); \
+		carry = word >> 63; \
+	}
+
+int32 scalar_bitmap_operation(uint64 *wordsA, uint64 *wordsB, SetOperation op,
+                              uint64 *result, int32 *runs) {
+	int32 cardinality = 0, starts = 0;
+	uint64 carry = 0;
+
+	switch (op) {
+		case SET_INTERSECTION:
+			BITMAP_OPERATION(wordsA[k] & wordsB[k], pg_popcount64);
+			break;
+		case SET_UNION:
+			BITMAP_OPERATION(wordsA[k] | wordsB[k], pg_popcount64);
+			break;
+		case SET_DIFFERENCE:
+			BITMAP_OPERATION(wordsA[k] & ~wordsB[k], pg_popcount64);
+			break;
+		case SET_DISJUNCTION:
+			BITMAP_OPERATION(wordsA[k] ^ wordsB[k], pg_popcount64);
+			break;
+	}
+	*runs = starts;
+	return cardinality;
+}
+
+static const SetKernels scalar_kernels = {
+	"scalar",
+	merge_intersection,
+	merge_intersection_count,
+	merge_union,
+	merge_difference,
+	merge_subset,
+	scalar_unpack_block,
+	scalar_bitmap_operation
+};
+
+#ifdef INTSET_USE_X86_SIMD
+
+#define INTSET_TARGET(isa) __attribute__((target(isa)))
+
+/*
+ * pshufb masks moving the 32-bit lanes selected by a 4-bit mask to the
+ * front of an SSE register
+ */
+static uint8 sse_compress_shuffle[16][16];
+
+/*
+ * vpermd indexes moving the 32-bit lanes selected by an 8-bit mask to the
+ * front of an AVX2 register
+ */
+static int32 avx2_compress_permute[256][8];
+
+static void init_compress_tables(void) {
+	for (int mask = 0; mask < 256; mask++) {
+		int k = 0;
+
+		for (int lane = 0; lane < 8; lane++) {
+			if (!(mask & (1 << lane))) continue;
+			if (mask < 16) {
+				for (int b = 0; b < 4; b++)
+					sse_compress_shuffle[mask][k * 4 + b] = lane * 4 + b;
+			}
+			avx2_compress_permute[mask][k++] = lane;
+		}
+	}
+}
+
+/*
+ * Finish a block of setA the vector loop left behind. matched has a bit
+ * set for each number of the block already found in setB before *j.
+ * Numbers missing from the rest of setB are appended to result
+ */
+static int32 finish_difference_block(int32 *block, int32 width, int32 matched,
+                                     int32 *dataB, int32 sizeB, int32 *j,
+                                     int32 *result) {
+	int32 size = 0;
+
+	for (int k = 0; k < width; k++) {
+		if (matched & (1 << k)) continue;
+		while (*j < sizeB && dataB[*j] < block[k]) (*j)++;
+		if (*j < sizeB && dataB[*j] == block[k]) (*j)++;
+		else result[size++] = block[k];
+	}
+	return size;
+}
+
+/*
+ * Same for the subset test, with the roles of the sets swapped: the
+ * block belongs to setB, and every unmatched number must be found in
+ * the rest of setA
+ */
+static bool finish_subset_block(int32 *block, int32 width, int32 matched,
+                                int32 *dataA, int32 sizeA, int32 *i) {
+	for (int k = 0; k < width; k++) {
+		if (matched & (1 << k)) continue;
+		while (*i < sizeA && dataA[*i] < block[k]) (*i)++;
+		if (*i == sizeA || dataA[*i] != block[k]) return false;
+		(*i)++;
 	}
 	return true;
 }
 
+/* SSE4.2 */
+
 /*
- * Iterate setA, if number exists in setB, add the number into intersection set
+ * Bit k is set when lane k of a equals any lane of b
  */
-int32 *get_intersection(int32 *dataA, int32 sizeA,
-                        int32 *dataB, int32 sizeB, int32 *newSize) {
-	int32 *intersection = NULL, size = 0;
+INTSET_TARGET("sse4.2")
+static inline int sse_match_mask(__m128i a, __m128i b) {
+	__m128i eq = _mm_or_si128(
+		_mm_or_si128(_mm_cmpeq_epi32(a, b),
+					 _mm_cmpeq_epi32(a, _mm_shuffle_epi32(b, _MM_SHUFFLE(0, 3, 2, 1)))),
+		_mm_or_si128(_mm_cmpeq_epi32(a, _mm_shuffle_epi32(b, _MM_SHUFFLE(1, 0, 3, 2))),
+					 _mm_cmpeq_epi32(a, _mm_shuffle_epi32(b, _MM_SHUFFLE(2, 1, 0, 3)))));
 
-	for (int i = 0; i < sizeA; i++) {
-		if (!num_exist(dataB, dataA[i], sizeB)) continue;
-		if (size == 0) {
-			intersection = malloc(sizeof(int32));
-			intersection[size++] = dataA[i];
+	return _mm_movemask_ps(_mm_castsi128_ps(eq));
+}
+
+/*
+ * Store the lanes of v selected by mask contiguously at out, returning
+ * how many were stored
+ */
+INTSET_TARGET("sse4.2,popcnt")
+static inline int32 sse_compress_store(int32 *out, __m128i v, int mask) {
+	__m128i shuffle = _mm_loadu_si128((const __m128i *) sse_compress_shuffle[mask]);
+
+	_mm_storeu_si128((__m128i *) out, _mm_shuffle_epi8(v, shuffle));
+	return __builtin_popcount(mask);
+}
+
+INTSET_TARGET("sse4.2,popcnt")
+static int32 sse_intersection(int32 *dataA, int32 sizeA,
+                              int32 *dataB, int32 sizeB, int32 *result) {
+	int32 i = 0, j = 0, size = 0;
+
+	if (sizeA >= 4 && sizeB >= 4) {
+		__m128i va = _mm_loadu_si128((const __m128i *) dataA);
+		__m128i vb = _mm_loadu_si128((const __m128i *) dataB);
+
+		for (;;) {
+			int32 maxA = dataA[i + 3], maxB = dataB[j + 3];
+
+			size += sse_compress_store(&result[size], va, sse_match_mask(va, vb));
+			if (maxA <= maxB) i += 4;
+			if (maxB <= maxA) j += 4;
+			if (i + 4 > sizeA || j + 4 > sizeB) break;
+			if (maxA <= maxB) va = _mm_loadu_si128((const __m128i *) &dataA[i]);
+			if (maxB <= maxA) vb = _mm_loadu_si128((const __m128i *) &dataB[j]);
+		}
+	}
+	return size + merge_intersection(&dataA[i], sizeA - i, &dataB[j], sizeB - j,
+									 &result[size]);
+}
+
+INTSET_TARGET("sse4.2,popcnt")
+static int32 sse_intersection_count(int32 *dataA, int32 sizeA, int32 *dataB, int32 sizeB) {
+	int32 i = 0, j = 0, size = 0;
+
+	if (sizeA >= 4 && sizeB >= 4) {
+		__m128i va = _mm_loadu_si128((const __m128i *) dataA);
+		__m128i vb = _mm_loadu_si128((const __m128i *) dataB);
+
+		for (;;) {
+			int32 maxA = dataA[i + 3], maxB = dataB[j + 3];
+
+			size += __builtin_popcount(sse_match_mask(va, vb));
+			if (maxA <= maxB) i += 4;
+			if (maxB <= maxA) j += 4;
+			if (i + 4 > sizeA || j + 4 > sizeB) break;
+			if (maxA <= maxB) va = _mm_loadu_si128((const __m128i *) &dataA[i]);
+			if (maxB <= maxA) vb = _mm_loadu_si128((const __m128i *) &dataB[j]);
+		}
+	}
+	return size + merge_intersection_count(&dataA[i], sizeA - i, &dataB[j], sizeB - j);
+}
+
+INTSET_TARGET("sse4.2,popcnt")
+static int32 sse_difference(int32 *dataA, int32 sizeA,
+                            int32 *dataB, int32 sizeB, int32 *result) {
+	int32 i = 0, j = 0, size = 0;
+	int matched = 0;
+
+	if (sizeA >= 4 && sizeB >= 4) {
+		__m128i va = _mm_loadu_si128((const __m128i *) dataA);
+		__m128i vb = _mm_loadu_si128((const __m128i *) dataB);
+
+		for (;;) {
+			int32 maxA = dataA[i + 3], maxB = dataB[j + 3];
+
+			matched |= sse_match_mask(va, vb);
+			if (maxA <= maxB) {
+				size += sse_compress_store(&result[size], va, ~matched & 0xF);
+				matched = 0;
+				i += 4;
+			}
+			if (maxB <= maxA) j += 4;
+			if (i + 4 > sizeA || j + 4 > sizeB) break;
+			if (maxA <= maxB) va = _mm_loadu_si128((const __m128i *) &dataA[i]);
+			if (maxB <= maxA) vb = _mm_loadu_si128((const __m128i *) &dataB[j]);
+		}
+	}
+	if (matched != 0) {
+		size += finish_difference_block(&dataA[i], 4, matched, dataB, sizeB, &j,
+										&result[size]);
+		i += 4;
+	}
+	return size + merge_difference(&dataA[i], sizeA - i, &dataB[j], sizeB - j,
+								   &result[size]);
+}
+
+INTSET_TARGET("sse4.2")
+static bool sse_subset(int32 *dataA, int32 sizeA, int32 *dataB, int32 sizeB) {
+	int32 i = 0, j = 0;
+	int matched = 0;
+
+	if (sizeA >= 4 && sizeB >= 4) {
+		__m128i va = _mm_loadu_si128((const __m128i *) dataA);
+		__m128i vb = _mm_loadu_si128((const __m128i *) dataB);
+
+		for (;;) {
+			int32 maxA = dataA[i + 3], maxB = dataB[j + 3];
+
+			matched |= sse_match_mask(vb, va);
+			if (maxB <= maxA) {
+				if (matched != 0xF) return false;
+				matched = 0;
+				j += 4;
+			}
+			if (maxA <= maxB) i += 4;
+			if (i + 4 > sizeA || j + 4 > sizeB) break;
+			if (maxA <= maxB) va = _mm_loadu_si128((const __m128i *) &dataA[i]);
+			if (maxB <= maxA) vb = _mm_loadu_si128((const __m128i *) &dataB[j]);
+		}
+	}
+	if (matched != 0) {
+		if (!finish_subset_block(&dataB[j], 4, matched, dataA, sizeA, &i))
+			return false;
+		j += 4;
+	}
+	return merge_subset(&dataA[i], sizeA - i, &dataB[j], sizeB - j);
+}
+
+/*
+ * Bitonic merge of two sorted registers: afterwards *lo holds the four
+ * smallest numbers and *hi the four largest, both in ascending order
+ */
+INTSET_TARGET("sse4.2")
+static inline void sse_merge(__m128i a, __m128i b, __m128i *lo, __m128i *hi) {
+	__m128i min = _mm_min_epi32(a, b);
+	__m128i max = _mm_max_epi32(a, b);
+
+	for (int k = 0; k < 3; k++) {
+		min = _mm_alignr_epi8(min, min, 4);
+		a = _mm_min_epi32(min, max);
+		max = _mm_max_epi32(min, max);
+		min = a;
+	}
+	*lo = _mm_alignr_epi8(min, min, 4);
+	*hi = max;
+}
+
+/*
+ * Store the lanes of v that differ from their predecessor, the lane
+ * before the first being the last lane of prev
+ */
+INTSET_TARGET("sse4.2,popcnt")
+static inline int32 sse_store_unique(int32 *out, __m128i prev, __m128i v) {
+	__m128i shifted = _mm_alignr_epi8(v, prev, 12);
+	int dup = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, shifted)));
+
+	return sse_compress_store(out, v, ~dup & 0xF);
+}
+
+INTSET_TARGET("sse4.2,popcnt")
+static int32 sse_union(int32 *dataA, int32 sizeA,
+                       int32 *dataB, int32 sizeB, int32 *result) {
+	int32 i = 4, j = 4, size, last;
+	int32 pending[4];
+	__m128i lo, hi, prev;
+
+	if (sizeA < 4 || sizeB < 4)
+		return merge_union(dataA, sizeA, dataB, sizeB, result);
+
+	sse_merge(_mm_loadu_si128((const __m128i *) dataA),
+			  _mm_loadu_si128((const __m128i *) dataB), &lo, &hi);
+	// nothing precedes the first number, so make sure it is not a duplicate
+	prev = _mm_set1_epi32((int32) ((uint32) _mm_cvtsi128_si32(lo) - 1));
+	size = sse_store_unique(result, prev, lo);
+	prev = lo;
+
+	// hi always holds the four largest numbers merged so far
+	while (i + 4 <= sizeA && j + 4 <= sizeB) {
+		__m128i next;
+
+		if (dataA[i] <= dataB[j]) {
+			next = _mm_loadu_si128((const __m128i *) &dataA[i]);
+			i += 4;
 		} else {
-			size++;
-			intersection =
-                    insert_num(intersection, size, dataA[i], size - 1);
+			next = _mm_loadu_si128((const __m128i *) &dataB[j]);
+			j += 4;
 		}
+		sse_merge(next, hi, &lo, &hi);
+		size += sse_store_unique(&result[size], prev, lo);
+		prev = lo;
+	}
+
+	// three-way merge of the numbers still in hi with both tails
+	_mm_storeu_si128((__m128i *) pending, hi);
+	last = result[size - 1];
+	for (int k = 0; k < 4 || i < sizeA || j < sizeB;) {
+		int32 num;
+
+		if (k < 4 && (i == sizeA || pending[k] <= dataA[i]) &&
+			(j == sizeB || pending[k] <= dataB[j]))
+			num = pending[k++];
+		else if (i < sizeA && (j == sizeB || dataA[i] <= dataB[j]))
+			num = dataA[i++];
+		else
+			num = dataB[j++];
+		if (num != last) result[size++] = last = num;
 	}
-	*newSize = size;
-	return intersection;
+	return size;
 }
 
+/* AVX2 */
+
 /*
- * Get union set, copy setA into union set and check each number in
- * setB. Add number in setB which is not in current union set.
+ * Bit k is set when lane k of a equals any lane of b
  */
-int32 *get_union(int32 *dataA, int32 sizeA,
-                 int32 *dataB, int32 sizeB, int32 *newSize) {
-	int32 size = sizeB, *unionSet = NULL, pos = 0;
-	unionSet = malloc(sizeof(int32) * size);
-	for (int j = 0; j < sizeB; j++) {
-		unionSet[j] = dataB[j];
+INTSET_TARGET("avx2")
+static inline int avx2_match_mask(__m256i a, __m256i b) {
+	// rotating the halves with vpshufd and swapping them with vpermq keeps
+	// every shuffle at one cycle latency
+	__m256i swapped = _mm256_permute4x64_epi64(b, _MM_SHUFFLE(1, 0, 3, 2));
+	__m256i eq = _mm256_or_si256(
+		_mm256_or_si256(_mm256_cmpeq_epi32(a, b),
+						_mm256_cmpeq_epi32(a, _mm256_shuffle_epi32(b, _MM_SHUFFLE(0, 3, 2, 1)))),
+		_mm256_or_si256(_mm256_cmpeq_epi32(a, _mm256_shuffle_epi32(b, _MM_SHUFFLE(1, 0, 3, 2))),
+						_mm256_cmpeq_epi32(a, _mm256_shuffle_epi32(b, _MM_SHUFFLE(2, 1, 0, 3)))));
+
+	eq = _mm256_or_si256(eq, _mm256_or_si256(
+		_mm256_or_si256(_mm256_cmpeq_epi32(a, swapped),
+						_mm256_cmpeq_epi32(a, _mm256_shuffle_epi32(swapped, _MM_SHUFFLE(0, 3, 2, 1)))),
+		_mm256_or_si256(_mm256_cmpeq_epi32(a, _mm256_shuffle_epi32(swapped, _MM_SHUFFLE(1, 0, 3, 2))),
+						_mm256_cmpeq_epi32(a, _mm256_shuffle_epi32(swapped, _MM_SHUFFLE(2, 1, 0, 3))))));
+	return _mm256_movemask_ps(_mm256_castsi256_ps(eq));
+}
+
+INTSET_TARGET("avx2,popcnt")
+static inline int32 avx2_compress_store(int32 *out, __m256i v, int mask) {
+	__m256i permute = _mm256_loadu_si256((const __m256i *) avx2_compress_permute[mask]);
+
+	_mm256_storeu_si256((__m256i *) out, _mm256_permutevar8x32_epi32(v, permute));
+	return __builtin_popcount(mask);
+}
+
+INTSET_TARGET("avx2,popcnt")
+static int32 avx2_intersection(int32 *dataA, int32 sizeA,
+                               int32 *dataB, int32 sizeB, int32 *result) {
+	int32 i = 0, j = 0, size = 0;
+
+	if (sizeA >= 8 && sizeB >= 8) {
+		__m256i va = _mm256_loadu_si256((const __m256i *) dataA);
+		__m256i vb = _mm256_loadu_si256((const __m256i *) dataB);
+
+		for (;;) {
+			int32 maxA = dataA[i + 7], maxB = dataB[j + 7];
+
+			size += avx2_compress_store(&result[size], va, avx2_match_mask(va, vb));
+			if (maxA <= maxB) i += 8;
+			if (maxB <= maxA) j += 8;
+			if (i + 8 > sizeA || j + 8 > sizeB) break;
+			if (maxA <= maxB) va = _mm256_loadu_si256((const __m256i *) &dataA[i]);
+			if (maxB <= maxA) vb = _mm256_loadu_si256((const __m256i *) &dataB[j]);
+		}
 	}
+	return size + sse_intersection(&dataA[i], sizeA - i, &dataB[j], sizeB - j,
+								   &result[size]);
+}
 
-	for (int i = 0; i < sizeA; i++) {
-		if (num_exist(unionSet, dataA[i], size)) continue;
-		pos = find_insert_pos(unionSet, dataA[i], size);
-		unionSet = insert_num(unionSet, ++size, dataA[i], pos);
+INTSET_TARGET("avx2,popcnt")
+static int32 avx2_intersection_count(int32 *dataA, int32 sizeA, int32 *dataB, int32 sizeB) {
+	int32 i = 0, j = 0, size = 0;
+
+	if (sizeA >= 8 && sizeB >= 8) {
+		__m256i va = _mm256_loadu_si256((const __m256i *) dataA);
+		__m256i vb = _mm256_loadu_si256((const __m256i *) dataB);
+
+		for (;;) {
+			int32 maxA = dataA[i + 7], maxB = dataB[j + 7];
+
+			size += __builtin_popcount(avx2_match_mask(va, vb));
+			if (maxA <= maxB) i += 8;
+			if (maxB <= maxA) j += 8;
+			if (i + 8 > sizeA || j + 8 > sizeB) break;
+			if (maxA <= maxB) va = _mm256_loadu_si256((const __m256i *) &dataA[i]);
+			if (maxB <= maxA) vb = _mm256_loadu_si256((const __m256i *) &dataB[j]);
+		}
+	}
+	return size + sse_intersection_count(&dataA[i], sizeA - i, &dataB[j], sizeB - j);
+}
+
+INTSET_TARGET("avx2,popcnt")
+static int32 avx2_difference(int32 *dataA, int32 sizeA,
+                             int32 *dataB, int32 sizeB, int32 *result) {
+	int32 i = 0, j = 0, size = 0;
+	int matched = 0;
+
+	if (sizeA >= 8 && sizeB >= 8) {
+		__m256i va = _mm256_loadu_si256((const __m256i *) dataA);
+		__m256i vb = _mm256_loadu_si256((const __m256i *) dataB);
+
+		for (;;) {
+			int32 maxA = dataA[i + 7], maxB = dataB[j + 7];
+
+			matched |= avx2_match_mask(va, vb);
+			if (maxA <= maxB) {
+				size += avx2_compress_store(&result[size], va, ~matched & 0xFF);
+				matched = 0;
+				i += 8;
+			}
+			if (maxB <= maxA) j += 8;
+			if (i + 8 > sizeA || j + 8 > sizeB) break;
+			if (maxA <= maxB) va = _mm256_loadu_si256((const __m256i *) &dataA[i]);
+			if (maxB <= maxA) vb = _mm256_loadu_si256((const __m256i *) &dataB[j]);
+		}
+	}
+	if (matched != 0) {
+		size += finish_difference_block(&dataA[i], 8, matched, dataB, sizeB, &j,
+										&result[size]);
+		i += 8;
 	}
+	return size + sse_difference(&dataA[i], sizeA - i, &dataB[j], sizeB - j,
+								 &result[size]);
+}
+
+INTSET_TARGET("avx2")
+static bool avx2_subset(int32 *dataA, int32 sizeA, int32 *dataB, int32 sizeB) {
+	int32 i = 0, j = 0;
+	int matched = 0;
 
-	*newSize = size;
-	return unionSet;
+	if (sizeA >= 8 && sizeB >= 8) {
+		__m256i va = _mm256_loadu_si256((const __m256i *) dataA);
+		__m256i vb = _mm256_loadu_si256((const __m256i *) dataB);
+
+		for (;;) {
+			int32 maxA = dataA[i + 7], maxB = dataB[j + 7];
+
+			matched |= avx2_match_mask(vb, va);
+			if (maxB <= maxA) {
+				if (matched != 0xFF) return false;
+				matched = 0;
+				j += 8;
+			}
+			if (maxA <= maxB) i += 8;
+			if (i + 8 > sizeA || j + 8 > sizeB) break;
+			if (maxA <= maxB) va = _mm256_loadu_si256((const __m256i *) &dataA[i]);
+			if (maxB <= maxA) vb = _mm256_loadu_si256((const __m256i *) &dataB[j]);
+		}
+	}
+	if (matched != 0) {
+		if (!finish_subset_block(&dataB[j], 8, matched, dataA, sizeA, &i))
+			return false;
+		j += 8;
+	}
+	return sse_subset(&dataA[i], sizeA - i, &dataB[j], sizeB - j);
 }
 
+/* AVX-512 */
+
 /*
- * Get disjunction set by minus intersection from union. If number
- * is in intersection set, jump to next number in union set.
+ * Bit k is set when lane k of a equals any lane of b. valignd needs an
+ * immediate rotation count, hence the unrolled compares
  */
-int32 *get_disjunction(int32 *dataA, int32 sizeA,
-                       int32 *dataB, int32 sizeB, int32 *newSize) {
-	int32 interSize = 0, unionSize = 0, size = 0,
-        *interSet = NULL, *unionSet = NULL, *disSet = NULL;
-    
-    interSet = get_intersection(dataA, sizeA, dataB, sizeB, &interSize);
-	unionSet = get_union(dataA, sizeA, dataB, sizeB, &unionSize);
-	for(int i = 0; i < unionSize; i++) {
-		if (num_exist(interSet, unionSet[i], interSize)) continue;
-		if (size == 0) {
-			disSet = malloc(sizeof(int32));
-			disSet[size++] = unionSet[i];
-		} else {
-			size++;
-			disSet = insert_num(disSet, size, unionSet[i], size - 1);
+#define AVX512_MATCH_ROTATION(k) \
+	_mm512_cmpeq_epi32_mask(a, _mm512_alignr_epi32(b, b, k))
+
+INTSET_TARGET("avx512f")
+static inline __mmask16 avx512_match_mask(__m512i a, __m512i b) {
+	return _mm512_cmpeq_epi32_mask(a, b) |
+		AVX512_MATCH_ROTATION(1) | AVX512_MATCH_ROTATION(2) |
+		AVX512_MATCH_ROTATION(3) | AVX512_MATCH_ROTATION(4) |
+		AVX512_MATCH_ROTATION(5) | AVX512_MATCH_ROTATION(6) |
+		AVX512_MATCH_ROTATION(7) | AVX512_MATCH_ROTATION(8) |
+		AVX512_MATCH_ROTATION(9) | AVX512_MATCH_ROTATION(10) |
+		AVX512_MATCH_ROTATION(11) | AVX512_MATCH_ROTATION(12) |
+		AVX512_MATCH_ROTATION(13) | AVX512_MATCH_ROTATION(14) |
+		AVX512_MATCH_ROTATION(15);
+}
+
+INTSET_TARGET("avx512f,avx2,popcnt")
+static int32 avx512_intersection(int32 *dataA, int32 sizeA,
+                                 int32 *dataB, int32 sizeB, int32 *result) {
+	int32 i = 0, j = 0, size = 0;
+
+	if (sizeA >= 16 && sizeB >= 16) {
+		__m512i va = _mm512_loadu_si512(dataA);
+		__m512i vb = _mm512_loadu_si512(dataB);
+
+		for (;;) {
+			int32 maxA = dataA[i + 15], maxB = dataB[j + 15];
+			__mmask16 mask = avx512_match_mask(va, vb);
+
+			_mm512_mask_compressstoreu_epi32(&result[size], mask, va);
+			size += __builtin_popcount(mask);
+			if (maxA <= maxB) i += 16;
+			if (maxB <= maxA) j += 16;
+			if (i + 16 > sizeA || j + 16 > sizeB) break;
+			if (maxA <= maxB) va = _mm512_loadu_si512(&dataA[i]);
+			if (maxB <= maxA) vb = _mm512_loadu_si512(&dataB[j]);
+		}
+	}
+	return size + avx2_intersection(&dataA[i], sizeA - i, &dataB[j], sizeB - j,
+									&result[size]);
+}
+
+INTSET_TARGET("avx512f,avx2,popcnt")
+static int32 avx512_intersection_count(int32 *dataA, int32 sizeA, int32 *dataB, int32 sizeB) {
+	int32 i = 0, j = 0, size = 0;
+
+	if (sizeA >= 16 && sizeB >= 16) {
+		__m512i va = _mm512_loadu_si512(dataA);
+		__m512i vb = _mm512_loadu_si512(dataB);
+
+		for (;;) {
+			int32 maxA = dataA[i + 15], maxB = dataB[j + 15];
+
+			size += __builtin_popcount(avx512_match_mask(va, vb));
+			if (maxA <= maxB) i += 16;
+			if (maxB <= maxA) j += 16;
+			if (i + 16 > sizeA || j + 16 > sizeB) break;
+			if (maxA <= maxB) va = _mm512_loadu_si512(&dataA[i]);
+			if (maxB <= maxA) vb = _mm512_loadu_si512(&dataB[j]);
+		}
+	}
+	return size + avx2_intersection_count(&dataA[i], sizeA - i, &dataB[j], sizeB - j);
+}
+
+INTSET_TARGET("avx512f,avx2,popcnt")
+static int32 avx512_difference(int32 *dataA, int32 sizeA,
+                               int32 *dataB, int32 sizeB, int32 *result) {
+	int32 i = 0, j = 0, size = 0;
+	int matched = 0;
+
+	if (sizeA >= 16 && sizeB >= 16) {
+		__m512i va = _mm512_loadu_si512(dataA);
+		__m512i vb = _mm512_loadu_si512(dataB);
+
+		for (;;) {
+			int32 maxA = dataA[i + 15], maxB = dataB[j + 15];
+
+			matched |= avx512_match_mask(va, vb);
+			if (maxA <= maxB) {
+				_mm512_mask_compressstoreu_epi32(&result[size], ~matched & 0xFFFF, va);
+				size += 16 - __builtin_popcount(matched);
+				matched = 0;
+				i += 16;
+			}
+			if (maxB <= maxA) j += 16;
+			if (i + 16 > sizeA || j + 16 > sizeB) break;
+			if (maxA <= maxB) va = _mm512_loadu_si512(&dataA[i]);
+			if (maxB <= maxA) vb = _mm512_loadu_si512(&dataB[j]);
+		}
+	}
+	if (matched != 0) {
+		size += finish_difference_block(&dataA[i], 16, matched, dataB, sizeB, &j,
+										&result[size]);
+		i += 16;
+	}
+	return size + avx2_difference(&dataA[i], sizeA - i, &dataB[j], sizeB - j,
+								  &result[size]);
+}
+
+INTSET_TARGET("avx512f,avx2")
+static bool avx512_subset(int32 *dataA, int32 sizeA, int32 *dataB, int32 sizeB) {
+	int32 i = 0, j = 0;
+	int matched = 0;
+
+	if (sizeA >= 16 && sizeB >= 16) {
+		__m512i va = _mm512_loadu_si512(dataA);
+		__m512i vb = _mm512_loadu_si512(dataB);
+
+		for (;;) {
+			int32 maxA = dataA[i + 15], maxB = dataB[j + 15];
+
+			matched |= avx512_match_mask(vb, va);
+			if (maxB <= maxA) {
+				if (matched != 0xFFFF) return false;
+				matched = 0;
+				j += 16;
+			}
+			if (maxA <= maxB) i += 16;
+			if (i + 16 > sizeA || j + 16 > sizeB) break;
+			if (maxA <= maxB) va = _mm512_loadu_si512(&dataA[i]);
+			if (maxB <= maxA) vb = _mm512_loadu_si512(&dataB[j]);
 		}
 	}
-	*newSize = size;
-	return disSet;
+	if (matched != 0) {
+		if (!finish_subset_block(&dataB[j], 16, matched, dataA, sizeA, &i))
+			return false;
+		j += 16;
+	}
+	return avx2_subset(&dataA[i], sizeA - i, &dataB[j], sizeB - j);
 }
 
 /*
- * Iterate through setA, if number is not in setB, add into difSet.
+ * Unpack a block of the packed format, see pack_block. Its four lanes are
+ * interleaved, so each step shifts out four gaps at once and adds them to
+ * the previous four numbers.
  */
-int32 *get_difference(int32 *dataA, int32 sizeA,
-                      int32 *dataB, int32 sizeB, int32 *newSize) {
-	int32 size = 0, *diffSet = NULL;
+INTSET_TARGET("sse4.2")
+static void sse_unpack_block(uint32 *words, int32 width, int32 first, int32 *result) {
+	__m128i prev = _mm_add_epi32(_mm_set1_epi32(first), _mm_setr_epi32(-4, -3, -2, -1));
+	__m128i four = _mm_set1_epi32(4);
+	__m128i mask, current;
+	int32 word = 0, shift = 0;
 
-	for(int i = 0; i < sizeA; i++) {
-		if (num_exist(dataB, dataA[i], sizeB)) continue;
-		if (size == 0) {
-			diffSet = malloc(sizeof(int32));
-			diffSet[size++] = dataA[i];
-		} else {
-			size++;
-			diffSet = insert_num(diffSet, size, dataA[i], size - 1);
+	if (width == 0) {
+		for (int k = 0; k < INTSET_BLOCK_SIZE / 4; k++) {
+			prev = _mm_add_epi32(prev, four);
+			_mm_storeu_si128((__m128i *) &result[k * 4], prev);
+		}
+		return;
+	}
+
+	mask = _mm_set1_epi32(width == 32 ? -1 : (int32) ((1U << width) - 1));
+	current = _mm_loadu_si128((__m128i *) words);
+	for (int k = 0; k < INTSET_BLOCK_SIZE / 4; k++) {
+		__m128i gap = _mm_srl_epi32(current, _mm_cvtsi32_si128(shift));
+
+		shift += width;
+		if (shift >= 32) {
+			// the words of a block end with its last gap, never read past them
+			if (++word < width) {
+				__m128i next = _mm_loadu_si128((__m128i *) &words[word * 4]);
+
+				if (shift > 32)
+					gap = _mm_or_si128(gap, _mm_sll_epi32(next, _mm_cvtsi32_si128(32 - (shift - width))));
+				current = next;
+			}
+			shift -= 32;
 		}
+		prev = _mm_add_epi32(prev, _mm_add_epi32(_mm_and_si128(gap, mask), four));
+		_mm_storeu_si128((__m128i *) &result[k * 4], prev);
+	}
+}
+
+/*
+ * Same as scalar_bitmap_operation, with popcnt instructions in place of
+ * calls through pg_popcount64
+ */
+INTSET_TARGET("popcnt")
+static int32 popcnt_bitmap_operation(uint64 *wordsA, uint64 *wordsB, SetOperation op,
+                                     uint64 *result, int32 *runs) {
+	int32 cardinality = 0, starts = 0;
+	uint64 carry = 0;
+
+	switch (op) {
+		case SET_INTERSECTION:
+			BITMAP_OPERATION(wordsA[k] & wordsB[k], __builtin_popcountll);
+			break;
+		case SET_UNION:
+			BITMAP_OPERATION(wordsA[k] | wordsB[k], __builtin_popcountll);
+			break;
+		case SET_DIFFERENCE:
+			BITMAP_OPERATION(wordsA[k] & ~wordsB[k], __builtin_popcountll);
+			break;
+		case SET_DISJUNCTION:
+			BITMAP_OPERATION(wordsA[k] ^ wordsB[k], __builtin_popcountll);
+			break;
 	}
-	*newSize = size;
-	return diffSet;
+	*runs = starts;
+	return cardinality;
 }
 
+/*
+ * The vector loops hand their tails to the next narrower kernel. Union
+ * and unpacking have no wider version than SSE, a merge network wider
+ * than four lanes spends more on shuffles than it saves, and the packed
+ * format is laid out for four lanes.
+ */
+static const SetKernels sse42_kernels = {
+	"sse4.2",
+	sse_intersection,
+	sse_intersection_count,
+	sse_union,
+	sse_difference,
+	sse_subset,
+	sse_unpack_block,
+	popcnt_bitmap_operation
+};
+
+static const SetKernels avx2_kernels = {
+	"avx2",
+	avx2_intersection,
+	avx2_intersection_count,
+	sse_union,
+	avx2_difference,
+	avx2_subset,
+	sse_unpack_block,
+	popcnt_bitmap_operation
+};
+
+static const SetKernels avx512_kernels = {
+	"avx512",
+	avx512_intersection,
+	avx512_intersection_count,
+	sse_union,
+	avx512_difference,
+	avx512_subset,
+	sse_unpack_block,
+	popcnt_bitmap_operation
+};
+
+#endif							/* INTSET_USE_X86_SIMD */
+
+/*
+ * Pick the widest set kernels the CPU (and the OS, for AVX state) can run
+ */
+void choose_set_kernels(void) {
+	set_kernels = &scalar_kernels;
+
+#ifdef INTSET_USE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt")) {
+		init_compress_tables();
+		set_kernels = &sse42_kernels;
+		if (__builtin_cpu_supports("avx2"))
+			set_kernels = &avx2_kernels;
+		if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("avx512f"))
+			set_kernels = &avx512_kernels;
+	}
+#endif
+
+	elog(DEBUG1, "intset set kernels: %s", set_kernels->name);
+}
+
+/*
+ * Kernels to use for the current call, honouring intset.force_scalar
+ */
+const SetKernels *current_set_kernels(void) {
+	if (force_scalar || set_kernels == NULL) return &scalar_kernels;
+	return set_kernels;
+}
@@ -0,0 +1,629 @@
+/*
+ * src/tutorial/intset_kernels.h
+ *
+ ******************************************************************************
+ Scalar kernels over sorted, duplicate free arrays of numbers, written once
+ for every element type the intset module stores. intset.c includes this
+ file once per type, after defining
+
+	KERNEL_TYPE			the element type, such as int32 or int64
+	KERNEL_NAME(name)	the name of each function for that type
+
+ so that intSet, bigintset and the narrow offsets of bigintset share the
+ same merges and searches. Sizes and positions are int32 for every type.
+
+ The signed element types also get their text and binary I/O from here,
+ when intset.c defines
+
+	KERNEL_UNSIGNED		the unsigned type of the same width
+	KERNEL_MAX			the largest element
+	KERNEL_SQL_TYPE		the SQL name of the element type, for errors
+	KERNEL_SET_TYPE		the SQL name of the set type, for errors
+ The functions are static inline, so each instantiation stays private to
+ intset.c and is compiled into its callers where that pays.
+ ******************************************************************************/
+
+#ifndef KERNEL_TYPE
+#error "KERNEL_TYPE must be defined before including intset_kernels.h"
+#endif
+#ifndef KERNEL_NAME
+#error "KERNEL_NAME must be defined before including intset_kernels.h"
+#endif
+
+#ifndef INTSET_KERNELS_TABLES
+#define INTSET_KERNELS_TABLES
+
+/*
+ * Decimal digits of every number from 00 to 99, so numbers can be
+ * written two digits at a time
+ */
+static const char digit_pairs[201] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+/*
+ * The smallest number of each digit count, up to the 20 digits of the
+ * largest uint64
+ */
+static const uint64 powers_of_ten[20] = {
+	UINT64CONST(1), UINT64CONST(10), UINT64CONST(100), UINT64CONST(1000),
+	UINT64CONST(10000), UINT64CONST(100000), UINT64CONST(1000000),
+	UINT64CONST(10000000), UINT64CONST(100000000), UINT64CONST(1000000000),
+	UINT64CONST(10000000000), UINT64CONST(100000000000),
+	UINT64CONST(1000000000000), UINT64CONST(10000000000000),
+	UINT64CONST(100000000000000), UINT64CONST(1000000000000000),
+	UINT64CONST(10000000000000000), UINT64CONST(100000000000000000),
+	UINT64CONST(1000000000000000000), UINT64CONST(10000000000000000000)
+};
+
+#endif							/* INTSET_KERNELS_TABLES */
+
+/*
+ * Check if the integer has been in the array
+ * Searching the number by binary search
+ */
+static inline bool KERNEL_NAME(num_exist)(KERNEL_TYPE *data, KERNEL_TYPE target, int32 size) {
+	int32 l = 0, r = size - 1, m;
+
+	while (l <= r) {
+		m = l + (r - l) / 2;
+		if (data[m] == target) return true;
+		else if (data[m] < target) l = m + 1;
+		else r = m - 1;
+	}
+	return false;
+}
+
+/*
+ * Find the first position at or after from whose number is not less than
+ * target. The window doubles until it passes target and is then binary
+ * searched, so the cost depends on the distance moved, not on size
+ */
+static inline int32 KERNEL_NAME(gallop_search)(KERNEL_TYPE *data, int32 size, int32 from, KERNEL_TYPE target) {
+	int32 lo = from, hi, step = 1, m;
+
+	if (lo >= size || data[lo] >= target) return lo;
+
+	// data[lo] < target, grow the window until data[hi] >= target
+	hi = lo + 1;
+	while (hi < size && data[hi] < target) {
+		lo = hi;
+		step <<= 1;
+		hi = lo + step;
+	}
+	if (hi > size) hi = size;
+
+	while (lo + 1 < hi) {
+		m = lo + (hi - lo) / 2;
+		if (data[m] < target) lo = m;
+		else hi = m;
+	}
+	return hi;
+}
+
+/*
+ * Drop repeated numbers from a sorted array in place, returning the new size
+ */
+static inline int32 KERNEL_NAME(remove_duplicates)(KERNEL_TYPE *data, int32 size) {
+	int32 newSize = 0;
+
+	for (int i = 0; i < size; i++) {
+		if (newSize == 0 || data[i] != data[newSize - 1]) data[newSize++] = data[i];
+	}
+	return newSize;
+}
+
+/*
+ * Merge the two sorted arrays, keeping the numbers found in both
+ */
+static inline int32 KERNEL_NAME(merge_intersection)(KERNEL_TYPE *dataA, int32 sizeA,
+                                                    KERNEL_TYPE *dataB, int32 sizeB, KERNEL_TYPE *result) {
+	int32 i = 0, j = 0, size = 0;
+
+	while (i < sizeA && j < sizeB) {
+		if (dataA[i] < dataB[j]) i++;
+		else if (dataA[i] > dataB[j]) j++;
+		else {
+			result[size++] = dataA[i];
+			i++;
+			j++;
+		}
+	}
+	return size;
+}
+
+/*
+ * Count the numbers found in both sorted arrays, without branching on
+ * which one to advance
+ */
+static inline int32 KERNEL_NAME(merge_intersection_count)(KERNEL_TYPE *dataA, int32 sizeA,
+                                                          KERNEL_TYPE *dataB, int32 sizeB) {
+	int32 i = 0, j = 0, size = 0;
+
+	while (i < sizeA && j < sizeB) {
+		KERNEL_TYPE a = dataA[i], b = dataB[j];
+
+		size += a == b;
+		i += a <= b;
+		j += b <= a;
+	}
+	return size;
+}
+
+/*
+ * Merge the two sorted arrays, keeping every number once
+ */
+static inline int32 KERNEL_NAME(merge_union)(KERNEL_TYPE *dataA, int32 sizeA,
+                                             KERNEL_TYPE *dataB, int32 sizeB, KERNEL_TYPE *result) {
+	int32 i = 0, j = 0, size = 0;
+
+	while (i < sizeA && j < sizeB) {
+		if (dataA[i] < dataB[j]) result[size++] = dataA[i++];
+		else if (dataA[i] > dataB[j]) result[size++] = dataB[j++];
+		else {
+			result[size++] = dataA[i];
+			i++;
+			j++;
+		}
+	}
+	// at most one of the tails is left, copy it as is
+	memcpy(&result[size], &dataA[i], (sizeA - i) * sizeof(KERNEL_TYPE));
+	size += sizeA - i;
+	memcpy(&result[size], &dataB[j], (sizeB - j) * sizeof(KERNEL_TYPE));
+	size += sizeB - j;
+	return size;
+}
+
+/*
+ * Merge the two sorted arrays, keeping the numbers of setA not in setB
+ */
+static inline int32 KERNEL_NAME(merge_difference)(KERNEL_TYPE *dataA, int32 sizeA,
+                                                  KERNEL_TYPE *dataB, int32 sizeB, KERNEL_TYPE *result) {
+	int32 i = 0, j = 0, size = 0;
+
+	while (i < sizeA && j < sizeB) {
+		if (dataA[i] < dataB[j]) result[size++] = dataA[i++];
+		else if (dataA[i] > dataB[j]) j++;
+		else {
+			i++;
+			j++;
+		}
+	}
+	memcpy(&result[size], &dataA[i], (sizeA - i) * sizeof(KERNEL_TYPE));
+	size += sizeA - i;
+	return size;
+}
+
+/*
+ * Merge the two sorted arrays, stopping at the first number of setB
+ * missing from setA
+ */
+static inline bool KERNEL_NAME(merge_subset)(KERNEL_TYPE *dataA, int32 sizeA, KERNEL_TYPE *dataB, int32 sizeB) {
+	int32 i = 0, j = 0;
+
+	while (j < sizeB) {
+		if (sizeA - i < sizeB - j) return false;
+		while (i < sizeA && dataA[i] < dataB[j]) i++;
+		if (i == sizeA || dataA[i] != dataB[j]) return false;
+		i++;
+		j++;
+	}
+	return true;
+}
+
+/*
+ * Merge the two sorted arrays, keeping the numbers found in exactly one
+ * of them. result must have room for sizeA + sizeB numbers
+ */
+static inline int32 KERNEL_NAME(get_disjunction)(KERNEL_TYPE *dataA, int32 sizeA,
+                                                 KERNEL_TYPE *dataB, int32 sizeB, KERNEL_TYPE *result) {
+	int32 i = 0, j = 0, size = 0;
+
+	while (i < sizeA && j < sizeB) {
+		if (dataA[i] < dataB[j]) result[size++] = dataA[i++];
+		else if (dataA[i] > dataB[j]) result[size++] = dataB[j++];
+		else {
+			i++;
+			j++;
+		}
+	}
+	memcpy(&result[size], &dataA[i], (sizeA - i) * sizeof(KERNEL_TYPE));
+	size += sizeA - i;
+	memcpy(&result[size], &dataB[j], (sizeB - j) * sizeof(KERNEL_TYPE));
+	size += sizeB - j;
+	return size;
+}
+
+/*
+ * Intersection of the two sorted arrays, looking the numbers of the
+ * smaller one up in the larger one with gallop_search
+ * result must have room for Min(sizeA, sizeB) numbers
+ */
+static inline int32 KERNEL_NAME(gallop_intersection)(KERNEL_TYPE *dataA, int32 sizeA,
+                                                     KERNEL_TYPE *dataB, int32 sizeB, KERNEL_TYPE *result) {
+	KERNEL_TYPE *small = dataA, *large = dataB;
+	int32 smallSize = sizeA, largeSize = sizeB;
+	int32 j = 0, size = 0;
+
+	if (sizeA > sizeB) {
+		small = dataB;
+		large = dataA;
+		smallSize = sizeB;
+		largeSize = sizeA;
+	}
+	// each search resumes where the previous one stopped
+	for (int32 i = 0; i < smallSize && j < largeSize; i++) {
+		j = KERNEL_NAME(gallop_search)(large, largeSize, j, small[i]);
+		if (j < largeSize && large[j] == small[i]) result[size++] = large[j++];
+	}
+	return size;
+}
+
+/*
+ * Size of the intersection of the two sorted arrays, galloping as
+ * gallop_intersection does
+ */
+static inline int32 KERNEL_NAME(gallop_intersection_count)(KERNEL_TYPE *dataA, int32 sizeA,
+                                                           KERNEL_TYPE *dataB, int32 sizeB) {
+	KERNEL_TYPE *small = dataA, *large = dataB;
+	int32 smallSize = sizeA, largeSize = sizeB;
+	int32 j = 0, size = 0;
+
+	if (sizeA > sizeB) {
+		small = dataB;
+		large = dataA;
+		smallSize = sizeB;
+		largeSize = sizeA;
+	}
+	for (int32 i = 0; i < smallSize && j < largeSize; i++) {
+		j = KERNEL_NAME(gallop_search)(large, largeSize, j, small[i]);
+		if (j < largeSize && large[j] == small[i]) {
+			size++;
+			j++;
+		}
+	}
+	return size;
+}
+
+/*
+ * Numbers of setA not in setB, locating the numbers of the smaller array
+ * in the larger one with gallop_search
+ */
+static inline int32 KERNEL_NAME(gallop_difference)(KERNEL_TYPE *dataA, int32 sizeA,
+                                                   KERNEL_TYPE *dataB, int32 sizeB, KERNEL_TYPE *result) {
+	int32 i = 0, j = 0, size = 0;
+
+	if (sizeA <= sizeB) {
+		// look each number of setA up in setB
+		for (; i < sizeA && j < sizeB; i++) {
+			j = KERNEL_NAME(gallop_search)(dataB, sizeB, j, dataA[i]);
+			if (j < sizeB && dataB[j] == dataA[i]) j++;
+			else result[size++] = dataA[i];
+		}
+	} else {
+		// copy the runs of setA between the numbers of setB
+		for (; j < sizeB && i < sizeA; j++) {
+			int32 pos = KERNEL_NAME(gallop_search)(dataA, sizeA, i, dataB[j]);
+
+			memcpy(&result[size], &dataA[i], (pos - i) * sizeof(KERNEL_TYPE));
+			size += pos - i;
+			i = pos;
+			if (i < sizeA && dataA[i] == dataB[j]) i++;
+		}
+	}
+	memcpy(&result[size], &dataA[i], (sizeA - i) * sizeof(KERNEL_TYPE));
+	return size + sizeA - i;
+}
+
+/*
+ * Check whether every number of setB is in setA, looking each one up in
+ * setA with gallop_search
+ */
+static inline bool KERNEL_NAME(gallop_subset)(KERNEL_TYPE *dataA, int32 sizeA, KERNEL_TYPE *dataB, int32 sizeB) {
+	int32 j = 0;
+
+	for (int32 i = 0; i < sizeB; i++) {
+		j = KERNEL_NAME(gallop_search)(dataA, sizeA, j, dataB[i]);
+		if (j == sizeA || dataA[j] != dataB[i]) return false;
+		j++;
+	}
+	return true;
+}
+
+/*
+ * Check whether two sorted arrays share a number, galloping through
+ * whichever one is behind
+ */
+static inline bool KERNEL_NAME(numbers_overlap)(KERNEL_TYPE *dataA, int32 sizeA, KERNEL_TYPE *dataB, int32 sizeB) {
+	int32 i = 0, j = 0;
+
+	while (i < sizeA && j < sizeB) {
+		if (dataA[i] == dataB[j]) return true;
+		if (dataA[i] < dataB[j]) i = KERNEL_NAME(gallop_search)(dataA, sizeA, i, dataB[j]);
+		else j = KERNEL_NAME(gallop_search)(dataB, sizeB, j, dataA[i]);
+	}
+	return false;
+}
+
+#ifdef KERNEL_UNSIGNED
+
+/*
+ * Bits of the element type, and the most bytes one of its varints takes
+ */
+#define KERNEL_BITS ((int) sizeof(KERNEL_TYPE) * 8)
+#define KERNEL_VARINT_MAX ((KERNEL_BITS + 6) / 7)
+
+/*
+ * Convert the optionally negative decimal number at pos, returning the
+ * position just after it
+ */
+static inline char *KERNEL_NAME(parse_number)(char *str, char *pos, KERNEL_TYPE *num) {
+	char *p = pos;
+	bool negative = false;
+	KERNEL_UNSIGNED value = 0, limit;
+
+	if (*p == '-') {
+		negative = true;
+		p++;
+	}
+	if (!isdigit((unsigned char) *p)) report_syntax_error(KERNEL_SET_TYPE, str, p);
+
+	limit = negative ? (KERNEL_UNSIGNED) KERNEL_MAX + 1 : (KERNEL_UNSIGNED) KERNEL_MAX;
+	while (isdigit((unsigned char) *p)) {
+		KERNEL_UNSIGNED digit = *p - '0';
+
+		if (value > (limit - digit) / 10) {
+			while (isdigit((unsigned char) *p)) p++;
+			ereport(ERROR,
+				(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+					errmsg("value \"%.*s\" is out of range for type %s",
+						(int) (p - pos), pos, KERNEL_SQL_TYPE),
+					errdetail("Number starts at position %d of \"%s\".",
+						(int) (pos - str) + 1, str)));
+		}
+		value = value * 10 + digit;
+		p++;
+	}
+	*num = negative ? (KERNEL_TYPE) (0 - value) : (KERNEL_TYPE) value;
+	return p;
+}
+
+/*
+ * Parse a set literal such as "{3, -1, 2}" in a single pass into data,
+ * which needs room for strlen(str) / 2 + 1 numbers, since every number
+ * takes at least one digit and one separator. Returns the count of
+ * numbers, unsorted unless *sorted is set and possibly repeated
+ */
+static inline int32 KERNEL_NAME(parse_numbers)(char *str, KERNEL_TYPE *data, bool *sorted) {
+	char *p = str;
+	int32 size = 0;
+
+	*sorted = true;
+	while (isspace((unsigned char) *p)) p++;
+	if (*p != '{') report_syntax_error(KERNEL_SET_TYPE, str, p);
+	p++;
+	while (isspace((unsigned char) *p)) p++;
+
+	if (*p != '}') {
+		for (;;) {
+			p = KERNEL_NAME(parse_number)(str, p, &data[size]);
+			if (size > 0 && data[size] < data[size - 1]) *sorted = false;
+			size++;
+
+			while (isspace((unsigned char) *p)) p++;
+			if (*p == '}') break;
+			if (*p != ',') report_syntax_error(KERNEL_SET_TYPE, str, p);
+			p++;
+			while (isspace((unsigned char) *p)) p++;
+		}
+	}
+	p++;
+	while (isspace((unsigned char) *p)) p++;
+	if (*p != '\0') report_syntax_error(KERNEL_SET_TYPE, str, p);
+	return size;
+}
+
+/*
+ * Count the digits of the absolute value of the integer
+ */
+static inline int32 KERNEL_NAME(count_digits)(KERNEL_UNSIGNED value) {
+	int32 digits = 1;
+
+	while (digits < 20 && value >= powers_of_ten[digits]) digits++;
+	return digits;
+}
+
+/*
+ * Count the characters needed to print the integer, sign included
+ */
+static inline int32 KERNEL_NAME(get_num_length)(KERNEL_TYPE num) {
+	if (num < 0) return 1 + KERNEL_NAME(count_digits)(0 - (KERNEL_UNSIGNED) num);
+	return KERNEL_NAME(count_digits)(num);
+}
+
+/*
+ * Write the integer at str without a terminator, returning the position
+ * just after its last digit
+ */
+static inline char *KERNEL_NAME(write_number)(char *str, KERNEL_TYPE num) {
+	KERNEL_UNSIGNED value = num;
+	char *end;
+
+	if (num < 0) {
+		*str++ = '-';
+		value = 0 - (KERNEL_UNSIGNED) num;
+	}
+	end = str + KERNEL_NAME(count_digits)(value);
+
+	// fill the digits in from the right
+	str = end;
+	while (value >= 100) {
+		uint32 pair = (value % 100) * 2;
+
+		value /= 100;
+		str -= 2;
+		str[0] = digit_pairs[pair];
+		str[1] = digit_pairs[pair + 1];
+	}
+	if (value >= 10) {
+		str[-2] = digit_pairs[value * 2];
+		str[-1] = digit_pairs[value * 2 + 1];
+	} else {
+		str[-1] = '0' + value;
+	}
+	return end;
+}
+
+/*
+ * Convert the sorted numbers to the text of a set
+ * The exact length is computed first so the output takes one palloc
+ * and every character is written once
+ */
+static inline char *KERNEL_NAME(to_string)(KERNEL_TYPE *data, int32 size) {
+	char *str, *p;
+	int64 len = 2 + 1; // braces and terminator
+
+	if (size > 0) len += size - 1; // commas
+	for (int i = 0; i < size; i++) {
+		len += KERNEL_NAME(get_num_length)(data[i]);
+	}
+	if (len > MaxAllocSize)
+		ereport(ERROR,
+			(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				errmsg("%s of %d elements is too large to print", KERNEL_SET_TYPE, size)));
+
+	str = palloc(len);
+	p = str;
+	*p++ = '{';
+	for (int i = 0; i < size; i++) {
+		if (i > 0) *p++ = ',';
+		p = KERNEL_NAME(write_number)(p, data[i]);
+	}
+	*p++ = '}';
+	*p = '\0';
+	return str;
+}
+
+/*
+ * Write value as a LEB128 varint, seven bits per byte with the high bit
+ * marking that more bytes follow
+ */
+static inline char *KERNEL_NAME(encode_varint)(char *p, KERNEL_UNSIGNED value) {
+	while (value >= 0x80) {
+		*p++ = (char) (value | 0x80);
+		value >>= 7;
+	}
+	*p++ = (char) value;
+	return p;
+}
+
+/*
+ * Read a varint written by encode_varint, without going past end
+ */
+static inline char *KERNEL_NAME(decode_varint)(char *p, char *end, KERNEL_UNSIGNED *value) {
+	KERNEL_UNSIGNED result = 0;
+
+	for (int shift = 0; shift < KERNEL_BITS; shift += 7) {
+		uint8 byte;
+
+		if (p == end)
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+					errmsg("insufficient data left in external %s value", KERNEL_SET_TYPE)));
+		byte = (uint8) *p++;
+		// the last byte only has room for the bits left, and no more bytes
+		if (shift + 7 > KERNEL_BITS && (byte >> (KERNEL_BITS - shift)) != 0)
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+					errmsg("invalid varint in external %s value", KERNEL_SET_TYPE)));
+		result |= (KERNEL_UNSIGNED) (byte & 0x7F) << shift;
+		if (!(byte & 0x80)) break;
+	}
+	*value = result;
+	return p;
+}
+
+/*
+ * Send the sorted numbers as the element count followed by one varint
+ * per element: the first element zigzag encoded, then each gap to the
+ * previous element minus one
+ */
+static inline bytea *KERNEL_NAME(send_numbers)(KERNEL_TYPE *data, int32 size) {
+	StringInfoData buf;
+	char *p;
+
+	pq_begintypsend(&buf);
+	pq_sendint32(&buf, size);
+
+	enlargeStringInfo(&buf, size * KERNEL_VARINT_MAX);
+	p = &buf.data[buf.len];
+	for (int i = 0; i < size; i++) {
+		if (i == 0)
+			p = KERNEL_NAME(encode_varint)(p, ((KERNEL_UNSIGNED) data[0] << 1)
+												^ (KERNEL_UNSIGNED) (data[0] >> (KERNEL_BITS - 1)));
+		else
+			p = KERNEL_NAME(encode_varint)(p, (KERNEL_UNSIGNED) data[i] - (KERNEL_UNSIGNED) data[i - 1] - 1);
+	}
+	buf.len = p - buf.data;
+	buf.data[buf.len] = '\0';
+	return pq_endtypsend(&buf);
+}
+
+/*
+ * Read the element count written by send_numbers
+ */
+static inline int32 KERNEL_NAME(recv_count)(StringInfo buf) {
+	int32 size = pq_getmsgint(buf, 4);
+
+	// every element takes at least one byte
+	if (size < 0 || size > buf->len - buf->cursor)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				errmsg("invalid element count %d in external %s value", size, KERNEL_SET_TYPE)));
+	return size;
+}
+
+/*
+ * Read the size numbers written by send_numbers into data. They come out
+ * sorted and duplicate free, since every gap is positive
+ */
+static inline void KERNEL_NAME(recv_numbers)(StringInfo buf, KERNEL_TYPE *data, int32 size) {
+	char *p = &buf->data[buf->cursor];
+	char *end = &buf->data[buf->len];
+
+	for (int i = 0; i < size; i++) {
+		KERNEL_UNSIGNED value;
+
+		p = KERNEL_NAME(decode_varint)(p, end, &value);
+		if (i == 0) {
+			data[0] = (KERNEL_TYPE) ((value >> 1) ^ (0 - (value & 1)));
+			continue;
+		}
+		// the gap plus one has to fit between the previous element and the largest
+		if (value >= (KERNEL_UNSIGNED) KERNEL_MAX - (KERNEL_UNSIGNED) data[i - 1])
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+					errmsg("element %d of external %s value is out of range", i + 1, KERNEL_SET_TYPE)));
+		data[i] = (KERNEL_TYPE) ((KERNEL_UNSIGNED) data[i - 1] + 1 + value);
+	}
+	buf->cursor = p - buf->data;
+}
+
+#undef KERNEL_BITS
+#undef KERNEL_VARINT_MAX
+#endif							/* KERNEL_UNSIGNED */
+
+#undef KERNEL_TYPE
+#undef KERNEL_NAME
+#undef KERNEL_UNSIGNED
+#undef KERNEL_MAX
+#undef KERNEL_SQL_TYPE
+#undef KERNEL_SET_TYPE
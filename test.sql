@@ -3,6 +3,7 @@ insert into mySets values (1, '{1,2,3}');
 insert into mySets values (2, '{1,3,1,3,1}');
 insert into mySets values (3, '{3,4,5}');
 insert into mySets values (4, '{4,5}');
+insert into mySets values (5, '{ -1, -2147483648, 2147483647 }');
 select * from mySets order by id;
 select a.*, b.* from mySets a, mySets b where (b.iset @< a.iset) and a.id != b.id;
 update mySets set iset = iset || '{5,6,7,8}' where id = 4;
@@ -24,12 +25,270 @@ insert into mySets values (5, '{1, 2, 3, 4, five}');
 insert into mySets values (6, '{ 1 2 3 4 }');
 insert into mySets values (7, ' 1 2 3 4 ');
 insert into mySets values (8, ' 1 2 3 4 }');
-insert into mySets values (9, '{ -1 }');
+insert into mySets values (9, '{2147483648}');
 insert into mySets values (10, '{1,2,3 ');
 insert into mySets values (11, '1,2,3,4,5');
 insert into mySets values (12, '{{1,2,3,5}');
 insert into mySets values (13, '{7,17,,27,37}');
 insert into mySets values (14, '{1,2,3,5,8,}');
+insert into mySets values (15, '{-2147483649}');
+insert into mySets values (16, '{1, 99999999999999999999}');
+insert into mySets values (17, '{1, 2, é}');
 
 
 
+
+create temp table bigSets (id int, iset intSet);
+insert into bigSets select 1, ('{' || string_agg(i::text, ',') || '}')::intSet from generate_series(1, 127 * 7, 7) i;
+insert into bigSets select 2, ('{' || string_agg(i::text, ',') || '}')::intSet from generate_series(1, 128 * 7, 7) i;
+insert into bigSets select 3, ('{' || string_agg((i * 9973)::text, ',') || '}')::intSet from generate_series(0, 999) i;
+insert into bigSets select 4, ('{' || string_agg(i::text, ',') || '}')::intSet from generate_series(1, 5000) i;
+insert into bigSets select 5, ('{' || string_agg(i::text, ',') || '}')::intSet from generate_series(1, 20000) i where i % 3 <> 0;
+insert into bigSets select 6, ('{' || string_agg(i::text, ',') || '}')::intSet from generate_series(60000, 70000) i;
+insert into bigSets select 7, ('{' || string_agg(i::text, ',') || '}')::intSet from generate_series(65000, 140000, 2) i;
+insert into bigSets values (8, '{}');
+select id, (#iset) as card from bigSets order by id;
+
+create temp table opResults as
+ select a.id as idA, b.id as idB, a.iset || b.iset as u, a.iset && b.iset as i, a.iset - b.iset as d,
+        a.iset !! b.iset as x, a.iset >@ b.iset as sup, a.iset @< b.iset as sub, a.iset ?| b.iset as ovl,
+        a.iset = b.iset as eq, intset_intersection_count(a.iset, b.iset) as cnt
+ from bigSets a, bigSets b;
+set intset.force_scalar = on;
+select r.idA, r.idB from opResults r, bigSets a, bigSets b
+ where a.id = r.idA and b.id = r.idB
+   and (r.u <> (a.iset || b.iset) or r.i <> (a.iset && b.iset) or r.d <> (a.iset - b.iset)
+    or r.x <> (a.iset !! b.iset) or r.sup <> (a.iset >@ b.iset) or r.sub <> (a.iset @< b.iset)
+    or r.ovl <> (a.iset ?| b.iset) or r.eq <> (a.iset = b.iset)
+    or r.cnt <> intset_intersection_count(a.iset, b.iset));
+reset intset.force_scalar;
+
+copy bigSets to '/tmp/intset_test.bin' with (format binary);
+create temp table bigSetsCopy (like bigSets);
+copy bigSetsCopy from '/tmp/intset_test.bin' with (format binary);
+select a.id from bigSets a join bigSetsCopy b using (id) where a.iset <> b.iset or a.iset::text <> b.iset::text;
+
+select id, (#iset) as card, pg_column_size(iset) < 8 + 4 * (#iset) as compressed from bigSets order by id;
+select id from bigSets where iset::text::intSet <> iset or iset::text::intSet::text <> iset::text;
+
+create temp view bigElements as
+ select id, unnest(string_to_array(trim(both '{}' from iset::text), ',')::int4[]) as num from bigSets;
+select a.id, b.id from bigSets a, bigSets b
+ where (a.iset || b.iset)::text <> (select '{' || coalesce(string_agg(num::text, ',' order by num), '') || '}'
+        from (select num from bigElements where id = a.id union select num from bigElements where id = b.id) n)
+    or (a.iset && b.iset)::text <> (select '{' || coalesce(string_agg(num::text, ',' order by num), '') || '}'
+        from (select num from bigElements where id = a.id intersect select num from bigElements where id = b.id) n)
+    or (a.iset - b.iset)::text <> (select '{' || coalesce(string_agg(num::text, ',' order by num), '') || '}'
+        from (select num from bigElements where id = a.id except select num from bigElements where id = b.id) n)
+    or (a.iset !! b.iset) <> ((a.iset || b.iset) - (a.iset && b.iset))
+    or (a.iset >@ b.iset) <> (not exists (select num from bigElements where id = b.id except select num from bigElements where id = a.id))
+    or (a.iset @< b.iset) <> (b.iset >@ a.iset)
+    or (a.iset ?| b.iset) <> ((#(a.iset && b.iset)) > 0);
+
+create temp table idxSets (id int, iset intSet);
+insert into idxSets
+ select g, ('{' || coalesce(string_agg(((g * 7 + k * 13) % 1000)::text, ','), '') || '}')::intSet
+ from generate_series(1, 5000) g left join lateral generate_series(1, g % 70) k on true group by g;
+insert into idxSets
+ select 5000 + g, ('{' || string_agg(k::text, ',') || '}')::intSet
+ from generate_series(1, 20) g, lateral generate_series(g * 50, g * 50 + g * 100) k group by g;
+create temp table idxQueries (qid int, q intSet);
+insert into idxQueries values (1, '{}'), (2, '{42}'), (3, '{13,26}'), (4, '{1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16}');
+insert into idxQueries select 5, iset from idxSets where id = 777;
+insert into idxQueries select 6, iset from idxSets where id = 5012;
+insert into idxQueries select 7, ('{' || string_agg(k::text, ',') || '}')::intSet from generate_series(0, 999) k;
+create temp view idxMatches as
+ select 1 as op, q.qid, s.id from idxQueries q join idxSets s on s.iset >@ q.q
+ union all select 2, q.qid, s.id from idxQueries q join idxSets s on s.iset @< q.q
+ union all select 3, q.qid, s.id from idxQueries q join idxSets s on s.iset = q.q
+ union all select 4, q.qid, s.id from idxQueries q join idxSets s on s.iset ?| q.q
+ union all select 5, q.qid, s.id from idxQueries q join idxSets s on s.iset ? intset_min(q.q)
+ union all select 6, 0, id from idxSets where 42 ? iset;
+create temp table seqMatches as select * from idxMatches;
+select op, count(*) from seqMatches group by op order by op;
+
+create index idxSets_gin on idxSets using gin (iset);
+set enable_seqscan = off;
+explain (costs off) select id from idxSets where 42 ? iset;
+create temp table ginMatches as select * from idxMatches;
+reset enable_seqscan;
+(select * from seqMatches except select * from ginMatches) union all (select * from ginMatches except select * from seqMatches);
+drop index idxSets_gin;
+
+insert into idxSets select 5021, ('{' || string_agg(k::text, ',') || '}')::intSet from generate_series(0, 19999) k;
+drop table seqMatches;
+create temp table seqMatches as select * from idxMatches;
+create index idxSets_gist on idxSets using gist (iset gist_intset_ops);
+set enable_seqscan = off;
+explain (costs off) select id from idxSets where iset >@ '{13,26}';
+create temp table gistMatches as select * from idxMatches;
+reset enable_seqscan;
+(select * from seqMatches except select * from gistMatches) union all (select * from gistMatches except select * from seqMatches);
+
+select a.id, b.id from bigSets a, bigSets b
+ where (a.iset < b.iset) <> (string_to_array(trim(both '{}' from a.iset::text), ',')::int4[] < string_to_array(trim(both '{}' from b.iset::text), ',')::int4[])
+    or (a.iset <= b.iset) <> (not (a.iset > b.iset)) or (a.iset >= b.iset) <> (b.iset <= a.iset);
+select count(*) from (select row_number() over (order by iset, id) as bySet,
+                             row_number() over (order by string_to_array(trim(both '{}' from iset::text), ',')::int4[], id) as byArray
+                      from idxSets) o
+ where bySet <> byArray;
+create index idxSets_btree on idxSets (iset);
+set enable_seqscan = off;
+select s.id from idxQueries q join idxSets s on s.iset = q.q order by q.qid, s.id;
+select count(*) from idxSets where iset < (select q from idxQueries where qid = 5);
+reset enable_seqscan;
+select count(*) from idxSets where iset < (select q from idxQueries where qid = 5);
+drop index idxSets_btree;
+
+create index idxSets_hash on idxSets using hash (iset);
+set enable_seqscan = off;
+set enable_bitmapscan = off;
+select s.id from idxQueries q join idxSets s on s.iset = q.q order by q.qid, s.id;
+reset enable_bitmapscan;
+reset enable_seqscan;
+drop index idxSets_hash;
+set enable_sort = off;
+create temp table hashGroups as select iset, count(*) as n from idxSets group by iset;
+reset enable_sort;
+set enable_hashagg = off;
+select count(*) from (select iset, count(*) as n from idxSets group by iset except select * from hashGroups) d;
+reset enable_hashagg;
+
+create table aggSets (grp int, iset intSet);
+insert into aggSets select id % 7, iset from idxSets;
+insert into aggSets select 100, iset || '{5,500,999}' from idxSets where id % 3 = 0;
+insert into aggSets values (101, '{1,2,3}');
+set max_parallel_workers_per_gather = 0;
+create temp table serialAggs as
+ select grp, intset_union_agg(iset) as u, intset_intersect_agg(iset) as i from aggSets group by grp;
+insert into serialAggs select null, intset_union_agg(iset), intset_intersect_agg(iset) from aggSets where grp in (100, 101);
+insert into serialAggs select -1, intset_union_agg(iset), intset_intersect_agg(iset) from aggSets where grp = 101;
+select grp, (#u) as unionCard, i from serialAggs order by grp;
+reset max_parallel_workers_per_gather;
+set parallel_setup_cost = 0;
+set parallel_tuple_cost = 0;
+set min_parallel_table_scan_size = 0;
+explain (costs off) select grp, intset_union_agg(iset), intset_intersect_agg(iset) from aggSets group by grp;
+select s.grp from serialAggs s
+ left join (select grp, intset_union_agg(iset) as u, intset_intersect_agg(iset) as i from aggSets group by grp) p using (grp)
+ where s.grp >= 0 and (p.u is distinct from s.u or p.i is distinct from s.i);
+select s.grp from serialAggs s, (select intset_union_agg(iset) as u, intset_intersect_agg(iset) as i from aggSets where grp in (100, 101)) p
+ where s.grp is null and (p.u is distinct from s.u or p.i is distinct from s.i);
+select s.grp from serialAggs s, (select intset_union_agg(iset) as u, intset_intersect_agg(iset) as i from aggSets where grp = 101) p
+ where s.grp = -1 and (p.u is distinct from s.u or p.i is distinct from s.i);
+reset parallel_setup_cost;
+reset parallel_tuple_cost;
+reset min_parallel_table_scan_size;
+drop table aggSets;
+
+select id from bigSets b where iset <> coalesce((select intset_agg(num) from bigElements e where e.id = b.id), '{}');
+select intset_agg(k % 1000) = (select intset_agg(k) from generate_series(0, 999) k) from generate_series(1, 1000000) k;
+select k % 3, (#intset_agg(k * 7 % 100003)) from generate_series(1, 300000) k group by k % 3 order by 1;
+select intset_agg(null::int4) is null;
+
+select b.id from bigSets b
+ where (select count(*) from intset_elements(b.iset)) <> (#b.iset)
+    or (select '{' || coalesce(string_agg(n::text, ',' order by o), '') || '}'
+        from intset_elements(b.iset) with ordinality as e(n, o)) <> b.iset::text;
+explain select * from intset_elements('{1,2,3}');
+select n from idxSets, intset_elements(iset) n where id = 777 order by 1;
+
+select '{1,2,3}'::intSet <-> '{2,3,4}', '{1,2,3}'::intSet % '{2,3,4}', intset_jaccard('{1,2,3}', '{2,3,4}');
+create temp view similarMatches as
+ select current_setting('intset.similarity_threshold')::float8 as threshold, q.qid, s.id
+ from idxQueries q join idxSets s on s.iset % q.q;
+create temp view nearest as
+ select q.qid, array(select s.iset <-> q.q from idxSets s order by s.iset <-> q.q limit 30) as distances from idxQueries q;
+set enable_indexscan = off;
+set enable_bitmapscan = off;
+create temp table seqSimilar as select * from similarMatches;
+set intset.similarity_threshold = 0;
+insert into seqSimilar select * from similarMatches;
+set intset.similarity_threshold = 0.9;
+insert into seqSimilar select * from similarMatches;
+create temp table seqNearest as select * from nearest;
+reset enable_indexscan;
+reset enable_bitmapscan;
+select threshold, count(*) from seqSimilar group by threshold order by threshold;
+
+set enable_seqscan = off;
+explain (costs off) select id from idxSets order by iset <-> '{13,26}' limit 5;
+reset intset.similarity_threshold;
+create temp table gistSimilar as select * from similarMatches;
+set intset.similarity_threshold = 0;
+insert into gistSimilar select * from similarMatches;
+set intset.similarity_threshold = 0.9;
+insert into gistSimilar select * from similarMatches;
+select n.qid from seqNearest n join nearest i using (qid) where n.distances <> i.distances;
+drop index idxSets_gist;
+create index idxSets_gin on idxSets using gin (iset);
+reset intset.similarity_threshold;
+create temp table ginSimilar as select * from similarMatches;
+set intset.similarity_threshold = 0;
+insert into ginSimilar select * from similarMatches;
+set intset.similarity_threshold = 0.9;
+insert into ginSimilar select * from similarMatches;
+reset intset.similarity_threshold;
+reset enable_seqscan;
+drop index idxSets_gin;
+(select * from seqSimilar except select * from gistSimilar) union all (select * from gistSimilar except select * from seqSimilar);
+(select * from seqSimilar except select * from ginSimilar) union all (select * from ginSimilar except select * from seqSimilar);
+
+select id from bigSets where iset::int4[]::intSet <> iset or iset::int4[] <> string_to_array(trim(both '{}' from iset::text), ',')::int4[];
+select '{3,1,2,3}'::int4[]::intSet, '{}'::int4[]::intSet, '{}'::intSet::int4[];
+select '{{1,2},{3,4}}'::int4[]::intSet;
+select '{1,null}'::int4[]::intSet;
+select a.id, b.id from bigSets a, bigSets b
+ where (a.iset >@ b.iset::int4[]) <> (a.iset >@ b.iset) or (b.iset::int4[] @< a.iset) <> (b.iset @< a.iset)
+    or (a.iset ?| b.iset::int4[]) <> (a.iset ?| b.iset) or (b.iset::int4[] ?| a.iset) <> (b.iset ?| a.iset);
+select '{5,1,5}'::intSet >@ '{1,5,5}'::int4[], '{1,5,5}'::int4[] @< '{5,1}'::intSet, '{7,1}'::int4[] ?| '{1}'::intSet;
+
+create temp table bigInts (id int, iset bigintset);
+insert into bigInts values (1, '{}'), (2, '{1, 65536}'), (3, '{0, 65536}'), (4, '{-5, 4294967290}'), (5, '{-5, 4294967291}'),
+ (6, '{-9223372036854775808, 0, 9223372036854775807}'), (7, '{65535, 65536, 65537}'), (8, '{4294967295, 4294967296}');
+insert into bigInts select 9, ('{' || string_agg((4294967000 + k * 3)::text, ',') || '}')::bigintset from generate_series(0, 499) k;
+insert into bigInts select 10, ('{' || string_agg((k * 10000000000)::text, ',') || '}')::bigintset from generate_series(-500, 500) k;
+insert into bigInts values (11, '{20000000000}'), (12, '{4294967003, 4294967006}'), (13, '{0, 10000000000, 4294967000}');
+select id, (#iset) as card, bigintset_min(iset), bigintset_max(iset),
+       (pg_column_size(iset::text::bigintset) - 24) / nullif(#iset, 0) as width
+ from bigInts order by id;
+select '{9223372036854775808}'::bigintset;
+select '{-9223372036854775809}'::bigintset;
+select id from bigInts where iset::text::bigintset <> iset or iset::text::bigintset::text <> iset::text;
+copy bigInts to '/tmp/bigintset_test.bin' with (format binary);
+create temp table bigIntsCopy (like bigInts);
+copy bigIntsCopy from '/tmp/bigintset_test.bin' with (format binary);
+select a.id from bigInts a join bigIntsCopy b using (id) where a.iset <> b.iset or a.iset::text <> b.iset::text;
+
+create temp view bigIntElements as
+ select id, unnest(string_to_array(trim(both '{}' from iset::text), ',')::int8[]) as num from bigInts;
+select a.id, b.id from bigInts a, bigInts b
+ where (a.iset || b.iset)::text <> (select '{' || coalesce(string_agg(num::text, ',' order by num), '') || '}'
+        from (select num from bigIntElements where id = a.id union select num from bigIntElements where id = b.id) n)
+    or (a.iset && b.iset)::text <> (select '{' || coalesce(string_agg(num::text, ',' order by num), '') || '}'
+        from (select num from bigIntElements where id = a.id intersect select num from bigIntElements where id = b.id) n)
+    or (a.iset - b.iset)::text <> (select '{' || coalesce(string_agg(num::text, ',' order by num), '') || '}'
+        from (select num from bigIntElements where id = a.id except select num from bigIntElements where id = b.id) n)
+    or (a.iset !! b.iset) <> ((a.iset || b.iset) - (a.iset && b.iset))
+    or (a.iset >@ b.iset) <> (not exists (select num from bigIntElements where id = b.id except select num from bigIntElements where id = a.id))
+    or (a.iset @< b.iset) <> (b.iset >@ a.iset)
+    or (a.iset ?| b.iset) <> ((#(a.iset && b.iset)) > 0)
+    or (a.iset < b.iset) <> (string_to_array(trim(both '{}' from a.iset::text), ',')::int8[] < string_to_array(trim(both '{}' from b.iset::text), ',')::int8[]);
+select e.id, e.num from bigIntElements e join bigInts b using (id) where not (e.num ? b.iset) or not (b.iset ? e.num) limit 5;
+
+select id from bigSets where iset::bigintset::intSet <> iset or iset::bigintset::text <> iset::text;
+select '{-2147483648, 2147483647}'::bigintset::intSet;
+select '{1, 2147483648}'::bigintset::intSet;
+select '{-2147483649, 1}'::bigintset::intSet;
+
+create index bigInts_btree on bigInts (iset);
+create index bigInts_hash on bigInts using hash (iset);
+set enable_seqscan = off;
+select a.id, b.id from bigInts a join bigInts b on a.iset = b.iset where a.id <> b.id;
+select id from bigInts where iset = '{0, 65536}' order by id;
+select id from bigInts order by iset, id;
+reset enable_seqscan;
+select id from bigInts order by iset, id;
+set enable_sort = off;
+select count(*) from (select iset from bigInts union select iset from bigIntsCopy) u;
+reset enable_sort;